@@ -9,3 +9,27 @@ Define.Executable
 	LinkFlags = '-lfuse -pthread -lluxem-cxx',
 }
 
+
+Define.Executable
+{
+	Name = 'clunker_explore',
+	Sources = Item() + 'explore.cxx',
+	Objects = Item() + FilesystemObjects,
+	LinkFlags = '-pthread -lluxem-cxx',
+}
+
+Define.Executable
+{
+	Name = 'clunker_traced',
+	Sources = Item() + 'main_traced.cxx',
+	Objects = Item() + FilesystemObjects,
+	BuildFlags = '-D_FILE_OFFSET_BITS=64 -I/usr/include/fuse',
+	LinkFlags = '-lfuse -pthread -lluxem-cxx',
+}
+
+Define.Executable
+{
+	Name = 'clunker_trace',
+	Sources = Item() + 'trace_convert.cxx',
+	LinkFlags = '-pthread',
+}
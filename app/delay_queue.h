@@ -0,0 +1,160 @@
+#ifndef delay_queue_h
+#define delay_queue_h
+
+#include <mutex>
+#include <array>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <condition_variable>
+
+#include "../ren-cxx-basics/function.h"
+
+// Runs jobs after a delay, using a hashed timer wheel with millisecond ticks:
+// adding is constant time and each tick only looks at its own slot.  A timer
+// thread hands due jobs to a few workers, so a slow job doesn't hold back the
+// ones due after it.  At most Limit jobs, holding at most ByteLimit bytes,
+// wait or run at once, so memory stays bounded.
+struct DelayQueueT
+{
+	typedef std::chrono::steady_clock ClockT;
+
+	DelayQueueT(size_t Limit, size_t ByteLimit, size_t Workers) :
+		Limit(Limit), ByteLimit(ByteLimit), WorkerCount(std::max<size_t>(Workers, 1)),
+		Die(false), Waiting(0), Held(0), HeldBytes(0), Current(0) {}
+
+	DelayQueueT(DelayQueueT const &) = delete;
+
+	~DelayQueueT(void) { Stop(); }
+
+	void Start(void)
+	{
+		Epoch = ClockT::now();
+		Timer = std::thread([this](void) { Run(); });
+		for (size_t Index = 0; Index < WorkerCount; ++Index)
+			Workers.emplace_back([this](void) { Work(); });
+	}
+
+	// Jobs still waiting are dropped
+	void Stop(void)
+	{
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			Die = true;
+		}
+		Condition.notify_all();
+		WorkCondition.notify_all();
+		if (Timer.joinable()) Timer.join();
+		for (auto &Worker : Workers) Worker.join();
+		Workers.clear();
+	}
+
+	// Bytes is what the job holds until it runs.  False if the queue is full
+	// or stopped, in which case the job isn't kept.
+	bool Add(std::chrono::nanoseconds Delay, size_t Bytes, function<void(void)> &&Job)
+	{
+		auto Due = TickOf(ClockT::now() + Delay) + 1;
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			if (Die || !Timer.joinable() || (Held >= Limit) || (HeldBytes + Bytes > ByteLimit)) return false;
+			Due = std::max(Due, Current);
+			Wheel[Due % Wheel.size()].push_back({Due, Bytes, std::move(Job)});
+			Waiting += 1;
+			Held += 1;
+			HeldBytes += Bytes;
+		}
+		Condition.notify_one();
+		return true;
+	}
+
+	private:
+		static constexpr size_t Slots = 1024;
+
+		struct EntryT
+		{
+			uint64_t Due;
+			size_t Bytes;
+			function<void(void)> Job;
+		};
+
+		uint64_t TickOf(ClockT::time_point Time) const
+		{
+			return std::chrono::duration_cast<std::chrono::milliseconds>(Time - Epoch).count();
+		}
+
+		void Run(void)
+		{
+			std::unique_lock<std::mutex> Guard(Mutex);
+			while (!Die)
+			{
+				auto const Now = TickOf(ClockT::now());
+				// Nothing to find in the ticks passed while idle
+				if (Waiting == 0) Current = Now + 1;
+				size_t Found = 0;
+				for (; Current <= Now; ++Current)
+				{
+					auto &Slot = Wheel[Current % Wheel.size()];
+					// Entries more than a turn of the wheel away stay
+					for (size_t Index = 0; Index < Slot.size();)
+					{
+						if (Slot[Index].Due > Current) { ++Index; continue; }
+						Ready.push_back(std::move(Slot[Index]));
+						Slot[Index] = std::move(Slot.back());
+						Slot.pop_back();
+						Found += 1;
+					}
+				}
+				if (Found)
+				{
+					Waiting -= Found;
+					WorkCondition.notify_all();
+				}
+				if (Waiting == 0) Condition.wait(Guard);
+				else Condition.wait_until(Guard, Epoch + std::chrono::milliseconds(Current));
+			}
+		}
+
+		void Work(void)
+		{
+			std::unique_lock<std::mutex> Guard(Mutex);
+			while (true)
+			{
+				WorkCondition.wait(Guard, [this](void) { return Die || !Ready.empty(); });
+				if (Die) return;
+				size_t Bytes = 0;
+				{
+					// Freed before the bytes are given back
+					auto Entry = std::move(Ready.front());
+					Ready.pop_front();
+					Bytes = Entry.Bytes;
+					Guard.unlock();
+					Entry.Job();
+				}
+				Guard.lock();
+				Held -= 1;
+				HeldBytes -= Bytes;
+			}
+		}
+
+		size_t const Limit;
+		size_t const ByteLimit;
+		size_t const WorkerCount;
+		std::mutex Mutex;
+		std::condition_variable Condition;
+		std::condition_variable WorkCondition;
+		bool Die;
+		// On the wheel, and on the wheel or not yet finished
+		size_t Waiting;
+		size_t Held;
+		size_t HeldBytes;
+		uint64_t Current;
+		ClockT::time_point Epoch;
+		std::array<std::vector<EntryT>, Slots> Wheel;
+		std::deque<EntryT> Ready;
+		std::thread Timer;
+		std::vector<std::thread> Workers;
+};
+
+#endif
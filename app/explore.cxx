@@ -0,0 +1,305 @@
+#include "../ren-cxx-basics/error.h"
+#include "asio_utils.h"
+#include "test/client.h"
+
+#include <set>
+#include <sstream>
+#include <mutex>
+#include <atomic>
+#include <limits>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Crash point explorer: runs a workload once for every failure countdown it
+// can reach and reports the countdowns after which the checker fails.  Each
+// worker owns a clunker mount; the setup runs there once and is snapshotted,
+// and each run restores the snapshot instead of starting over.
+
+struct CommandsT
+{
+	std::string Setup;
+	std::string Workload;
+	std::string Checker;
+	// Lose unsynced changes before checking, as if the failure were a crash
+	bool Crash;
+};
+
+// Shared between workers
+struct ExplorationT
+{
+	// The next countdown to try
+	std::atomic<int64_t> Next;
+	// The smallest countdown the workload finished within; it and everything
+	// above it run without failures, so there's nothing more to find
+	std::atomic<int64_t> Limit;
+
+	std::mutex Mutex;
+	std::set<int64_t> Failures;
+
+	ExplorationT(void) : Next(0), Limit(std::numeric_limits<int64_t>::max()) {}
+
+	void Finished(int64_t Count)
+	{
+		auto Current = Limit.load();
+		while ((Count < Current) && !Limit.compare_exchange_weak(Current, Count)) {}
+	}
+
+	void Failed(int64_t Count)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		Failures.insert(Count);
+	}
+};
+
+// Runs a shell command in Directory and returns its exit status, or 128 plus
+// the signal that killed it
+int RunCommand(std::string const &Directory, std::string const &Command, int64_t Count)
+{
+	if (Command.empty()) return 0;
+	auto const Child = fork();
+	if (Child < 0) throw SystemErrorT() << "Failed to fork for [" << Command << "]: " << strerror(errno);
+	if (Child == 0)
+	{
+		if (chdir(Directory.c_str()) != 0) _exit(127);
+		setenv("CLUNKER_FAIL_AT", std::to_string(Count).c_str(), 1);
+		execl("/bin/sh", "sh", "-c", Command.c_str(), static_cast<char *>(nullptr));
+		_exit(127);
+	}
+	int Status = 0;
+	while (waitpid(Child, &Status, 0) < 0)
+		if (errno != EINTR) throw SystemErrorT() << "Failed to wait for [" << Command << "]: " << strerror(errno);
+	if (WIFSIGNALED(Status)) return 128 + WTERMSIG(Status);
+	return WEXITSTATUS(Status);
+}
+
+struct WorkerT
+{
+	WorkerT(
+		std::string const &Clunker,
+		std::string const &Mount,
+		uint16_t Port,
+		CommandsT const &Commands,
+		ExplorationT &Exploration) :
+		Mount(Mount),
+		Endpoint(asio::ip::address_v4::loopback(), Port),
+		Commands(Commands),
+		Exploration(Exploration)
+	{
+		Process = fork();
+		if (Process < 0) throw SystemErrorT() << "Failed to fork for clunker: " << strerror(errno);
+		if (Process == 0)
+		{
+			setenv("CLUNKER_PORT", std::to_string(Port).c_str(), 1);
+			execl(Clunker.c_str(), Clunker.c_str(), Mount.c_str(), static_cast<char *>(nullptr));
+			_exit(127);
+		}
+	}
+
+	WorkerT(WorkerT const &) = delete;
+
+	~WorkerT(void)
+	{
+		Join();
+		kill(Process, SIGTERM);
+		int Status;
+		while ((waitpid(Process, &Status, 0) < 0) && (errno == EINTR)) {}
+	}
+
+	void Start(void)
+	{
+		Thread = std::thread([this](void)
+		{
+			try
+			{
+				WaitForMount();
+				ConnectClunker(Service, Endpoint, [this](std::shared_ptr<ClunkerControlT> NewControl)
+				{
+					Control = std::move(NewControl);
+					Prepare();
+				});
+				Service.run();
+			}
+			catch (UserErrorT const &Error) { Fail(Error); }
+			catch (SystemErrorT const &Error) { Fail(Error); }
+			catch (ConstructionErrorT const &Error) { Fail(Error); }
+			catch (std::runtime_error const &Error) { Fail(Error.what()); }
+		});
+	}
+
+	// Empty if the worker ran out of countdowns to try
+	std::string const &Join(void)
+	{
+		if (Thread.joinable()) Thread.join();
+		return Error;
+	}
+
+	private:
+		// Polls until the mount point is on a different device from its parent
+		void WaitForMount(void)
+		{
+			auto const Parent = Mount.substr(0, Mount.rfind('/'));
+			for (size_t Attempt = 0; Attempt < 1000; ++Attempt)
+			{
+				struct stat MountStat, ParentStat;
+				if ((stat(Mount.c_str(), &MountStat) == 0) &&
+					(stat(Parent.c_str(), &ParentStat) == 0) &&
+					(MountStat.st_dev != ParentStat.st_dev)) return;
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			throw SystemErrorT() << "Clunker didn't mount [" << Mount << "]";
+		}
+
+		template <typename ErrorT> void Fail(ErrorT const &Error)
+		{
+			std::stringstream Out;
+			Out << Error;
+			this->Error = Out.str();
+			// Keeps the other workers from going on
+			Exploration.Limit = -1;
+		}
+
+		void Prepare(void)
+		{
+			if (RunCommand(Mount, Commands.Setup, -1) != 0)
+				throw UserErrorT() << "Setup failed in [" << Mount << "]";
+			Control->TrackDurability(Commands.Crash, [this](bool Success)
+			{
+				if (!Success) throw SystemErrorT() << "Failed to set durability tracking in [" << Mount << "]";
+				Control->Snapshot(SnapshotName, [this](bool Success)
+				{
+					if (!Success) throw SystemErrorT() << "Failed to snapshot the setup in [" << Mount << "]";
+					Next();
+				});
+			});
+		}
+
+		void Check(int64_t Count)
+		{
+			if (RunCommand(Mount, Commands.Checker, Count) != 0)
+			{
+				std::cout << "Check failed after " << Count << " operations" << std::endl;
+				Exploration.Failed(Count);
+			}
+			Next();
+		}
+
+		void Next(void)
+		{
+			auto const Count = Exploration.Next++;
+			if (Count >= Exploration.Limit)
+			{
+				Service.stop();
+				return;
+			}
+			Control->Restore(SnapshotName, [this, Count](bool Success)
+			{
+				if (!Success) throw SystemErrorT() << "Failed to restore the setup in [" << Mount << "]";
+				Control->SetOpCount(Count, [this, Count](bool Success)
+				{
+					RunCommand(Mount, Commands.Workload, Count);
+					Control->GetOpCount([this, Count](int64_t Remaining)
+					{
+						// Operations left over mean the workload never saw a failure
+						if (Remaining > 0) Exploration.Finished(Count);
+						Control->SetOpCount(-1, [this, Count](bool Success)
+						{
+							if (!Commands.Crash) 
+							{
+								Check(Count);
+								return;
+							}
+							Control->Crash(Count, 0, false, [this, Count](bool Success) { Check(Count); });
+						});
+					});
+				});
+			});
+		}
+
+		static constexpr char const *SnapshotName = "explore";
+
+		std::string const Mount;
+		asio::ip::tcp::endpoint Endpoint;
+		CommandsT const &Commands;
+		ExplorationT &Exploration;
+		pid_t Process;
+		std::string Error;
+		asio::io_service Service;
+		std::shared_ptr<ClunkerControlT> Control;
+		std::thread Thread;
+};
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		if (argc < 5) throw UserErrorT() << "Usage: " << argv[0] << " CLUNKER SETUP WORKLOAD CHECKER";
+		std::string const Clunker = argv[1];
+		CommandsT const Commands{argv[2], argv[3], argv[4], getenv("CLUNKER_EXPLORE_CRASH") && (std::string(getenv("CLUNKER_EXPLORE_CRASH")) == "1")};
+
+		uint16_t BasePort = 0;
+		if (!getenv("CLUNKER_PORT")) throw UserErrorT() << "CLUNKER_PORT env variable is not set.";
+		StringT(getenv("CLUNKER_PORT")) >> BasePort;
+
+		size_t Workers = std::max(1u, std::thread::hardware_concurrency());
+		if (getenv("CLUNKER_EXPLORE_WORKERS")) StringT(getenv("CLUNKER_EXPLORE_WORKERS")) >> Workers;
+		if (Workers < 1) throw UserErrorT() << "CLUNKER_EXPLORE_WORKERS must be at least 1.";
+
+		// Cached lookups and stats skip the countdown, so runs only repeat
+		// exactly without caching
+		setenv("CLUNKER_ENTRY_TIMEOUT", "0", 0);
+		setenv("CLUNKER_ATTR_TIMEOUT", "0", 0);
+
+		char Template[] = "/tmp/clunker_explore.XXXXXX";
+		if (!mkdtemp(Template)) throw SystemErrorT() << "Failed to create a directory for mounts: " << strerror(errno);
+		std::string const Base = Template;
+
+		ExplorationT Exploration;
+		std::string Error;
+		{
+			std::vector<std::unique_ptr<WorkerT>> Running;
+			for (size_t Index = 0; Index < Workers; ++Index)
+				Running.emplace_back(new WorkerT(
+					Clunker,
+					Base + "/" + std::to_string(Index),
+					BasePort + Index,
+					Commands,
+					Exploration));
+			for (auto &Worker : Running) Worker->Start();
+			for (auto &Worker : Running) 
+				if (Error.empty()) Error = Worker->Join();
+		}
+		rmdir(Base.c_str());
+		if (!Error.empty()) throw SystemErrorT() << "Exploration stopped: " << Error;
+
+		std::cout << "The workload completes after " << Exploration.Limit << " operations; " <<
+			Exploration.Failures.size() << " failure points failed the check:";
+		for (auto Count : Exploration.Failures) std::cout << " " << Count;
+		std::cout << std::endl;
+		return Exploration.Failures.empty() ? 0 : 2;
+	}
+	catch (UserErrorT const &Error)
+	{
+		std::cerr << "Error: " << Error << std::endl;
+		return 1;
+	}
+	catch (SystemErrorT const &Error)
+	{
+		std::cerr << "System error: " << Error << std::endl;
+		return 1;
+	}
+	catch (ConstructionErrorT const &Error)
+	{
+		std::cerr << "Uncaught error: " << Error << std::endl;
+		return 1;
+	}
+	catch (std::runtime_error const &Error)
+	{
+		std::cerr << "Uncaught error: " << Error.what() << std::endl;
+		return 1;
+	}
+}
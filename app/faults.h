@@ -0,0 +1,457 @@
+#ifndef faults_h
+#define faults_h
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <limits>
+#include <cstdint>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <sys/types.h>
+
+#include "operations.h"
+#include "path_trie.h"
+
+// Accepts errno names like ENOSPC or numbers, 0 if it's neither
+inline int ParseErrno(std::string const &Name)
+{
+#define CLUNKER_ERRNO_PARSE(name) if (Name == #name) return name;
+	CLUNKER_ERRNO_PARSE(EIO)
+	CLUNKER_ERRNO_PARSE(ENOSPC)
+	CLUNKER_ERRNO_PARSE(EDQUOT)
+	CLUNKER_ERRNO_PARSE(EFBIG)
+	CLUNKER_ERRNO_PARSE(EROFS)
+	CLUNKER_ERRNO_PARSE(EACCES)
+	CLUNKER_ERRNO_PARSE(EPERM)
+	CLUNKER_ERRNO_PARSE(ENOENT)
+	CLUNKER_ERRNO_PARSE(EEXIST)
+	CLUNKER_ERRNO_PARSE(ENOTEMPTY)
+	CLUNKER_ERRNO_PARSE(ENOTDIR)
+	CLUNKER_ERRNO_PARSE(EISDIR)
+	CLUNKER_ERRNO_PARSE(EINVAL)
+	CLUNKER_ERRNO_PARSE(EINTR)
+	CLUNKER_ERRNO_PARSE(EAGAIN)
+	CLUNKER_ERRNO_PARSE(ENOMEM)
+	CLUNKER_ERRNO_PARSE(EMFILE)
+	CLUNKER_ERRNO_PARSE(ENFILE)
+	CLUNKER_ERRNO_PARSE(EBUSY)
+	CLUNKER_ERRNO_PARSE(ETIMEDOUT)
+	CLUNKER_ERRNO_PARSE(ENAMETOOLONG)
+	CLUNKER_ERRNO_PARSE(EXDEV)
+#undef CLUNKER_ERRNO_PARSE
+	char *End = nullptr;
+	auto const Number = strtol(Name.c_str(), &End, 10);
+	if (Name.empty() || *End || (Number <= 0)) return 0;
+	return Number;
+}
+
+// splitmix64's finalizer, a counter based generator: no state is shared
+// between threads beyond the counter
+inline uint64_t Mix(uint64_t Value)
+{
+	Value += 0x9E3779B97F4A7C15ull;
+	Value = (Value ^ (Value >> 30)) * 0xBF58476D1CE4E5B9ull;
+	Value = (Value ^ (Value >> 27)) * 0x94D049BB133111EBull;
+	return Value ^ (Value >> 31);
+}
+
+// How a faulted operation fails.  Fail returns the rule's error; the others
+// only apply to reads and writes, which go through in part instead:
+// Short moves a prefix of the request and reports its length, Torn writes a
+// prefix but reports the whole write, and Sectors writes a random subset of
+// the 512 byte sectors and reports the whole write.  Reads can only be
+// short.
+enum struct FaultModeT : uint8_t
+{
+	Fail,
+	Short,
+	Torn,
+	Sectors,
+};
+
+inline bool ParseFaultMode(std::string const &Name, FaultModeT &Out)
+{
+	if (Name == "fail") Out = FaultModeT::Fail;
+	else if (Name == "short") Out = FaultModeT::Short;
+	else if (Name == "torn") Out = FaultModeT::Torn;
+	else if (Name == "sectors") Out = FaultModeT::Sectors;
+	else return false;
+	return true;
+}
+
+// Where a read or write picked by a partial rule is cut.  Draw decides the
+// split point, so the same draw always cuts a request the same way.
+struct SplitT
+{
+	static constexpr size_t SectorSize = 512;
+
+	FaultModeT Mode = FaultModeT::Fail;
+	uint64_t Draw = 0;
+
+	explicit operator bool(void) const { return Mode != FaultModeT::Fail; }
+
+	// Calls Visit(Offset, Length) with each range of the Count bytes at
+	// Start that goes through, in order
+	template <typename VisitT> void Kept(off_t Start, size_t Count, VisitT &&Visit) const
+	{
+		switch (Mode)
+		{
+			case FaultModeT::Fail: 
+				Visit(Start, Count); 
+				return;
+			case FaultModeT::Short:
+				// At least a byte, so a read doesn't look like the end of file
+				if (Count > 1) Count = 1 + Draw % (Count - 1);
+				Visit(Start, Count);
+				return;
+			case FaultModeT::Torn:
+				if (Count > 0) Count = Draw % Count;
+				if (Count > 0) Visit(Start, Count);
+				return;
+			case FaultModeT::Sectors:
+			{
+				// Sectors are aligned to the file, not the request
+				off_t const End = Start + Count;
+				off_t Run = -1;
+				for (off_t Sector = Start / SectorSize; Sector * static_cast<off_t>(SectorSize) < End; ++Sector)
+				{
+					auto const From = std::max(Start, Sector * static_cast<off_t>(SectorSize));
+					if (Mix(Draw ^ Sector) & 1)
+					{
+						if (Run < 0) Run = From;
+						continue;
+					}
+					if (Run >= 0) Visit(Run, From - Run);
+					Run = -1;
+				}
+				if (Run >= 0) Visit(Run, End - Run);
+				return;
+			}
+		}
+	}
+
+	// The count to report for Count bytes, if they all could be written
+	size_t Reported(off_t Start, size_t Count) const
+	{
+		if (Mode != FaultModeT::Short) return Count;
+		size_t Out = 0;
+		Kept(Start, Count, [&Out](off_t, size_t Length) { Out = Length; });
+		return Out;
+	}
+};
+
+// The split picked for the request being served on this thread, set by
+// FaultsT::Check for a read or write and taken straight after by its handler
+inline SplitT &RequestSplit(void)
+{
+	static thread_local SplitT Split;
+	return Split;
+}
+
+inline SplitT TakeSplit(void)
+{
+	auto &Pending = RequestSplit();
+	auto const Out = Pending;
+	Pending.Mode = FaultModeT::Fail;
+	return Out;
+}
+
+// A failure schedule for one operation kind.  Operations go through until
+// Operations of them have, or until passing Bytes more bytes would go over,
+// then fail with Error, or go through in part as Mode says.  Negative
+// Operations or Bytes don't limit; with neither limit every operation fails.
+// Times limits how many fail before the rule lets operations through again,
+// negative fails them forever.  Seed decides where partial operations are
+// cut.
+struct FaultRuleT
+{
+	int64_t Operations = -1;
+	int64_t Bytes = -1;
+	int Error = EIO;
+	int64_t Times = -1;
+	FaultModeT Mode = FaultModeT::Fail;
+	uint64_t Seed = 0;
+};
+
+// Per kind rules, checked with a couple of atomic operations each, and rules
+// scoped to a path prefix.  Path rules only count and fail operations on paths
+// at or below their prefix.  With no rules armed a check is a single relaxed
+// load, and the operation's path is only worked out when a path rule could
+// apply to its kind.
+struct FaultsT
+{
+	FaultsT(void) : Armed(0), ScopedKinds(0), RatesArmed(false), Seed(0), RateError(EIO), Dropped(0), SplitsDropped(0) {}
+
+	// Operations must be excluded while rules change
+	void Set(OperationT Kind, FaultRuleT const &Rule)
+	{
+		auto &Slot = Slots[static_cast<size_t>(Kind)];
+		if (!Slot.Armed) Armed += 1;
+		Slot.Armed = true;
+		Slot.Counter.Reset(Rule);
+	}
+
+	// Kinds is a mask of OperationBit values.  A rule for the same pattern
+	// and kinds is replaced.
+	void SetPath(std::string const &Pattern, uint32_t Kinds, FaultRuleT const &Rule)
+	{
+		auto &Rules = Paths.At(Pattern);
+		ScopedKinds |= Kinds;
+		for (auto &Existing : Rules)
+			if (Existing->Kinds == Kinds)
+			{
+				Existing->Counter.Reset(Rule);
+				return;
+			}
+		Rules.emplace_back(new PathRuleT());
+		Rules.back()->Kinds = Kinds;
+		Rules.back()->Counter.Reset(Rule);
+		Armed += 1;
+	}
+
+	// Fails each kind of operation at random with the probability in Rates.
+	// Whether the Nth operation of a kind fails depends only on the seed, so
+	// a run that makes the same operations fails the same ones whichever
+	// threads serve them.
+	void SetRates(uint64_t Seed, std::array<double, static_cast<size_t>(OperationT::Count)> const &Rates, int Error)
+	{
+		if (!RatesArmed) Armed += 1;
+		RatesArmed = true;
+		this->Seed = Seed;
+		RateError = Error;
+		for (size_t Index = 0; Index < Rates.size(); ++Index)
+		{
+			auto &Rate = this->Rates[Index];
+			auto const Probability = Rates[Index];
+			if (Probability <= 0) Rate.Threshold = 0;
+			else if (Probability >= 1) Rate.Threshold = std::numeric_limits<uint64_t>::max();
+			else Rate.Threshold = static_cast<uint64_t>(Probability * 18446744073709551616.0);
+			Rate.Sequence = 0;
+		}
+		std::lock_guard<std::mutex> Guard(LogMutex);
+		Log.clear();
+		Dropped = 0;
+	}
+
+	// Random failures so far, as the kind and its operation's index among
+	// that kind.  Only the first LogLimit are kept.
+	static constexpr size_t LogLimit = 65536;
+	struct InjectedT
+	{
+		OperationT Kind;
+		uint64_t Index;
+	};
+
+	uint64_t GetSeed(void) const { return Seed; }
+
+	std::vector<InjectedT> GetLog(uint64_t &Dropped)
+	{
+		std::lock_guard<std::mutex> Guard(LogMutex);
+		Dropped = this->Dropped;
+		return Log;
+	}
+
+	// A read or write that went through in part: the request, and the file
+	// ranges that went through
+	struct SplitRecordT
+	{
+		OperationT Kind;
+		uint64_t Inode;
+		off_t Offset;
+		size_t Length;
+		std::vector<std::pair<off_t, size_t>> Kept;
+	};
+
+	void RecordSplit(SplitRecordT &&Record)
+	{
+		std::lock_guard<std::mutex> Guard(LogMutex);
+		if (Splits.size() >= LogLimit) SplitsDropped += 1;
+		else Splits.push_back(std::move(Record));
+	}
+
+	// Partial operations since the rules were cleared.  Only the first
+	// LogLimit are kept.
+	std::vector<SplitRecordT> GetSplits(uint64_t &Dropped)
+	{
+		std::lock_guard<std::mutex> Guard(LogMutex);
+		Dropped = SplitsDropped;
+		return Splits;
+	}
+
+	void Clear(void)
+	{
+		for (auto &Slot : Slots) Slot.Armed = false;
+		Paths.Clear();
+		ScopedKinds = 0;
+		RatesArmed = false;
+		Armed = 0;
+		std::lock_guard<std::mutex> Guard(LogMutex);
+		Splits.clear();
+		SplitsDropped = 0;
+	}
+
+	// True if a path rule could apply to operations of this kind
+	bool Scoped(OperationT Kind) const { return ScopedKinds & OperationBit(Kind); }
+
+	// 0, or the negative errno to fail with.  Locate is called with an empty
+	// RulePathT to fill when the path is needed, and returns false if the
+	// operation has no path, which matches no path rule.  A read or write a
+	// partial rule picks gets 0, with its split in RequestSplit.
+	template <typename LocateT> int Check(OperationT Kind, LocateT &&Locate, size_t Bytes = 0)
+	{
+		if (!Armed.load(std::memory_order_relaxed)) return 0;
+		auto &Slot = Slots[static_cast<size_t>(Kind)];
+		if (Slot.Armed.load(std::memory_order_relaxed))
+		{
+			auto const Fault = Slot.Counter.Take(Bytes);
+			if (Fault) return Slot.Counter.Fire(Kind, Fault);
+		}
+		if (RatesArmed)
+		{
+			auto &Rate = Rates[static_cast<size_t>(Kind)];
+			if (Rate.Threshold)
+			{
+				auto const Index = Rate.Sequence.fetch_add(1, std::memory_order_relaxed);
+				if (Mix(Seed ^ (static_cast<uint64_t>(Kind) << 56) ^ Index) < Rate.Threshold)
+				{
+					Record(Kind, Index);
+					return -RateError;
+				}
+			}
+		}
+		if (!Scoped(Kind)) return 0;
+		RulePathT Path;
+		if (!Locate(Path)) return 0;
+		// Shallower rules are checked first, and the first to fail wins
+		int Fault = 0;
+		Paths.Match(Path, [&](PathRuleT &Rule)
+		{
+			if (!(Rule.Kinds & OperationBit(Kind))) return false;
+			Fault = Rule.Counter.Take(Bytes);
+			if (!Fault) return false;
+			Fault = Rule.Counter.Fire(Kind, Fault);
+			return true;
+		});
+		return Fault;
+	}
+
+	private:
+		// The state of one rule
+		struct CounterT
+		{
+			void Reset(FaultRuleT const &Rule)
+			{
+				Operations = ((Rule.Operations < 0) && (Rule.Bytes < 0)) ? 0 : Rule.Operations;
+				Bytes = Rule.Bytes;
+				Error = Rule.Error;
+				Times = Rule.Times;
+				Mode = Rule.Mode;
+				Seed = Rule.Seed;
+				Sequence = 0;
+			}
+
+			// Turns a failure from Take into a split, for partial rules
+			int Fire(OperationT Kind, int Fault)
+			{
+				if ((Mode == FaultModeT::Fail) || ((Kind != OperationT::read) && (Kind != OperationT::write)))
+					return Fault;
+				auto &Split = RequestSplit();
+				Split.Mode = (Kind == OperationT::read) ? FaultModeT::Short : Mode;
+				Split.Draw = Mix(Seed ^ Sequence.fetch_add(1, std::memory_order_relaxed));
+				return 0;
+			}
+
+			int Take(size_t Count)
+			{
+				if (TakeOperation() && TakeBytes(Count)) return 0;
+				auto Left = Times.load(std::memory_order_relaxed);
+				while (true)
+				{
+					if (Left < 0) return -Error;
+					if (Left == 0) return 0;
+					if (Times.compare_exchange_weak(Left, Left - 1, std::memory_order_relaxed))
+						return -Error;
+				}
+			}
+
+			private:
+				bool TakeOperation(void)
+				{
+					auto Count = Operations.load(std::memory_order_relaxed);
+					while (true)
+					{
+						if (Count < 0) return true;
+						if (Count == 0) return false;
+						if (Operations.compare_exchange_weak(Count, Count - 1, std::memory_order_relaxed))
+							return true;
+					}
+				}
+
+				bool TakeBytes(size_t Count)
+				{
+					auto Left = Bytes.load(std::memory_order_relaxed);
+					while (true)
+					{
+						if (Left < 0) return true;
+						if (static_cast<int64_t>(Count) > Left) return false;
+						if (Bytes.compare_exchange_weak(Left, Left - Count, std::memory_order_relaxed))
+							return true;
+					}
+				}
+
+				std::atomic<int64_t> Operations{0};
+				std::atomic<int64_t> Bytes{0};
+				int Error = EIO;
+				std::atomic<int64_t> Times{0};
+				FaultModeT Mode = FaultModeT::Fail;
+				uint64_t Seed = 0;
+				std::atomic<uint64_t> Sequence{0};
+		};
+
+		struct SlotT
+		{
+			std::atomic<bool> Armed{false};
+			CounterT Counter;
+		};
+
+		struct PathRuleT
+		{
+			uint32_t Kinds;
+			CounterT Counter;
+		};
+
+		struct RateT
+		{
+			uint64_t Threshold = 0;
+			std::atomic<uint64_t> Sequence{0};
+		};
+
+		void Record(OperationT Kind, uint64_t Index)
+		{
+			std::lock_guard<std::mutex> Guard(LogMutex);
+			if (Log.size() >= LogLimit) Dropped += 1;
+			else Log.push_back({Kind, Index});
+		}
+
+		std::atomic<size_t> Armed;
+		std::array<SlotT, static_cast<size_t>(OperationT::Count)> Slots;
+		uint32_t ScopedKinds;
+		PathTrieT<PathRuleT> Paths;
+
+		bool RatesArmed;
+		uint64_t Seed;
+		int RateError;
+		std::array<RateT, static_cast<size_t>(OperationT::Count)> Rates;
+		std::mutex LogMutex;
+		std::vector<InjectedT> Log;
+		uint64_t Dropped;
+		std::vector<SplitRecordT> Splits;
+		uint64_t SplitsDropped;
+};
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef file_data_h
+#define file_data_h
+
+#include <map>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <sys/types.h>
+
+#include "pool.h"
+
+// Regular file contents, stored as fixed size chunks keyed by chunk index so
+// writes only touch the chunks they overlap.  Chunks that were never written
+// (or were punched out) are holes: they have no backing storage and read as
+// zeros.
+//
+// Chunks are shared and stamped with the snapshot epoch that wrote them.  If
+// a journal is passed to a modifying method, chunks from an older epoch are
+// handed to the journal and copied before being changed, so snapshots share
+// all unmodified chunks with the live file.
+struct RegularFileDataT
+{
+	static constexpr size_t ChunkSize = 64 * 1024;
+
+	struct ChunkT
+	{
+		std::shared_ptr<uint8_t> Bytes;
+		uint64_t Epoch = 0;
+	};
+
+	struct JournalT
+	{
+		uint64_t Epoch;
+
+		// Previous is null if the chunk didn't exist
+		virtual void Save(size_t Index, ChunkT const *Previous) = 0;
+	};
+
+	RegularFileDataT(void) : Length(0) {}
+
+	off_t Size(void) const { return Length; }
+
+	// Bytes of backing storage, for st_blocks
+	off_t Allocated(void) const { return Chunks.size() * ChunkSize; }
+
+	// lseek SEEK_DATA/SEEK_HOLE semantics, -1 for ENXIO
+	off_t SeekData(off_t Start) const
+	{
+		if (Start >= Length) return -1;
+		auto Found = Chunks.lower_bound(Start / ChunkSize);
+		if (Found == Chunks.end()) return -1;
+		off_t const At = std::max(Start, static_cast<off_t>(Found->first * ChunkSize));
+		if (At >= Length) return -1;
+		return At;
+	}
+
+	off_t SeekHole(off_t Start) const
+	{
+		if (Start >= Length) return -1;
+		size_t Index = Start / ChunkSize;
+		auto Found = Chunks.find(Index);
+		if (Found == Chunks.end()) return Start;
+		while ((Found != Chunks.end()) && (Found->first == Index))
+		{
+			++Found;
+			++Index;
+		}
+		return std::min(Length, static_cast<off_t>(Index * ChunkSize));
+	}
+
+	// Visits the storage backing a range as (bytes, length) spans, with holes
+	// backed by a shared zero chunk, so callers can hand out the storage
+	// itself.  The spans are valid until the file is next modified.
+	template <typename VisitT> size_t Segments(size_t Count, off_t Start, VisitT &&Visit) const
+	{
+		if (Start >= Length) return 0;
+		Count = std::min(Count, static_cast<size_t>(Length - Start));
+		size_t Done = 0;
+		auto Next = Chunks.lower_bound(Start / ChunkSize);
+		while (Done < Count)
+		{
+			auto const At = Start + Done;
+			auto const Index = At / ChunkSize;
+			auto const Offset = At % ChunkSize;
+			auto const Span = std::min(Count - Done, ChunkSize - Offset);
+			if ((Next != Chunks.end()) && (Next->first == Index))
+			{
+				Visit(Next->second.Bytes.get() + Offset, Span);
+				++Next;
+			}
+			else Visit(Zeros() + Offset, Span);
+			Done += Span;
+		}
+		return Count;
+	}
+
+	size_t Read(char *Out, size_t Count, off_t Start) const
+	{
+		return Segments(Count, Start, [&Out](uint8_t const *Bytes, size_t Span)
+		{
+			memcpy(Out, Bytes, Span);
+			Out += Span;
+		});
+	}
+
+	// Copy(Destination, Span) fills Destination from the next Span bytes of
+	// the source and returns how many it filled.  Returns the number of bytes
+	// written, which is short if the pool limit was reached or the source ran
+	// dry.
+	template <typename CopyT> size_t WriteFrom(size_t Count, off_t Start, JournalT *Journal, CopyT &&Copy)
+	{
+		size_t Done = 0;
+		while (Done < Count)
+		{
+			auto const At = Start + Done;
+			auto const Offset = At % ChunkSize;
+			auto const Span = std::min(Count - Done, ChunkSize - Offset);
+			auto Destination = Chunk(At / ChunkSize, Journal);
+			if (!Destination) break;
+			auto const Copied = Copy(Destination + Offset, Span);
+			Done += Copied;
+			if (Copied < Span) break;
+		}
+		if (Done) Length = std::max(Length, static_cast<off_t>(Start + Done));
+		return Done;
+	}
+
+	size_t Write(char const *In, size_t Count, off_t Start, JournalT *Journal = nullptr)
+	{
+		return WriteFrom(Count, Start, Journal, [&In](uint8_t *Destination, size_t Span)
+		{
+			memcpy(Destination, In, Span);
+			In += Span;
+			return Span;
+		});
+	}
+
+	void Truncate(off_t NewLength, JournalT *Journal = nullptr)
+	{
+		if (NewLength < Length)
+		{
+			// Drop whole chunks past the end and zero the tail of the last
+			// partial chunk so that growing the file again reads zeros
+			auto const Keep = (NewLength + ChunkSize - 1) / ChunkSize;
+			Erase(Chunks.lower_bound(Keep), Chunks.end(), Journal);
+			auto const Offset = NewLength % ChunkSize;
+			if (Offset != 0)
+			{
+				auto Last = Modify(NewLength / ChunkSize, Journal);
+				if (Last) memset(Last + Offset, 0, ChunkSize - Offset);
+			}
+		}
+		Length = NewLength;
+	}
+
+	// Deallocates the range, keeping the size (FALLOC_FL_PUNCH_HOLE)
+	void PunchHole(off_t Start, off_t Count, JournalT *Journal = nullptr)
+	{
+		auto const End = std::min(Length, Start + Count);
+		if (Start >= End) return;
+		auto const First = (Start + ChunkSize - 1) / ChunkSize;
+		auto const Last = End / ChunkSize;
+		if (First < Last)
+			Erase(Chunks.lower_bound(First), Chunks.lower_bound(Last), Journal);
+		if (Start % ChunkSize != 0)
+			ZeroPartial(Start / ChunkSize, Start % ChunkSize, std::min(static_cast<off_t>(First * ChunkSize), End), Journal);
+		if ((End % ChunkSize != 0) && (static_cast<off_t>(Last * ChunkSize) >= Start) && (Last >= First))
+			ZeroPartial(Last, 0, End, Journal);
+	}
+
+	// Undo support; Previous is as passed to JournalT::Save
+	void RestoreChunk(size_t Index, ChunkT const *Previous)
+	{
+		if (Previous) Chunks[Index] = *Previous;
+		else Chunks.erase(Index);
+	}
+
+	void RestoreLength(off_t OldLength) { Length = OldLength; }
+
+	// Partial undo, for a write torn by a crash: the first Keep bytes of the
+	// chunk stay as they are and the rest go back to Previous.  False if
+	// there's no memory for the mixed chunk, leaving it unchanged.
+	bool TearChunk(size_t Index, ChunkT const *Previous, size_t Keep)
+	{
+		auto Found = Chunks.find(Index);
+		auto Mixed = Allocate(Found != Chunks.end() ? Found->second.Epoch : 0);
+		if (!Mixed.Bytes) return false;
+		auto const Bytes = Mixed.Bytes.get();
+		memcpy(Bytes, Found != Chunks.end() ? Found->second.Bytes.get() : Zeros(), Keep);
+		memcpy(Bytes + Keep, (Previous ? Previous->Bytes.get() : Zeros()) + Keep, ChunkSize - Keep);
+		Chunks[Index] = std::move(Mixed);
+		return true;
+	}
+
+	private:
+		struct ChunkDeleterT
+		{
+			void operator ()(uint8_t *Chunk) const { GlobalPool().Free(Chunk); }
+		};
+
+		typedef std::map<size_t, ChunkT>::iterator IteratorT;
+
+		static uint8_t const *Zeros(void)
+		{
+			static uint8_t const Zeros[ChunkSize] = {};
+			return Zeros;
+		}
+
+		static ChunkT Allocate(uint64_t Epoch)
+		{
+			ChunkT Out;
+			auto Bytes = static_cast<uint8_t *>(GlobalPool().Allocate(ChunkSize));
+			if (!Bytes) return Out;
+			try
+			{
+				Out.Bytes = std::shared_ptr<uint8_t>(Bytes, ChunkDeleterT(), PoolAllocatorT<uint8_t>());
+			}
+			catch (std::bad_alloc const &)
+			{
+				// The deleter has already been called
+				return Out;
+			}
+			Out.Epoch = Epoch;
+			return Out;
+		}
+
+		void Erase(IteratorT Start, IteratorT End, JournalT *Journal)
+		{
+			if (Journal)
+			{
+				for (auto Chunk = Start; Chunk != End; ++Chunk)
+					if (Chunk->second.Epoch < Journal->Epoch)
+						Journal->Save(Chunk->first, &Chunk->second);
+			}
+			Chunks.erase(Start, End);
+		}
+
+		// Existing chunk, copied first if the journal needs the original
+		uint8_t *Modify(IteratorT Found, JournalT *Journal)
+		{
+			if (Journal && (Found->second.Epoch < Journal->Epoch))
+			{
+				auto Copy = Allocate(Journal->Epoch);
+				if (!Copy.Bytes) return nullptr;
+				memcpy(Copy.Bytes.get(), Found->second.Bytes.get(), ChunkSize);
+				Journal->Save(Found->first, &Found->second);
+				Found->second = std::move(Copy);
+			}
+			return Found->second.Bytes.get();
+		}
+
+		uint8_t *Modify(size_t Index, JournalT *Journal)
+		{
+			auto Found = Chunks.find(Index);
+			if (Found == Chunks.end()) return nullptr;
+			return Modify(Found, Journal);
+		}
+
+		// Existing or new zeroed chunk
+		uint8_t *Chunk(size_t Index, JournalT *Journal)
+		{
+			auto Found = Chunks.find(Index);
+			if (Found != Chunks.end()) return Modify(Found, Journal);
+			auto Created = Allocate(Journal ? Journal->Epoch : 0);
+			if (!Created.Bytes) return nullptr;
+			memset(Created.Bytes.get(), 0, ChunkSize);
+			if (Journal) Journal->Save(Index, nullptr);
+			auto Bytes = Created.Bytes.get();
+			Chunks.emplace(Index, std::move(Created));
+			return Bytes;
+		}
+
+		void ZeroPartial(size_t Index, size_t Offset, off_t End, JournalT *Journal)
+		{
+			auto Found = Chunks.find(Index);
+			if (Found == Chunks.end()) return;
+			auto const Bytes = Modify(Found, Journal);
+			if (!Bytes) return;
+			auto const Stop = End - static_cast<off_t>(Index * ChunkSize);
+			memset(Bytes + Offset, 0, Stop - Offset);
+			if (std::all_of(Bytes, Bytes + ChunkSize, [](uint8_t Byte) { return Byte == 0; }))
+			{
+				// Already saved by Modify if it predates the journal
+				Chunks.erase(Found);
+			}
+		}
+
+		off_t Length;
+		std::map<size_t, ChunkT> Chunks;
+};
+
+#endif
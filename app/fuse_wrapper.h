@@ -5,11 +5,170 @@
 #include <fuse.h>
 #include <fuse_lowlevel.h>
 
+#include <tuple>
+#include <limits>
+#include <thread>
+#include <utility>
+#include <initializer_list>
+
 #include "../ren-cxx-basics/error.h"
+#include "kernel_notify.h"
+#include "delay_queue.h"
+#include "stats.h"
+#include "trace.h"
+#include "record.h"
+
+// Mount settings, mostly how much the kernel may cache and how large requests
+// can be.  Zero sizes leave the kernel's defaults.
+struct FuseConfigT
+{
+	// Serve the inode based ll_ methods, otherwise the path based methods
+	bool LowLevel = true;
+
+	// Seconds the kernel may reuse lookups and attributes without asking
+	double EntryTimeout = 1.0;
+	double AttributeTimeout = 1.0;
+
+	// Keep file data cached across opens
+	bool KeepCache = false;
+
+	// Allow writes larger than a page per request
+	bool BigWrites = true;
+
+	size_t MaxRead = 0;
+	size_t MaxWrite = 0;
+
+	// Most low-level requests, and most bytes of their arguments, waiting on
+	// injected latency at once; more run without the delay
+	size_t MaxDelayed = 4096;
+	size_t MaxDelayedBytes = 64 * 1024 * 1024;
+
+	// Threads running low-level requests once their delay passes
+	size_t DelayThreads = 4;
+};
+
+// The thread that made the request being served on this thread, set by the
+// glue before each call
+inline pid_t &RequestPid(void)
+{
+	static thread_local pid_t Pid = 0;
+	return Pid;
+}
 
-template <typename MethodTypeT> struct GlueCallT;
-template <typename FilesystemT, typename ReturnT, typename ...ArgsT>
-	struct GlueCallT<ReturnT (FilesystemT::*)(bool, ArgsT ...)> 
+// Whether the process filter watches the caller of the request being served
+// on this thread, or -1 until the filesystem first asks
+inline int8_t &RequestWatched(void)
+{
+	static thread_local int8_t Watched = -1;
+	return Watched;
+}
+
+// Injected latency for the request being served on this thread.  On the first
+// pass the filesystem may set Delay and return DelayRequest; the glue then
+// waits outside the filesystem lock and runs the request again with Checked
+// set.
+struct RequestDelayT
+{
+	bool Checked = false;
+	std::chrono::nanoseconds Delay{0};
+};
+
+inline RequestDelayT &RequestDelay(void)
+{
+	static thread_local RequestDelayT Delay;
+	return Delay;
+}
+
+constexpr int DelayRequest = std::numeric_limits<int>::min();
+
+template <typename ResultT> bool Delayed(ResultT const &) { return false; }
+inline bool Delayed(int Result) { return Result == DelayRequest; }
+
+template <typename ResultT> bool Failed(ResultT const &) { return false; }
+inline bool Failed(int Result) { return Result < 0; }
+
+template <typename ResultT> int32_t ResultCode(ResultT const &) { return 0; }
+inline int32_t ResultCode(int Result) { return Result; }
+
+// Runs one pass of a request under the filesystem lock, adding the time spent
+// waiting for the lock and running to Time.  The filesystem describes the
+// request for the recorder afresh on each pass.
+template <typename FilesystemT, typename CallT> 
+	auto TimedPass(FilesystemT *Filesystem, bool OutOfBand, RequestTimeT &Time, CallT &&Call)
+{
+	RequestRecord().Kind = RequestRecordT::Unset;
+	auto const Start = StatsT::ClockT::now();
+	Filesystem->OperationBegin(OutOfBand);
+	auto const Locked = StatsT::ClockT::now();
+	auto Result = Call();
+	auto const Done = StatsT::ClockT::now();
+	Filesystem->OperationEnd(OutOfBand);
+	Time.Wait += Locked - Start;
+	Time.Run += Done - Locked;
+	return Result;
+}
+
+// A low-level request argument kept for running the request again later.
+// Pointers into the request, which libfuse reuses once the call returns, are
+// copied.  HeapSize is what the copy holds beyond the argument itself.
+template <typename ValueT> struct StoredArgT
+{
+	StoredArgT(ValueT Value) : Value(Value) {}
+	ValueT Get(void) { return Value; }
+	size_t HeapSize(void) const { return 0; }
+	ValueT Value;
+};
+
+template <> struct StoredArgT<const char *>
+{
+	StoredArgT(const char *Value) : Value(Value) {}
+	const char *Get(void) { return Value.c_str(); }
+	size_t HeapSize(void) const { return Value.capacity(); }
+	std::string Value;
+};
+
+template <typename StructT> struct StoredStructT
+{
+	StoredStructT(StructT *Value) : Null(!Value) { if (Value) this->Value = *Value; }
+	StructT *Get(void) { return Null ? nullptr : &Value; }
+	size_t HeapSize(void) const { return 0; }
+	bool Null;
+	StructT Value;
+};
+
+template <> struct StoredArgT<struct fuse_file_info *> : StoredStructT<struct fuse_file_info> 
+	{ using StoredStructT::StoredStructT; };
+template <> struct StoredArgT<struct stat *> : StoredStructT<struct stat> 
+	{ using StoredStructT::StoredStructT; };
+
+template <> struct StoredArgT<struct fuse_bufvec *>
+{
+	StoredArgT(struct fuse_bufvec *In) : Data(fuse_buf_size(In)), Value(FUSE_BUFVEC_INIT(Data.size()))
+	{
+		Value.buf[0].mem = Data.data();
+		fuse_buf_copy(&Value, In, FUSE_BUF_NO_SPLICE);
+		Value.idx = 0;
+		Value.off = 0;
+	}
+	StoredArgT(StoredArgT const &) = delete;
+	struct fuse_bufvec *Get(void) { return &Value; }
+	size_t HeapSize(void) const { return Data.capacity(); }
+	std::vector<uint8_t> Data;
+	struct fuse_bufvec Value;
+};
+
+// The memory a stored request holds
+template <typename StoredT, size_t ...Indices> 
+	size_t StoredSize(StoredT const &Stored, std::index_sequence<Indices...>)
+{
+	size_t Out = sizeof(Stored);
+	for (auto Size : {size_t(0), std::get<Indices>(Stored).HeapSize()...}) Out += Size;
+	return Out;
+}
+
+template <typename MethodTypeT, typename TracerT> struct GlueCallT;
+template <typename TracerT, typename FilesystemT, typename ReturnT, typename ...ArgsT>
+	struct GlueCallT<ReturnT (FilesystemT::*)(bool, ArgsT ...), TracerT> 
 {
 	template <ReturnT (FilesystemT::*Source)(bool, ArgsT ...), char const *Name>
 		static void Apply(ReturnT (*&Dest)(ArgsT ...))
@@ -17,33 +176,168 @@ template <typename FilesystemT, typename ReturnT, typename ...ArgsT>
 		Dest = [](ArgsT ...Args) -> ReturnT
 		{ 
 			//std::cout << "#Calling op " << Name << std::endl;
+			static size_t const Operation = Stats().Register(Name);
 			auto &FuseContext = *fuse_get_context();
 			
 			auto Filesystem = static_cast<FilesystemT *>(FuseContext.private_data);
 
 			//std::cout << "op tid " << FuseContext.pid << std::endl;
+			RequestPid() = FuseContext.pid;
+			RequestWatched() = -1;
+			RequestDelay() = RequestDelayT();
 			bool const OutOfBand = Filesystem->OutOfBandThreadIDs.count(FuseContext.pid);
 			//if (OutOfBand) std::cout << "pid is oob" << std::endl;
 
-			Filesystem->OperationBegin(OutOfBand);
-			auto Result = (Filesystem->*Source)(OutOfBand, std::forward<ArgsT>(Args)...); 
-			Filesystem->OperationEnd(OutOfBand);
+			typename TracerT::SpanT Span;
+			TracerT::Begin(Span, Name, FuseContext.pid);
+			RequestTimeT Time;
+			auto const Call = [&](void) { return (Filesystem->*Source)(OutOfBand, Args...); };
+			auto Result = TimedPass(Filesystem, OutOfBand, Time, Call);
+			bool const WasDelayed = Delayed(Result);
+			if (WasDelayed)
+			{
+				// The high-level API replies when this returns, so this thread
+				// waits, without the lock.  Latency rules are refused unless
+				// the loop is multithreaded, so other requests go on meanwhile.
+				std::this_thread::sleep_for(RequestDelay().Delay);
+				// The filter may have changed meanwhile
+				RequestWatched() = -1;
+				TracerT::Resume(Span);
+				Result = TimedPass(Filesystem, OutOfBand, Time, Call);
+			}
+			Stats().Record(Operation, Time, Failed(Result), WasDelayed);
+			TracerT::End(Span, Result);
+			if (Recorder().Active()) Recorder().Write(RequestRecord(), ResultCode(Result));
 			return Result;
 		};
 	}
 };
 
-template <typename FilesystemT> struct FuseT
+// Low-level methods take the request and reply to it themselves, returning 0,
+// or return a negative errno to reply with
+template <typename MethodTypeT, typename TracerT> struct LowLevelGlueCallT;
+template <typename TracerT, typename FilesystemT, typename ...ArgsT>
+	struct LowLevelGlueCallT<int (FilesystemT::*)(bool, fuse_req_t, ArgsT ...), TracerT> 
+{
+	template <int (FilesystemT::*Source)(bool, fuse_req_t, ArgsT ...), char const *Name>
+		static void Apply(void (*&Dest)(fuse_req_t, ArgsT ...))
+	{
+		Dest = [](fuse_req_t Request, ArgsT ...Args)
+		{ 
+			static size_t const Operation = Stats().Register(Name);
+			auto Filesystem = static_cast<FilesystemT *>(fuse_req_userdata(Request));
+			RequestPid() = fuse_req_ctx(Request)->pid;
+			RequestWatched() = -1;
+			RequestDelay() = RequestDelayT();
+			bool const OutOfBand = Filesystem->OutOfBandThreadIDs.count(RequestPid());
+
+			typename TracerT::SpanT Span;
+			TracerT::Begin(Span, Name, RequestPid());
+			RequestTimeT Time;
+			auto Result = TimedPass(Filesystem, OutOfBand, Time, [&](void)
+				{ return (Filesystem->*Source)(OutOfBand, Request, Args...); });
+			if (Result == DelayRequest)
+			{
+				// Run again once the delay passes, freeing this thread for
+				// other requests meanwhile
+				auto Stored = std::make_shared<std::tuple<StoredArgT<ArgsT>...>>(Args...);
+				auto const Bytes = StoredSize(*Stored, std::index_sequence_for<ArgsT...>());
+				auto const Pid = RequestPid();
+				auto const Delay = RequestDelay().Delay;
+				TracerT::Suspend();
+				function<void(void)> Job([Filesystem, Request, OutOfBand, Pid, Time, Span, Stored](void)
+				{
+					Replay<Source>(Filesystem, Request, OutOfBand, Pid, Operation, Time, Span, true, *Stored, std::index_sequence_for<ArgsT...>());
+				});
+				if (Filesystem->Defer(Delay, Bytes, std::move(Job))) return;
+				// Too much is waiting already, so this one goes through
+				// undelayed rather than tie up a FUSE thread
+				Replay<Source>(Filesystem, Request, OutOfBand, Pid, Operation, Time, Span, false, *Stored, std::index_sequence_for<ArgsT...>());
+				return;
+			}
+			Stats().Record(Operation, Time, Result < 0, false);
+			TracerT::End(Span, Result);
+			if (Recorder().Active()) Recorder().Write(RequestRecord(), Result);
+			if (Result < 0) fuse_reply_err(Request, -Result);
+		};
+	}
+
+	// Time and Span hold the first pass
+	template <int (FilesystemT::*Source)(bool, fuse_req_t, ArgsT ...), size_t ...Indices>
+		static void Replay(
+			FilesystemT *Filesystem, 
+			fuse_req_t Request, 
+			bool OutOfBand, 
+			pid_t Pid, 
+			size_t Operation,
+			RequestTimeT Time,
+			typename TracerT::SpanT Span,
+			bool WasDelayed,
+			std::tuple<StoredArgT<ArgsT>...> &Stored, 
+			std::index_sequence<Indices...>)
+	{
+		RequestPid() = Pid;
+		RequestWatched() = -1;
+		RequestDelay().Checked = true;
+		TracerT::Resume(Span);
+		auto Result = TimedPass(Filesystem, OutOfBand, Time, [&](void)
+			{ return (Filesystem->*Source)(OutOfBand, Request, std::get<Indices>(Stored).Get()...); });
+		Stats().Record(Operation, Time, Result < 0, WasDelayed);
+		TracerT::End(Span, Result);
+		if (Recorder().Active()) Recorder().Write(RequestRecord(), Result);
+		if (Result < 0) fuse_reply_err(Request, -Result);
+	}
+};
+
+// Methods without the out of band flag are called without OperationBegin, for
+// requests that must never wait (forget).  They aren't traced.
+template <typename TracerT, typename FilesystemT, typename ...ArgsT>
+	struct LowLevelGlueCallT<void (FilesystemT::*)(fuse_req_t, ArgsT ...), TracerT> 
+{
+	template <void (FilesystemT::*Source)(fuse_req_t, ArgsT ...), char const *Name>
+		static void Apply(void (*&Dest)(fuse_req_t, ArgsT ...))
+	{
+		Dest = [](fuse_req_t Request, ArgsT ...Args)
+		{ 
+			static size_t const Operation = Stats().Register(Name);
+			auto Filesystem = static_cast<FilesystemT *>(fuse_req_userdata(Request));
+			RequestTimeT Time;
+			auto const Start = StatsT::ClockT::now();
+			(Filesystem->*Source)(Request, std::forward<ArgsT>(Args)...); 
+			Time.Run = StatsT::ClockT::now() - Start;
+			Stats().Record(Operation, Time, false, false);
+		};
+	}
+};
+
+// TracerT is NoTraceT, or TraceT to write a span for each operation
+template <typename FilesystemT, typename TracerT = NoTraceT> struct FuseT
 {
-	FuseT(std::string const &Path, FilesystemT &Filesystem) : 
-		Mount(Path), Context(Filesystem, Mount)
-		{ }
+	FuseT(std::string const &Path, FilesystemT &Filesystem, FuseConfigT const &Config) : 
+		Started((TracerT::Start(), true)),
+		Mount(Path, Config), Context(Filesystem, Mount, Config), Delays(Config.MaxDelayed, Config.MaxDelayedBytes, Config.DelayThreads)
+	{ 
+		Notify.Start(Mount.Channel);
+		Delays.Start();
+	}
+
+	// With the high-level API only the root has an ID the kernel knows
+	KernelNotifyT &Notifications(void) { return Notify; }
+
+	// Where low-level requests wait out injected latency
+	DelayQueueT &DelayedRequests(void) { return Delays; }
 
-	int Run(void)
+	// Multithreaded runs requests on a pool of threads that grows with load,
+	// so FilesystemT must do its own locking
+	int Run(bool Multithreaded)
 	{
-		//auto Result = fuse_loop_mt(Context.Context);
-		auto Result = fuse_loop(Context.Context);
-		return Result;
+		if (!Context.Context)
+		{
+			if (Multithreaded) return fuse_session_loop_mt(Context.Session);
+			return fuse_session_loop(Context.Session);
+		}
+		if (Multithreaded) return fuse_loop_mt(Context.Context);
+		return fuse_loop(Context.Context);
 	}
 
 	void Kill(void)
@@ -60,6 +354,14 @@ template <typename FilesystemT> struct FuseT
 				allocated = false;
 				argv = nullptr;
 				argc = 0;
+				// Parsing starts after the program name
+				Add("clunker");
+			}
+
+			void AddOption(std::string const &Option)
+			{
+				Add("-o");
+				Add(Option);
 			}
 
 			void Add(std::string const &Arg)
@@ -81,9 +383,10 @@ template <typename FilesystemT> struct FuseT
 			std::string const Path;
 			fuse_chan *Channel;
 
-			MountT(std::string const &Path) : Path(Path), Channel(nullptr)
+			MountT(std::string const &Path, FuseConfigT const &Config) : Path(Path), Channel(nullptr)
 			{
 				ArgsT Args;
+				if (Config.MaxRead) Args.AddOption(StringT() << "max_read=" << Config.MaxRead);
 				Channel = fuse_mount(Path.c_str(), &Args);
 				if (!Channel) throw ConstructionErrorT() << "Couldn't mount filesystem.";
 			}
@@ -107,6 +410,7 @@ template <typename FilesystemT> struct FuseT
 		{
 			MountT &Mount;
 			static fuse_operations Callbacks;
+			static fuse_lowlevel_ops LowLevelCallbacks;
 			FilesystemT &Filesystem;
 			fuse *Context;
 			fuse_session *Session;
@@ -123,7 +427,7 @@ template <typename FilesystemT> struct FuseT
 				static void SetCallback_##name(FilesystemT2 const *, CXXAbsurdity_HighPrecedence) \
 			{ \
 				static constexpr char Name[] = #name; \
-				GlueCallT<decltype(&FilesystemT2::name)>::template Apply<&FilesystemT2::name, Name>(Callbacks.name); \
+				GlueCallT<decltype(&FilesystemT2::name), TracerT>::template Apply<&FilesystemT2::name, Name>(Callbacks.name); \
 			} \
 			\
 			template <typename FilesystemT2> \
@@ -186,14 +490,101 @@ template <typename FilesystemT> struct FuseT
 
 #undef PREP_SET_CALLBACK
 
-			ContextT(FilesystemT &Filesystem, MountT &Mount) : 
+#define PREP_SET_LL_CALLBACK(name) \
+			template \
+			< \
+				typename FilesystemT2, \
+				typename Enable = decltype(&FilesystemT2::ll_##name) \
+			> \
+				static void SetLowLevelCallback_##name(FilesystemT2 const *, CXXAbsurdity_HighPrecedence) \
+			{ \
+				static constexpr char Name[] = #name; \
+				LowLevelGlueCallT<decltype(&FilesystemT2::ll_##name), TracerT>::template Apply<&FilesystemT2::ll_##name, Name>(LowLevelCallbacks.name); \
+			} \
+			\
+			template <typename FilesystemT2> \
+				static void SetLowLevelCallback_##name(FilesystemT2 const *, CXXAbsurdity_LowPrecedence) \
+			{ \
+			} \
+			\
+			struct AutoSetLowLevelCallback_##name \
+			{ \
+				AutoSetLowLevelCallback_##name(void) \
+				{ \
+					SetLowLevelCallback_##name( \
+						static_cast<FilesystemT const *>(nullptr), \
+						CXXAbsurdity_HighPrecedence()); \
+				} \
+			} SetLowLevel_##name;
+
+			PREP_SET_LL_CALLBACK(lookup)
+			PREP_SET_LL_CALLBACK(forget)
+			PREP_SET_LL_CALLBACK(getattr)
+			PREP_SET_LL_CALLBACK(setattr)
+			PREP_SET_LL_CALLBACK(readlink)
+			PREP_SET_LL_CALLBACK(mknod)
+			PREP_SET_LL_CALLBACK(mkdir)
+			PREP_SET_LL_CALLBACK(unlink)
+			PREP_SET_LL_CALLBACK(rmdir)
+			PREP_SET_LL_CALLBACK(symlink)
+			PREP_SET_LL_CALLBACK(rename)
+			PREP_SET_LL_CALLBACK(link)
+			PREP_SET_LL_CALLBACK(open)
+			PREP_SET_LL_CALLBACK(read)
+			PREP_SET_LL_CALLBACK(write)
+			PREP_SET_LL_CALLBACK(flush)
+			PREP_SET_LL_CALLBACK(release)
+			PREP_SET_LL_CALLBACK(fsync)
+			PREP_SET_LL_CALLBACK(opendir)
+			PREP_SET_LL_CALLBACK(readdir)
+			PREP_SET_LL_CALLBACK(releasedir)
+			PREP_SET_LL_CALLBACK(fsyncdir)
+			PREP_SET_LL_CALLBACK(statfs)
+			PREP_SET_LL_CALLBACK(setxattr)
+			PREP_SET_LL_CALLBACK(getxattr)
+			PREP_SET_LL_CALLBACK(listxattr)
+			PREP_SET_LL_CALLBACK(removexattr)
+			PREP_SET_LL_CALLBACK(access)
+			PREP_SET_LL_CALLBACK(create)
+			PREP_SET_LL_CALLBACK(getlk)
+			PREP_SET_LL_CALLBACK(setlk)
+			PREP_SET_LL_CALLBACK(bmap)
+			PREP_SET_LL_CALLBACK(ioctl)
+			PREP_SET_LL_CALLBACK(poll)
+			PREP_SET_LL_CALLBACK(write_buf)
+			PREP_SET_LL_CALLBACK(forget_multi)
+			PREP_SET_LL_CALLBACK(flock)
+			PREP_SET_LL_CALLBACK(fallocate)
+
+#undef PREP_SET_LL_CALLBACK
+
+			ContextT(FilesystemT &Filesystem, MountT &Mount, FuseConfigT const &Config) : 
 				Mount(Mount), 
 				Filesystem(Filesystem),
-				Context(nullptr)
+				Context(nullptr),
+				Session(nullptr)
 			{
 				ArgsT Args;
 				//Args.Add("--debug");
 				//Args.Add("-d");
+				if (Config.BigWrites) Args.AddOption("big_writes");
+				if (Config.MaxWrite) Args.AddOption(StringT() << "max_write=" << Config.MaxWrite);
+				if (Config.LowLevel)
+				{
+					// The filesystem sets timeouts and keep_cache itself
+					Session = fuse_lowlevel_new(
+						&Args,
+						&LowLevelCallbacks,
+						sizeof(LowLevelCallbacks),
+						&Filesystem);
+					if (!Session)
+						throw ConstructionErrorT() << "Failed to initialize fuse session.";
+					fuse_session_add_chan(Session, Mount.Channel);
+					return;
+				}
+				Args.AddOption(StringT() << "entry_timeout=" << Config.EntryTimeout);
+				Args.AddOption(StringT() << "attr_timeout=" << Config.AttributeTimeout);
+				if (Config.KeepCache) Args.AddOption("kernel_cache");
 				Context = fuse_new(
 					Mount.Channel,
 					&Args,
@@ -208,15 +599,25 @@ template <typename FilesystemT> struct FuseT
 			~ContextT(void)
 			{
 				Mount.Destroy();
-				fuse_destroy(Context);
+				if (Context) fuse_destroy(Context);
+				else fuse_session_destroy(Session);
 			}
 		};
 
+		// Tracing starts before mounting, in case the trace file is under the
+		// mount point
+		bool Started;
 		MountT Mount;
 		ContextT Context;
+		// Last, so they stop before the channel goes away
+		KernelNotifyT Notify;
+		DelayQueueT Delays;
 };
 
-template <typename FilesystemT> fuse_operations FuseT<FilesystemT>::ContextT::Callbacks = {};
+template <typename FilesystemT, typename TracerT> 
+	fuse_operations FuseT<FilesystemT, TracerT>::ContextT::Callbacks = {};
+template <typename FilesystemT, typename TracerT> 
+	fuse_lowlevel_ops FuseT<FilesystemT, TracerT>::ContextT::LowLevelCallbacks = {};
 
 #endif
 
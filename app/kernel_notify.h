@@ -0,0 +1,155 @@
+#ifndef kernel_notify_h
+#define kernel_notify_h
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <string>
+#include <condition_variable>
+
+#include "../ren-cxx-basics/function.h"
+
+// Runs queued jobs in order on a thread of its own
+struct BackgroundT
+{
+	BackgroundT(void) : Die(false), Queued(0), Done(0) {}
+
+	BackgroundT(BackgroundT const &) = delete;
+
+	~BackgroundT(void) { Stop(); }
+
+	void Start(void)
+	{
+		Thread = std::thread([this](void) { Run(); });
+	}
+
+	// Jobs still queued are dropped
+	void Stop(void)
+	{
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			Die = true;
+		}
+		Condition.notify_all();
+		Finished.notify_all();
+		if (Thread.joinable()) Thread.join();
+	}
+
+	bool Running(void) const { return Thread.joinable(); }
+
+	void Queue(function<void(void)> &&Job)
+	{
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			Pending.push_back(std::move(Job));
+			Queued += 1;
+		}
+		Condition.notify_one();
+	}
+
+	// Waits until everything queued so far has run
+	void Flush(void)
+	{
+		std::unique_lock<std::mutex> Guard(Mutex);
+		auto const Target = Queued;
+		Finished.wait(Guard, [this, Target](void) { return Die || (Done >= Target); });
+	}
+
+	private:
+		void Run(void)
+		{
+			std::unique_lock<std::mutex> Guard(Mutex);
+			while (true)
+			{
+				Condition.wait(Guard, [this](void) { return Die || !Pending.empty(); });
+				if (Die) return;
+				std::vector<function<void(void)>> Batch;
+				std::swap(Batch, Pending);
+				Guard.unlock();
+				for (auto &Job : Batch) Job();
+				auto const Count = Batch.size();
+				Batch.clear();
+				Guard.lock();
+				Done += Count;
+				Finished.notify_all();
+			}
+		}
+
+		std::mutex Mutex;
+		std::condition_variable Condition;
+		std::condition_variable Finished;
+		bool Die;
+		uint64_t Queued;
+		uint64_t Done;
+		std::vector<function<void(void)>> Pending;
+		std::thread Thread;
+};
+
+// Queues kernel cache invalidations and sends them from a thread of their
+// own.  The kernel may need to wait for requests we're serving while it
+// processes a notification, so they're never sent from a request handler or
+// while holding filesystem locks.  Large structures are also freed here, on
+// another thread, so neither callers nor notifications wait on that.
+struct KernelNotifyT
+{
+	KernelNotifyT(void) : Channel(nullptr) {}
+
+	// The high-level API shares only the root's ID with the kernel, so
+	// everything else is reached through the root's names
+	void Start(fuse_chan *Channel)
+	{
+		this->Channel = Channel;
+		Notices.Start();
+		Releases.Start();
+	}
+
+	void Stop(void)
+	{
+		Notices.Stop();
+		Releases.Stop();
+	}
+
+	// Drops cached attributes and data
+	void Inode(fuse_ino_t Inode)
+	{
+		if (!Channel) return;
+		Notices.Queue([this, Inode](void)
+		{
+			fuse_lowlevel_notify_inval_inode(Channel, Inode, 0, 0);
+		});
+	}
+
+	// Drops cached names, and everything cached below them, as one batch
+	void Entries(fuse_ino_t Parent, std::vector<std::string> &&Names)
+	{
+		if (!Channel || Names.empty()) return;
+		auto Shared = std::make_shared<std::vector<std::string>>(std::move(Names));
+		Notices.Queue([this, Parent, Shared](void)
+		{
+			// Failures are for names the kernel already dropped
+			for (auto const &Name : *Shared)
+				fuse_lowlevel_notify_inval_entry(Channel, Parent, Name.c_str(), Name.size());
+		});
+	}
+
+	// Waits until the notifications queued so far have been sent
+	void Flush(void) { Notices.Flush(); }
+
+	// Drops the reference to Owner in the background
+	void Release(std::shared_ptr<void> Owner)
+	{
+		if (!Releases.Running()) return;
+		Releases.Queue([Owner = std::move(Owner)](void) mutable { Owner.reset(); });
+	}
+
+	private:
+		fuse_chan *Channel;
+		BackgroundT Notices;
+		BackgroundT Releases;
+};
+
+#endif
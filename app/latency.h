@@ -0,0 +1,131 @@
+#ifndef latency_h
+#define latency_h
+
+#include <array>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <string>
+
+#include "operations.h"
+#include "path_trie.h"
+
+// How long an operation takes, as a log-normal distribution with the given
+// median and 99th percentile in seconds.  A P99 no larger than the median
+// gives a fixed delay.
+struct LatencyRuleT
+{
+	double Median = 0;
+	double P99 = 0;
+};
+
+// Delays per operation kind and per path prefix, like FaultsT.  Where several
+// rules apply the longest delay drawn is used.  Draws come from a generator
+// per thread, so sampling never contends.
+struct LatencyT
+{
+	LatencyT(void) : Armed(false), ScopedKinds(0) {}
+
+	// Operations must be excluded while rules change
+	void Set(OperationT Kind, LatencyRuleT const &Rule)
+	{
+		auto &Slot = Slots[static_cast<size_t>(Kind)];
+		Slot.Armed = true;
+		Slot.Distribution = DistributionT(Rule);
+		Armed = true;
+	}
+
+	// Kinds is a mask of OperationBit values.  A rule for the same pattern
+	// and kinds is replaced.
+	void SetPath(std::string const &Pattern, uint32_t Kinds, LatencyRuleT const &Rule)
+	{
+		auto &Rules = Paths.At(Pattern);
+		ScopedKinds |= Kinds;
+		Armed = true;
+		for (auto &Existing : Rules)
+			if (Existing->Kinds == Kinds)
+			{
+				Existing->Distribution = DistributionT(Rule);
+				return;
+			}
+		Rules.emplace_back(new PathRuleT());
+		Rules.back()->Kinds = Kinds;
+		Rules.back()->Distribution = DistributionT(Rule);
+	}
+
+	void Clear(void)
+	{
+		for (auto &Slot : Slots) Slot.Armed = false;
+		Paths.Clear();
+		ScopedKinds = 0;
+		Armed = false;
+	}
+
+	// Takes the same arguments as FaultsT::Check
+	template <typename LocateT> std::chrono::nanoseconds Sample(OperationT Kind, LocateT &&Locate, size_t Bytes = 0)
+	{
+		if (!Armed) return std::chrono::nanoseconds(0);
+		double Seconds = 0;
+		auto const &Slot = Slots[static_cast<size_t>(Kind)];
+		if (Slot.Armed) Seconds = Slot.Distribution.Sample();
+		if (ScopedKinds & OperationBit(Kind))
+		{
+			RulePathT Path;
+			if (Locate(Path))
+				Paths.Match(Path, [&](PathRuleT &Rule)
+				{
+					if (Rule.Kinds & OperationBit(Kind))
+						Seconds = std::max(Seconds, Rule.Distribution.Sample());
+					return false;
+				});
+		}
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(Seconds));
+	}
+
+	private:
+		struct DistributionT
+		{
+			DistributionT(void) : Mu(0), Sigma(0), Fixed(0) {}
+
+			explicit DistributionT(LatencyRuleT const &Rule) : Mu(0), Sigma(0), Fixed(0)
+			{
+				if (Rule.Median <= 0) return;
+				if (Rule.P99 <= Rule.Median)
+				{
+					Fixed = Rule.Median;
+					return;
+				}
+				// The 99th percentile of a standard normal is 2.326 deviations out
+				Mu = std::log(Rule.Median);
+				Sigma = std::log(Rule.P99 / Rule.Median) / 2.326;
+			}
+
+			double Sample(void) const
+			{
+				if (Sigma <= 0) return Fixed;
+				static thread_local std::mt19937_64 Generator(std::random_device{}());
+				return std::lognormal_distribution<double>(Mu, Sigma)(Generator);
+			}
+
+			double Mu, Sigma, Fixed;
+		};
+
+		struct SlotT
+		{
+			bool Armed = false;
+			DistributionT Distribution;
+		};
+
+		struct PathRuleT
+		{
+			uint32_t Kinds;
+			DistributionT Distribution;
+		};
+
+		bool Armed;
+		std::array<SlotT, static_cast<size_t>(OperationT::Count)> Slots;
+		uint32_t ScopedKinds;
+		PathTrieT<PathRuleT> Paths;
+};
+
+#endif
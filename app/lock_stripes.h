@@ -0,0 +1,73 @@
+#ifndef lock_stripes_h
+#define lock_stripes_h
+
+#include <mutex>
+#include <array>
+#include <algorithm>
+#include <initializer_list>
+#include <cstdint>
+
+#include "../ren-cxx-basics/error.h"
+
+// A fixed set of mutexes handed out by address, so every node has a lock
+// without storing one per node.  Unrelated nodes occasionally share a stripe,
+// which only costs some contention.
+struct LockStripesT
+{
+	static constexpr size_t Bits = 10;
+	static constexpr size_t Count = size_t(1) << Bits;
+
+	std::mutex &For(void const *Pointer) { return Stripes[Index(Pointer)]; }
+	std::mutex &At(size_t Index) { return Stripes[Index]; }
+
+	static size_t Index(void const *Pointer)
+	{
+		// Fibonacci hashing; the low bits are always zero due to alignment
+		return (static_cast<uint64_t>(reinterpret_cast<uintptr_t>(Pointer) >> 4) * 11400714819323198485ull) >> (64 - Bits);
+	}
+
+	private:
+		std::array<std::mutex, Count> Stripes;
+};
+
+// Holds the stripes for a few nodes at once, always locking in stripe order so
+// overlapping groups can't deadlock.  Null pointers are ignored.
+struct StripeGuardT
+{
+	StripeGuardT(LockStripesT &Stripes) : Stripes(Stripes), Held(0) {}
+
+	StripeGuardT(LockStripesT &Stripes, std::initializer_list<void const *> Pointers) : StripeGuardT(Stripes)
+	{
+		Lock(Pointers);
+	}
+
+	StripeGuardT(StripeGuardT const &) = delete;
+
+	~StripeGuardT(void) { Unlock(); }
+
+	void Lock(std::initializer_list<void const *> Pointers)
+	{
+		AssertE(Held, 0u);
+		for (auto Pointer : Pointers)
+		{
+			if (!Pointer) continue;
+			AssertLT(Held, Indices.size());
+			Indices[Held++] = LockStripesT::Index(Pointer);
+		}
+		std::sort(Indices.begin(), Indices.begin() + Held);
+		Held = std::unique(Indices.begin(), Indices.begin() + Held) - Indices.begin();
+		for (size_t Index = 0; Index < Held; ++Index) Stripes.At(Indices[Index]).lock();
+	}
+
+	void Unlock(void)
+	{
+		while (Held > 0) Stripes.At(Indices[--Held]).unlock();
+	}
+
+	private:
+		LockStripesT &Stripes;
+		std::array<size_t, 4> Indices;
+		size_t Held;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef log_h
+#define log_h
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+#include <condition_variable>
+#include <unistd.h>
+
+#include "record_ring.h"
+
+// Logging that never blocks the caller.  Each thread formats its line on the
+// stack and appends it to a ring of its own, and a background thread drains
+// the rings to stdout.  A full ring drops the line and counts it rather than
+// waiting.
+//
+// Lines below CLUNKER_LOG_MINIMUM are compiled out; the rest are checked
+// against the level set at runtime, which costs a relaxed load when off.
+
+enum struct LogLevelT : uint8_t
+{
+	Trace,
+	Debug,
+	Info,
+	Warning,
+	Error,
+	Off,
+};
+
+#ifndef CLUNKER_LOG_MINIMUM
+#define CLUNKER_LOG_MINIMUM 0
+#endif
+
+inline bool ParseLogLevel(std::string const &Name, LogLevelT &Out)
+{
+	if (Name == "trace") Out = LogLevelT::Trace;
+	else if (Name == "debug") Out = LogLevelT::Debug;
+	else if (Name == "info") Out = LogLevelT::Info;
+	else if (Name == "warning") Out = LogLevelT::Warning;
+	else if (Name == "error") Out = LogLevelT::Error;
+	else if (Name == "off") Out = LogLevelT::Off;
+	else return false;
+	return true;
+}
+
+// One line being formatted.  Lines longer than the buffer are cut.
+struct LogLineT
+{
+	struct HeaderT
+	{
+		uint16_t Length;
+		LogLevelT Level;
+		int64_t Time;
+	};
+
+	static constexpr size_t Limit = 1024;
+	static_assert(Limit <= RecordRingT::MaxRecord, "Log lines must fit in a ring record");
+
+	explicit LogLineT(LogLevelT Level) : Length(sizeof(HeaderT))
+	{
+		Header.Level = Level;
+		Header.Time = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	LogLineT &operator <<(char const *Text) { return Append(Text, strlen(Text)); }
+
+	LogLineT &operator <<(std::string const &Text) { return Append(Text.data(), Text.size()); }
+
+	LogLineT &operator <<(char Character) { return Append(&Character, 1); }
+
+	LogLineT &operator <<(bool Value) { return Value ? Append("true", 4) : Append("false", 5); }
+
+	template <typename NumberT, typename = typename std::enable_if<std::is_integral<NumberT>::value>::type>
+		LogLineT &operator <<(NumberT Value)
+	{
+		char Digits[24];
+		auto const Count = std::is_signed<NumberT>::value ?
+			snprintf(Digits, sizeof(Digits), "%lld", static_cast<long long>(Value)) :
+			snprintf(Digits, sizeof(Digits), "%llu", static_cast<unsigned long long>(Value));
+		return Append(Digits, std::max(Count, 0));
+	}
+
+	LogLineT &operator <<(double Value)
+	{
+		char Digits[32];
+		auto const Count = snprintf(Digits, sizeof(Digits), "%g", Value);
+		return Append(Digits, std::min(static_cast<size_t>(std::max(Count, 0)), sizeof(Digits) - 1));
+	}
+
+	// The record as stored in a ring, header first
+	char const *Record(void)
+	{
+		Header.Length = Length;
+		memcpy(Buffer.data(), &Header, sizeof(HeaderT));
+		return Buffer.data();
+	}
+
+	size_t Size(void) const { return Length; }
+
+	private:
+		LogLineT &Append(char const *Text, size_t Count)
+		{
+			Count = std::min(Count, Limit - Length);
+			memcpy(Buffer.data() + Length, Text, Count);
+			Length += Count;
+			return *this;
+		}
+
+		HeaderT Header;
+		size_t Length;
+		std::array<char, Limit> Buffer;
+};
+
+struct LoggerT
+{
+	LoggerT(void) : Level(static_cast<uint8_t>(LogLevelT::Info)), Die(false)
+	{
+		Thread = std::thread([this](void) { Run(); });
+	}
+
+	LoggerT(LoggerT const &) = delete;
+
+	~LoggerT(void)
+	{
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			Die = true;
+		}
+		Condition.notify_all();
+		Thread.join();
+	}
+
+	bool Enabled(LogLevelT Check) const
+	{
+		return static_cast<uint8_t>(Check) >= Level.load(std::memory_order_relaxed);
+	}
+
+	void SetLevel(LogLevelT Level) { this->Level.store(static_cast<uint8_t>(Level), std::memory_order_relaxed); }
+
+	void Write(LogLineT &Line)
+	{
+		auto const Record = Line.Record();
+		auto &Ring = this->Ring();
+		Ring.Push(Record, Line.Size());
+		// Drained early rather than dropping lines in a burst
+		if (Ring.Used() > RecordRingT::Size / 2) Condition.notify_one();
+	}
+
+	private:
+		// Registered on first use by each thread, and released when it exits
+		struct HolderT
+		{
+			std::shared_ptr<RecordRingT> Ring;
+			~HolderT(void) { if (Ring) Ring->Orphaned = true; }
+		};
+
+		RecordRingT &Ring(void)
+		{
+			static thread_local HolderT Holder;
+			if (!Holder.Ring) Holder.Ring = Rings.Add();
+			return *Holder.Ring;
+		}
+
+		void Run(void)
+		{
+			std::unique_lock<std::mutex> Guard(Mutex);
+			while (!Die)
+			{
+				Condition.wait_for(Guard, std::chrono::milliseconds(10));
+				Guard.unlock();
+				Drain();
+				Guard.lock();
+			}
+			Guard.unlock();
+			Drain();
+		}
+
+		// On the logging thread only, without the mutex so the write doesn't
+		// hold up anyone
+		void Drain(void)
+		{
+			Output.clear();
+			for (auto const &Ring : Rings.Take())
+			{
+				Ring->Drain([&](char const *Record, size_t Length)
+				{
+					LogLineT::HeaderT Header;
+					memcpy(&Header, Record, sizeof(Header));
+					static char const *const Names[] = {"T", "D", "I", "W", "E"};
+					char Prefix[64];
+					auto const Count = snprintf(Prefix, sizeof(Prefix), "%s %lld.%06lld [t%llu] ",
+						Names[static_cast<size_t>(Header.Level)],
+						static_cast<long long>(Header.Time / 1000000),
+						static_cast<long long>(Header.Time % 1000000),
+						static_cast<unsigned long long>(Ring->Thread));
+					Output.append(Prefix, Count);
+					Output.append(Record + sizeof(Header), Length - sizeof(Header));
+					Output.push_back('\n');
+				});
+				auto const Dropped = Ring->Dropped.exchange(0, std::memory_order_relaxed);
+				if (Dropped)
+					Output += "W [t" + std::to_string(Ring->Thread) + "] " + std::to_string(Dropped) + " lines dropped\n";
+			}
+			size_t Done = 0;
+			while (Done < Output.size())
+			{
+				auto const Written = ::write(STDOUT_FILENO, Output.data() + Done, Output.size() - Done);
+				if (Written <= 0) break;
+				Done += Written;
+			}
+		}
+
+		std::atomic<uint8_t> Level;
+		std::mutex Mutex;
+		std::condition_variable Condition;
+		bool Die;
+		RingListT Rings;
+		std::string Output;
+		std::thread Thread;
+};
+
+inline LoggerT &Logger(void)
+{
+	static LoggerT Logger;
+	return Logger;
+}
+
+#define LOG(Level, ...) \
+	do \
+	{ \
+		if ((static_cast<int>(LogLevelT::Level) >= CLUNKER_LOG_MINIMUM) && Logger().Enabled(LogLevelT::Level)) \
+		{ \
+			LogLineT Line(LogLevelT::Level); \
+			Line << __VA_ARGS__; \
+			Logger().Write(Line); \
+		} \
+	} while (0)
+
+#endif
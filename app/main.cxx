@@ -8,7 +8,14 @@
 #include <thread>
 #include <fcntl.h>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <shared_mutex>
+#include <atomic>
+#include <random>
 #include <sys/syscall.h>
+#include <sys/uio.h>
+#include <malloc.h>
 
 #include "../ren-cxx-basics/error.h"
 #include "../ren-cxx-basics/variant.h"
@@ -17,7 +24,46 @@
 
 #include "fuse_wrapper.h"
 #include "fuse_outofband.h"
+#include "pool.h"
+#include "file_data.h"
+#include "lock_stripes.h"
 #include "asio_utils.h"
+#include "faults.h"
+#include "process_filter.h"
+#include "latency.h"
+#include "log.h"
+
+// Builds with CLUNKER_TRACE write a span for every operation
+#ifdef CLUNKER_TRACE
+typedef TraceT TracerT;
+#else
+typedef NoTraceT TracerT;
+#endif
+
+// Heap memory counts towards the memory limit along with the slab pool; see
+// HeapCountT.  Array, sized and nothrow forms all come through these.
+void *operator new(size_t Size)
+{
+	while (true)
+	{
+		auto Out = malloc(Size ? Size : 1);
+		if (Out)
+		{
+			HeapCountT::Add(malloc_usable_size(Out));
+			return Out;
+		}
+		auto Handler = std::get_new_handler();
+		if (!Handler) throw std::bad_alloc();
+		Handler();
+	}
+}
+
+void operator delete(void *Pointer) noexcept
+{
+	if (!Pointer) return;
+	HeapCountT::Add(-static_cast<int64_t>(malloc_usable_size(Pointer)));
+	free(Pointer);
+}
 
 std::vector<function<void(void)>> SignalHandlers;
 
@@ -34,15 +80,36 @@ struct timespec Now(void)
 	return Out;
 }
 
-typedef std::vector<uint8_t> RegularFileDataT;
+struct FileT;
+
 typedef std::string SymlinkPathT;
+typedef std::map<std::string, std::shared_ptr<FileT>> DirectoryDataT;
 
-struct FileT
+struct FileT : std::enable_shared_from_this<FileT>
 {
 	struct stat stat;
-	VariantT<SymlinkPathT, RegularFileDataT> Data;
+	VariantT<SymlinkPathT, RegularFileDataT, DirectoryDataT> Data;
+
+	// Where the node is linked.  Files with several links keep the latest,
+	// and lose it if that one is removed.
+	std::weak_ptr<FileT> Parent;
+	std::string Name;
+
+	// Snapshot epoch of the last journaled change to stat
+	uint64_t Epoch;
 
-	FileT(void) : stat() 
+	// For durability tracking: the last journal sequence number covered by
+	// an fsync of this node, and the epoch that fsync started, so changes
+	// after it are saved again
+	std::atomic<uint64_t> Synced;
+	uint64_t Floor;
+
+	// Outstanding kernel lookups, for the low-level API.  The node holds a
+	// reference to itself while any remain so its node ID stays valid.
+	uint64_t Lookups;
+	std::shared_ptr<FileT> Pinned;
+
+	FileT(void) : stat(), Epoch(0), Synced(0), Floor(0), Lookups(0)
 	{
 		stat.st_atim = Now();
 		stat.st_mtim = Now();
@@ -50,19 +117,42 @@ struct FileT
 		stat.st_uid = 0;
 		stat.st_gid = 0;
 	}
+
+	bool IsDirectory(void) const { return Data.Is<DirectoryDataT>(); }
+
+	// The type can't change after creation, so this is safe without the lock
+	mode_t Type(void) const
+	{
+		if (Data.Is<DirectoryDataT>()) return S_IFDIR;
+		if (Data.Is<SymlinkPathT>()) return S_IFLNK;
+		return S_IFREG;
+	}
 };
 
 struct FilesystemT : OutOfBandControlT
 {
 	std::set<pid_t> OutOfBandThreadIDs;
 
-	FilesystemT(std::string MountPath, std::mutex &Mutex) : 
+	FilesystemT(std::string MountPath, FuseConfigT const &Config) : 
 		MountPath(Filesystem::PathT::Qualify(MountPath)),
-		Mutex(Mutex), 
+		EntryTimeout(Config.EntryTimeout),
+		AttributeTimeout(Config.AttributeTimeout),
+		KeepCache(Config.KeepCache),
+		LowLevel(Config.LowLevel),
+		Notify(nullptr),
+		Delays(nullptr),
+		Batching(false),
 		OperationCount(-1), 
-		Root(std::make_shared<FileT>())
+		NextInode(RootInode),
+		Clock(0),
+		Epoch(0),
+		JournalSequence(0),
+		Tracking(false),
+		DurablePosition(0),
+		CompactAt(MinimumCompact),
+		Root(CreateNode(DirectoryDataT()))
 	{
-		Files.emplace(std::string("/"), Root);
+		if (!Root) throw ConstructionErrorT() << "Memory limit too low to create the root directory.";
 		Root->stat.st_uid = getuid();
 		Root->stat.st_gid = getgid();
 		Root->stat.st_mode = 
@@ -70,168 +160,434 @@ struct FilesystemT : OutOfBandControlT
 			S_IRUSR | S_IWUSR | S_IXUSR |
 			S_IRGRP | S_IWGRP | S_IXGRP |
 			S_IROTH | S_IWOTH | S_IXOTH;
+		Root->stat.st_nlink = 2;
 	}
 
 	bool Clean(void) 
 	{
-		std::lock_guard<std::mutex> Guard(Mutex);
-		std::cout << "Cleaning list:" << std::endl;
-		for (auto File = Files.rbegin(); File != Files.rend(); ++File)
-			std::cout << "\t" << File->first << std::endl;
-		for (auto File = Files.rbegin(); File != Files.rend(); ++File)
+		std::vector<std::string> Cached;
+		// Swapped out wholesale so a snapshot can take the old tree back
+		auto Saved = std::make_shared<std::pair<DirectoryDataT, InodesT>>();
 		{
-			if (File->first == "/") continue;
-			auto Path = MountPath.EnterRaw(File->first).Render();
-			std::cout << "Cleaning " << Path << std::endl;
-			if (File->second->Data)
+			ControlGuardT Guard(*this);
+			auto &Children = Root->Data.Get<DirectoryDataT>();
+			// Dropping a directory's name drops everything cached below it.
+			// Only the low-level API counts which names the kernel holds.
+			for (auto const &Child : Children)
 			{
-				if (!OOBRemoveFile(Path)) return false;
+				StripeGuardT ChildGuard(Stripes, {Child.second.get()});
+				if (!LowLevel || Child.second->Lookups) Cached.push_back(Child.first);
 			}
-			else 
+			Touch(Root);
+			Root->stat.st_nlink = 2;
+			std::swap(Saved->first, Children);
+			std::swap(Saved->second, Inodes);
+			Inodes.emplace(Root->stat.st_ino, Root);
+			if (Journaling())
 			{
-				if (!OOBRemoveDir(Path)) return false;
+				// Copied back so the saved tree never changes once it's shared
+				Log(Root, UndoT{Root, std::string(), [this, Saved](void)
+				{
+					auto &Children = Root->Data.Get<DirectoryDataT>();
+					Children = Saved->first;
+					Inodes = Saved->second;
+					for (auto const &Child : Children)
+					{
+						Child.second->Parent = Root;
+						Child.second->Name = Child.first;
+					}
+				}});
 			}
+			// Out of band changes don't wait for a sync
+			Settle();
+		}
+		// Removed directories keep their parent links, PathOf checks them
+		Notify->Entries(FUSE_ROOT_ID, std::move(Cached));
+		Notify->Inode(FUSE_ROOT_ID);
+		FlushNotices();
+		// Freeing a large tree takes a while, so it's done in the background
+		Notify->Release(std::move(Saved));
+		return true;
+	}
+
+	void Snapshot(std::string const &Name)
+	{
+		ControlGuardT Guard(*this);
+		// Changes from here on are journaled; the new epoch makes every
+		// existing node and chunk copy-on-write
+		Snapshots[Name] = Journal.size();
+		Epoch = ++Clock;
+	}
+
+	bool Restore(std::string const &Name)
+	{
+		std::map<fuse_ino_t, std::set<std::string>> Cached;
+		{
+			ControlGuardT Guard(*this);
+			auto Found = Snapshots.find(Name);
+			if (Found == Snapshots.end()) return false;
+			Rollback(Found->second, [](UndoT const &) { return RevertT{true, 0}; }, Cached);
+			Settle();
+		}
+		for (auto &Directory : Cached)
+			Notify->Entries(Directory.first, std::vector<std::string>(Directory.second.begin(), Directory.second.end()));
+		FlushNotices();
+		return true;
+	}
+
+	bool DropSnapshot(std::string const &Name)
+	{
+		ControlGuardT Guard(*this);
+		if (!Snapshots.erase(Name)) return false;
+		if (Snapshots.empty())
+		{
+			if (Tracking) CompactJournal();
+			else Journal.clear();
+			return true;
+		}
+		// Nothing before the earliest remaining snapshot can be restored, or
+		// lost in a crash
+		size_t Earliest = Tracking ? DurablePosition : Journal.size();
+		for (auto const &Snapshot : Snapshots) Earliest = std::min(Earliest, Snapshot.second);
+		Journal.erase(Journal.begin(), Journal.begin() + Earliest);
+		for (auto &Snapshot : Snapshots) Snapshot.second -= Earliest;
+		if (Tracking) DurablePosition -= Earliest;
+		return true;
+	}
+
+	// Starts recording which changes have been synced.  The state when
+	// tracking starts counts as durable.
+	void TrackDurability(bool On)
+	{
+		ControlGuardT Guard(*this);
+		Tracking = On;
+		Epoch = ++Clock;
+		Settle();
+	}
+
+	// Rolls back every change not covered by an fsync or fsyncdir, as if
+	// the machine lost power.  With Survive above 0 each unsynced chunk of
+	// file data is kept with that probability, so later writes can persist
+	// while earlier ones are lost, and with Tear a kept chunk may keep only
+	// some of its sectors.  False if durability isn't tracked.
+	bool Crash(uint64_t Seed, double Survive, bool Tear)
+	{
+		std::map<fuse_ino_t, std::set<std::string>> Cached;
+		{
+			ControlGuardT Guard(*this);
+			if (!Tracking) return false;
+			std::mt19937_64 Random(Seed);
+			auto const Sectors = RegularFileDataT::ChunkSize / SectorSize;
+			auto Decide = [&](UndoT const &Undo)
+			{
+				if (Undo.Owner->Synced.load(std::memory_order_relaxed) >= Undo.Sequence)
+					return RevertT{false, 0};
+				if (!Undo.Tear || (std::uniform_real_distribution<double>()(Random) >= Survive))
+					return RevertT{true, 0};
+				if (!Tear) return RevertT{false, 0};
+				auto const Keep = std::uniform_int_distribution<size_t>(0, Sectors)(Random);
+				if (Keep == Sectors) return RevertT{false, 0};
+				return RevertT{true, Keep * SectorSize};
+			};
+			Rollback(DurablePosition, Decide, Cached);
+			// What survived is on disk now
+			Settle();
+		}
+		for (auto &Directory : Cached)
+			Notify->Entries(Directory.first, std::vector<std::string>(Directory.second.begin(), Directory.second.end()));
+		FlushNotices();
+		return true;
+	}
+
+	bool Extents(std::string const &Path, std::vector<std::pair<off_t, off_t>> &Out)
+	{
+		ControlGuardT Guard(*this, true);
+		auto Found = Find(Path.c_str());
+		if (!Found || !Found->Data.Is<RegularFileDataT>()) return false;
+		std::lock_guard<std::mutex> NodeGuard(Stripes.For(Found.get()));
+		auto const &Data = Found->Data.Get<RegularFileDataT>();
+		off_t Start = 0;
+		while (true)
+		{
+			Start = Data.SeekData(Start);
+			if (Start < 0) break;
+			auto const End = Data.SeekHole(Start);
+			Out.emplace_back(Start, End - Start);
+			Start = End;
 		}
-		Files.clear(); 
-		Files.emplace(std::string("/"), Root);
 		return true;
 	}
 
+	void SetNotify(KernelNotifyT &Notify)
+	{
+		this->Notify = &Notify;
+	}
+
+	void SetDelays(DelayQueueT &Delays)
+	{
+		this->Delays = &Delays;
+	}
+
+	// For the glue, false if the request has to go on undelayed
+	bool Defer(std::chrono::nanoseconds Delay, size_t Bytes, function<void(void)> &&Job)
+	{
+		return Delays && Delays->Add(Delay, Bytes, std::move(Job));
+	}
+
 	void SetCount(int64_t Count) 
 	{ 
-		std::lock_guard<std::mutex> Guard(Mutex);
-		OperationCount = Count; 
-		std::cout << "Count is now " << OperationCount << std::endl;
+		OperationCount.store(Count); 
+		if (Count == 0) InvalidateKnown();
+		LOG(Info, "Count is now " << Count);
 	}
 
 	int64_t GetCount(void) const 
 	{ 
-		std::lock_guard<std::mutex> Guard(Mutex);
-		return OperationCount; 
+		return OperationCount.load(); 
+	}
+
+	// Cached attributes and data are dropped so the operations reach the
+	// rules rather than being answered by the kernel
+	void SetFault(OperationT Kind, FaultRuleT const &Rule)
+	{
+		{
+			ControlGuardT Guard(*this);
+			Faults.Set(Kind, Rule);
+		}
+		InvalidateKnown();
+	}
+
+	// Path rules only see paths the filesystem can work out: a file with
+	// several links is found through the one made last
+	void SetPathFault(std::string const &Pattern, uint32_t Kinds, FaultRuleT const &Rule)
+	{
+		{
+			ControlGuardT Guard(*this);
+			Faults.SetPath(Pattern, Kinds, Rule);
+		}
+		InvalidateKnown();
+	}
+
+	void SetFaultRates(uint64_t Seed, std::array<double, static_cast<size_t>(OperationT::Count)> const &Rates, int Error)
+	{
+		{
+			ControlGuardT Guard(*this);
+			Faults.SetRates(Seed, Rates, Error);
+		}
+		InvalidateKnown();
+	}
+
+	// Doesn't wait on operations
+	std::vector<FaultsT::InjectedT> GetFaultLog(uint64_t &Seed, uint64_t &Dropped)
+	{
+		Seed = Faults.GetSeed();
+		return Faults.GetLog(Dropped);
+	}
+
+	// Doesn't wait on operations
+	std::vector<FaultsT::SplitRecordT> GetSplitLog(uint64_t &Dropped)
+	{
+		return Faults.GetSplits(Dropped);
+	}
+
+	// False, with errno set, if the file can't be opened.  A file in the
+	// mount would record writes to itself.
+	bool StartRecording(std::string const &Path, bool Hashes)
+	{
+		auto const Qualified = Filesystem::PathT::Qualify(Path).Render();
+		auto const Mount = MountPath.Render();
+		if ((Qualified == Mount) || (Qualified.compare(0, Mount.size() + 1, Mount + "/") == 0))
+		{
+			errno = EINVAL;
+			return false;
+		}
+		return Recorder().Start(Qualified, Hashes);
+	}
+
+	void ClearFaults(void)
+	{
+		ControlGuardT Guard(*this);
+		Faults.Clear();
+	}
+
+	void SetLatency(OperationT Kind, LatencyRuleT const &Rule)
+	{
+		ControlGuardT Guard(*this);
+		Latency.Set(Kind, Rule);
+	}
+
+	void SetPathLatency(std::string const &Pattern, uint32_t Kinds, LatencyRuleT const &Rule)
+	{
+		ControlGuardT Guard(*this);
+		Latency.SetPath(Pattern, Kinds, Rule);
+	}
+
+	void ClearLatency(void)
+	{
+		ControlGuardT Guard(*this);
+		Latency.Clear();
+	}
+
+	void SetProcessFilter(std::set<pid_t> &&Pids, std::set<pid_t> &&Roots, std::set<pid_t> &&Groups)
+	{
+		ControlGuardT Guard(*this);
+		Processes.Set(std::move(Pids), std::move(Roots), std::move(Groups));
+	}
+
+	void ClearProcessFilter(void)
+	{
+		ControlGuardT Guard(*this);
+		Processes.Clear();
+	}
+
+	// Runs the control commands Body makes with operations excluded
+	// throughout, so no operation sees the state between two of them.  The
+	// commands don't lock for themselves meanwhile, and waiting on kernel
+	// notifications is left until operations can run again.
+	template <typename BodyT> void Batch(BodyT &&Body)
+	{
+		{
+			std::lock_guard<std::shared_timed_mutex> Guard(Mutex);
+			Batching = true;
+			FinallyT Done([this](void) { Batching = false; });
+			Body();
+		}
+		Notify->Flush();
 	}
 
 	// FuseT interface
+	//
+	// Operations share the filesystem lock, which is only taken exclusively by
+	// the control commands that replace whole trees.  Within an operation each
+	// node touched is locked through its stripe: a directory's stripe guards
+	// its entries, a node's stripe guards its stat and data.  Node type,
+	// inode number and symlink targets never change and are read unlocked.
 	void OperationBegin(bool const OutOfBand)
 	{
 		Assert(!OutOfBand);
-		Mutex.lock();
+		Mutex.lock_shared();
 	}
 
 	void OperationEnd(bool const OutOfBand)
 	{
 		Assert(!OutOfBand);
-		Mutex.unlock();
+		Mutex.unlock_shared();
+	}
+
+// Describes the operation for tracing and recording.  Then delays it by any
+// injected latency and counts it against the failure countdown and the fault
+// rules, unless the caller is filtered out.  Only the first check in a
+// request can delay it.
+#define OPER(...) \
+	if (TracerT::Enabled || Recorder().Active()) Describe(__VA_ARGS__); \
+	if (CallerWatched()) \
+	{ \
+		if (!RequestDelay().Checked) \
+		{ \
+			RequestDelay().Checked = true; \
+			RequestDelay().Delay = Latency.Sample(__VA_ARGS__); \
+			if (RequestDelay().Delay.count()) return DelayRequest; \
+		} \
+		if (!DecrementCount()) \
+		{ \
+			if (TracerT::Enabled && CurrentSpan()) CurrentSpan()->Flags |= TraceRecordT::Tripped; \
+			return -EIO; \
+		} \
+		auto const Fault = Faults.Check(__VA_ARGS__); \
+		if (Fault) return Fault; \
 	}
 
-#define OPER if (!DecrementCount()) return -EIO;
+	// Path interface, for the high-level API
+	//
+	// Each operation resolves its path and calls the node interface.
+
+	// Out-of-band requests come from control commands that hold the
+	// filesystem exclusively, so the tree is read as is and nothing is counted
+	int OutOfBandStat(char const *Path, struct stat &Out)
+	{
+		auto Found = Find(Path);
+		if (!Found) return -ENOENT;
+		GetAttributes(*Found, Out);
+		return 0;
+	}
 
 	int getattr(bool const OutOfBand, const char *path, struct stat *buf)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(path);
-		if (Found == Files.end()) return -ENOENT;
-		*buf = Found->second->stat;
+		OPER(OperationT::getattr, AtPath(path))
+		auto Found = Find(path);
+		if (!Found) return -ENOENT;
+		GetAttributes(*Found, *buf);
 		return 0;
 	}
 
 	int opendir(bool const OutOfBand, const char *path, struct fuse_file_info *fi)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(path);
-		if (Found == Files.end()) return -ENOENT;
-		if (!CheckPermission(
-			*Found->second,
-			(fi->flags == O_RDONLY) || (fi->flags == O_RDWR),
-			(fi->flags == O_WRONLY) || (fi->flags == O_RDWR),
-			false)) return -EACCES;
-		if (Found->second->Data) 
-		{
-			/*if (Found->second->Data.Is<SymlinkPathT>())
-			{
-				auto Found2 = Files.find(Found->second->Data.Get<SymlinkPathT>());
-				if (Found2 == Files.end()) return -ENOENT;
-				if (Found2->second->Data) return -ENOTDIR;
-			}
-			else*/ return -ENOTDIR;
-		}
-		return 0;
+		OPER(OperationT::opendir, AtPath(path))
+		auto Found = Find(path);
+		if (!Found) return -ENOENT;
+		return OpenDirectory(PathCaller(), *Found, fi);
 	}
 
 	int readdir(bool const OutOfBand, const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 	{
-		std::cout << "reading dir [" << path << "]" << std::endl;
+		LOG(Debug, "Reading directory [" << path << "]");
 		Assert(!OutOfBand);
-		OPER
-		std::string Path(path);
-		off_t Count = 0;
-		for (auto Test = ++Files.lower_bound(Path); IterInDir(Test, Path); ++Test)
+		OPER(OperationT::readdir, AtPath(path))
+		if (auto Record = Noting()) Record->Offset = offset;
+		auto Found = Find(path);
+		if (!Found) return -ENOENT;
+		return ReadDirectory(*Found, offset, [&](std::string const &Name, struct stat const &Entry, off_t Next)
 		{
-			OPER
-			Count += 1;
-			std::cout << "rd " << Test->first << " @" << Count << std::endl;
-			if (Count <= offset) continue;
-			auto Filename = Test->first.substr(Path.size() == 1 ? 1 : Path.size() + 1);
-			std::cout << "\tfn " << Filename << std::endl;
-			if (Filename.find_first_of('/') != std::string::npos) continue;
-			std::cout << "\tg" << std::endl;
-			if (filler(buf, Filename.c_str(), &Test->second->stat, Count)) break;
-		}
-		return 0;
+			return filler(buf, Name.c_str(), &Entry, Next) == 0;
+		});
 	}
 
 	int mkdir(bool const OutOfBand, const char *path, mode_t mode)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Root = Files.emplace(std::string(path), std::make_shared<FileT>()).first;
-		auto const &fuse_context = *fuse_get_context();
-		Root->second->stat.st_uid = fuse_context.uid;
-		Root->second->stat.st_gid = fuse_context.gid;
-		Root->second->stat.st_mode = 
-			mode |
-			S_IFDIR;
-		this->IBCreate(path, true);
-		return 0;
+		OPER(OperationT::mkdir, AtPath(path))
+		if (auto Record = Noting()) Record->Mode = mode;
+		std::string Name;
+		auto Parent = FindParent(path, Name);
+		if (!Parent) return -ENOENT;
+		std::shared_ptr<FileT> Directory;
+		return MakeDirectory(PathCaller(), Parent, Name, mode, Directory);
 	}
 
 	int rmdir(bool const OutOfBand, const char *path)
 	{
 		Assert(!OutOfBand);
-		OPER
-		std::string Path(path);
-		auto Found = Files.find(path);
-		if (Found == Files.end()) return -ENOENT;
-		if (Found->second->Data) return -ENOTDIR;
-		auto Next = Found;
-		++Next;
-		if (IterInDir(Next, Path)) return -ENOTEMPTY;
-		Files.erase(Found);
-		this->IBRemove(Path);
-		return 0;
+		OPER(OperationT::rmdir, AtPath(path))
+		std::string Name;
+		auto Parent = FindParent(path, Name);
+		if (!Parent) return -ENOENT;
+		return RemoveDirectory(Parent, Name);
 	}
 
 	int create(bool const OutOfBand, const char *path, mode_t mode, struct fuse_file_info *fi)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Root = Files.emplace(std::string(path), std::make_shared<FileT>()).first;
-		auto const &fuse_context = *fuse_get_context();
-		Root->second->stat.st_uid = fuse_context.uid;
-		Root->second->stat.st_gid = fuse_context.gid;
-		Root->second->stat.st_mode = 
-			mode |
-			S_IFREG;
-		Root->second->Data = RegularFileDataT();
-		SetFile(fi, Root->second);
-		this->IBCreate(path, false);
-		return 0;
+		OPER(OperationT::create, AtPath(path))
+		std::string Name;
+		auto Parent = FindParent(path, Name);
+		if (!Parent) return -ENOENT;
+		std::shared_ptr<FileT> File;
+		auto const Result = CreateFile(PathCaller(), Parent, Name, mode, fi, File);
+		if (auto Record = Noting())
+		{
+			Record->Mode = mode;
+			Record->Flags = fi->flags;
+			Record->Handle = fi->fh;
+		}
+		return Result;
 	}
 	
 	int release(bool const OutOfBand, const char *path, struct fuse_file_info *fi)
 	{
 		Assert(!OutOfBand);
+		if (auto Record = Note(RecordFormatT::Release)) Record->Handle = fi->fh;
 		ClearFile(fi);
 		return 0;
 	}
@@ -239,293 +595,1781 @@ struct FilesystemT : OutOfBandControlT
 	int utimens(bool const OutOfBand, const char *path, const struct timespec tv[2])
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(path);
-		if (Found == Files.end()) return -ENOENT;
-		auto &stat = Found->second->stat;
-		stat.st_atim = tv[0];
-		stat.st_mtim = tv[1];
+		OPER(OperationT::utimens, AtPath(path))
+		auto Found = Find(path);
+		if (!Found) return -ENOENT;
+		struct stat Attributes;
+		Attributes.st_atim = tv[0];
+		Attributes.st_mtim = tv[1];
+		return SetAttributes(Found, Attributes, FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME);
+	}
+
+	// Data is never buffered, but the file's data and attributes are marked
+	// durable so crash doesn't roll them back
+	int fsync(bool const OutOfBand, const char *path, int datasync, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::fsync, AtPath(path))
+		if (auto Record = Noting()) Record->Handle = fi->fh;
+		Sync(GetFile(fi));
 		return 0;
 	}
 
-	int access(bool const OutOfBand, const char *path, int amode)
+	int fsyncdir(bool const OutOfBand, const char *path, int datasync, struct fuse_file_info *fi)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(path);
-		if (Found == Files.end()) return -ENOENT;
-		if (amode == F_OK) return 0;
-		if (!CheckPermission(
-			*Found->second, 
-			amode & R_OK,
-			amode & W_OK,
-			amode & X_OK)) return -EACCES;
+		OPER(OperationT::fsyncdir, AtPath(path))
+		auto Found = Find(path);
+		if (!Found) return -ENOENT;
+		Sync(Found);
 		return 0;
 	}
 
+	int access(bool const OutOfBand, const char *path, int amode)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::access, AtPath(path))
+		if (auto Record = Noting()) Record->Mode = amode;
+		auto Found = Find(path);
+		if (!Found) return -ENOENT;
+		return Access(PathCaller(), *Found, amode);
+	}
+
 	int unlink(bool const OutOfBand, const char *path)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(path);
-		if (Found == Files.end()) return -ENOENT;
-		if (!Found->second->Data) return -EPERM;
-		Files.erase(Found);
-		this->IBRemove(path);
-		return 0;
+		OPER(OperationT::unlink, AtPath(path))
+		std::string Name;
+		auto Parent = FindParent(path, Name);
+		if (!Parent) return -ENOENT;
+		return RemoveFile(Parent, Name);
 	}
 
 	int open(bool const OutOfBand, const char *path, struct fuse_file_info *fi)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(path);
-		if (Found == Files.end()) return -ENOENT;
-		if (!Found->second->Data) return -EPERM;
-		if (Found->second->Data.Is<SymlinkPathT>())
+		OPER(OperationT::open, AtPath(path))
+		auto Found = Find(path);
+		if (!Found) return -ENOENT;
+		auto const Result = Open(PathCaller(), Found, fi);
+		if (auto Record = Noting())
 		{
-			/*Found = Files.find(Found->second->Data.Get<SymlinkPathT>());
-			if (Found == Files.end())*/ return -ENOENT;
+			Record->Flags = fi->flags;
+			Record->Handle = fi->fh;
 		}
-		if (!CheckPermission(
-			*Found->second,
-			(fi->flags == O_RDONLY) || (fi->flags == O_RDWR),
-			(fi->flags == O_WRONLY) || (fi->flags == O_RDWR),
-			false)) return -EACCES;
-		SetFile(fi, Found->second);
-		return 0;
+		return Result;
 	}
 
 	int read(bool const OutOfBand, const char *path, char *out, size_t count, off_t start, struct fuse_file_info *fi)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto &File = GetFile(fi);
-		auto &Data = File.Data.Get<RegularFileDataT>();
-		size_t Good = 0;
-		size_t Zero = 0;
-		if ((unsigned int)start >= Data.size())
-			Zero = count;
-		else 
+		OPER(OperationT::read, AtPath(path), count)
+		if (auto Record = Noting())
 		{
-			Good = std::min(count, Data.size() - start);
-			Zero = count - Good;
+			Record->Handle = fi->fh;
+			Record->Offset = start;
 		}
-		if (Good)
-			memcpy(out, &Data[start], Good);
-		if (Zero)
-			memset(out + Good, 0, Zero);
-		return Good;
+		return Read(fi, out, SplitRead(fi, count, start), start);
 	}
 
-	int write(bool const OutOfBand, const char *path, const char *out, size_t count, off_t start, struct fuse_file_info *fi)
+	// libfuse's high-level API frees the segments returned by read_buf, so
+	// reads are only served in place by the low-level API
+	int write_buf(bool const OutOfBand, const char *path, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto &File = GetFile(fi);
-		auto &Data = File.Data.Get<RegularFileDataT>();
-		auto const End = start + count;
-		if (Data.size() < End)
+		OPER(OperationT::write, AtPath(path), fuse_buf_size(buf))
+		if (auto Record = Noting())
 		{
-			Data.resize(End);
-			File.stat.st_size = End;
+			Record->Handle = fi->fh;
+			Record->Offset = off;
+			Record->Hash = HashOf(*buf);
 		}
-		memcpy(&Data[start], out, count);
-		return count;
+		return Write(fi, *buf, off, TakeSplit());
 	}
 
 	int truncate(bool const OutOfBand, const char *path, off_t size)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(path);
-		if (Found == Files.end()) return -ENOENT;
-		if (!Found->second->Data) return -EPERM;
-		if (Found->second->Data.Is<SymlinkPathT>())
-		{
-			/*Found = Files.find(Found->second->Data.Get<SymlinkPathT>());
-			if (Found == Files.end())*/ return -ENOENT;
-		}
-		auto &File = *Found->second;
-		auto &Data = File.Data.Get<RegularFileDataT>();
-		off_t OldLength = Data.size();
-		size_t Zero = 0;
-		if (OldLength < size)
-			Zero = size - OldLength;
-		Data.resize(size);
-		if (Zero) memset(&Data[OldLength], 0, Zero);
-		File.stat.st_size = size;
-		return 0;
+		OPER(OperationT::truncate, AtPath(path))
+		if (auto Record = Noting()) Record->Size = size;
+		auto Found = Find(path);
+		if (!Found) return -ENOENT;
+		struct stat Attributes;
+		Attributes.st_size = size;
+		return SetAttributes(Found, Attributes, FUSE_SET_ATTR_SIZE);
+	}
+
+	int fallocate(bool const OutOfBand, const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::fallocate, AtPath(path))
+		if (auto Record = Noting())
+		{
+			Record->Handle = fi->fh;
+			Record->Mode = mode;
+			Record->Offset = offset;
+			Record->Size = length;
+		}
+		return Allocate(fi, mode, offset, length);
 	}
 
 	int chmod(bool const OutOfBand, const char *path, mode_t mode)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(path);
-		if (Found == Files.end()) return -ENOENT;
-		Found->second->stat.st_mode = mode;
-		return 0;
+		OPER(OperationT::chmod, AtPath(path))
+		if (auto Record = Noting()) Record->Mode = mode;
+		auto Found = Find(path);
+		if (!Found) return -ENOENT;
+		struct stat Attributes;
+		Attributes.st_mode = mode;
+		return SetAttributes(Found, Attributes, FUSE_SET_ATTR_MODE);
 	}
 
 	int chown(bool const OutOfBand, const char *path, uid_t uid, gid_t gid)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(path);
-		if (Found == Files.end()) return -ENOENT;
-		Found->second->stat.st_uid = uid;
-		Found->second->stat.st_gid = gid;
-		return 0;
+		OPER(OperationT::chown, AtPath(path))
+		if (auto Record = Noting())
+		{
+			Record->Offset = static_cast<int32_t>(uid);
+			Record->Size = static_cast<int32_t>(gid);
+		}
+		auto Found = Find(path);
+		if (!Found) return -ENOENT;
+		struct stat Attributes;
+		Attributes.st_uid = uid;
+		Attributes.st_gid = gid;
+		return SetAttributes(Found, Attributes, 
+			(uid != static_cast<uid_t>(-1) ? FUSE_SET_ATTR_UID : 0) | 
+			(gid != static_cast<gid_t>(-1) ? FUSE_SET_ATTR_GID : 0));
 	}
 
 	int rename(bool const OutOfBand, const char *from, const char *to)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(from);
-		if (Found == Files.end()) return -ENOENT;
-		Files.emplace(to, Found->second);
-		Files.erase(Found);
-		this->IBRename(from, to);
-		return 0;
+		OPER(OperationT::rename, AtPath(to))
+		if (auto Record = Noting())
+		{
+			Record->Path = PathOf(AtPath(from));
+			Record->Target = PathOf(AtPath(to));
+		}
+		std::string FromName, ToName;
+		auto FromParent = FindParent(from, FromName);
+		if (!FromParent) return -ENOENT;
+		auto ToParent = FindParent(to, ToName);
+		if (!ToParent) return -ENOENT;
+		return Rename(FromParent, FromName, ToParent, ToName);
 	}
 
 	int link(bool const OutOfBand, const char *from, const char *to)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(from);
-		if (Found == Files.end()) return -ENOENT;
-		Files.emplace(to, Found->second);
-		this->IBLink(from, to);
-		return 0;
+		OPER(OperationT::link, AtPath(to))
+		if (auto Record = Noting())
+		{
+			Record->Path = PathOf(AtPath(from));
+			Record->Target = PathOf(AtPath(to));
+		}
+		auto Found = Find(from);
+		if (!Found) return -ENOENT;
+		std::string Name;
+		auto Parent = FindParent(to, Name);
+		if (!Parent) return -ENOENT;
+		return Link(Found, Parent, Name);
 	}
 	
 	int symlink(bool const OutOfBand, const char *to, const char *from)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Result = Files.emplace(std::string(from), std::make_shared<FileT>());
-		auto Root = Result.first;
-		Root->second->Data = SymlinkPathT(to);
-		auto const &fuse_context = *fuse_get_context();
-		Root->second->stat.st_uid = fuse_context.uid;
-		Root->second->stat.st_gid = fuse_context.gid;
-		Root->second->stat.st_mode = 
-			S_IFLNK |
-			S_IRUSR | S_IWUSR | S_IXUSR |
-			S_IRGRP | S_IWGRP | S_IXGRP |
-			S_IROTH | S_IWOTH | S_IXOTH;
-		this->IBLink(from, to);
-		return 0;
+		OPER(OperationT::symlink, AtPath(from))
+		if (auto Record = Noting()) Record->Target = to;
+		std::string Name;
+		auto Parent = FindParent(from, Name);
+		if (!Parent) return -ENOENT;
+		std::shared_ptr<FileT> Link;
+		return Symlink(PathCaller(), to, Parent, Name, Link);
 	}
 
 	int readlink(bool const OutOfBand, char const *path, char *out, size_t out_size)
 	{
 		Assert(!OutOfBand);
-		OPER
-		auto Found = Files.find(path);
-		if (Found == Files.end()) return -ENOENT;
-		if (!Found->second->Data) return -EINVAL;
-		if (!Found->second->Data.Is<SymlinkPathT>()) return -EINVAL;
-		auto &Target = Found->second->Data.Get<SymlinkPathT>();
-		memcpy(out, Target.c_str(), std::min(out_size, Target.size()));
+		OPER(OperationT::readlink, AtPath(path))
+		auto Found = Find(path);
+		if (!Found) return -ENOENT;
+		if (!Found->Data.Is<SymlinkPathT>()) return -EINVAL;
+		auto &Target = Found->Data.Get<SymlinkPathT>();
+		if (out_size == 0) return -EINVAL;
+		auto const Length = std::min(out_size - 1, Target.size());
+		memcpy(out, Target.c_str(), Length);
+		out[Length] = 0;
 		return 0;
 	}
 
-	friend struct FuseT<FilesystemT>;
-	private:
-		// Utility methods
-		bool DecrementCount(void)
-		{
-			if (OperationCount < 0) return true;
-			if (OperationCount == 0) return false;
-			OperationCount -= 1;
-			return true;
-		}
+	// Inode interface, for the low-level API
+	//
+	// Node IDs are node addresses, apart from the root which is FUSE_ROOT_ID.
+	// Nodes are pinned while the kernel holds lookups on them, so an ID stays
+	// valid until it's forgotten even if the node is unlinked.  Methods reply
+	// themselves and return 0, or return an error for the glue to reply with.
 
-		template <typename IteratorT>
-			bool IterInDir(IteratorT const &Test, std::string const &Dir)
-		{
-			return 
-				(Test != Files.end()) &&
-				InDir(Test->first, Dir);
-		}
-	
-		bool InDir(std::string const &Test, std::string const &Dir)
-		{
-			return
-				(Test.size() > Dir.size()) &&
-				(Test.substr(0, Dir.size()) == Dir);
-		}
-	
-		bool CheckPermission(FileT &File, bool Read, bool Write, bool Execute)
+	int ll_lookup(bool const OutOfBand, fuse_req_t req, fuse_ino_t parent, const char *name)
+	{
+		if (!OutOfBand)
 		{
-			auto const &st_mode = File.stat.st_mode;
-			auto const &st_uid = File.stat.st_uid;
-			auto const &st_gid = File.stat.st_gid;
-			auto const &fuse_context = *fuse_get_context();
-			auto const uid = fuse_context.uid;
-			auto const gid = fuse_context.gid;
-			return
-				(
-					!Read ||
-					(
-						((st_mode & S_IRUSR) && (st_uid == uid)) ||
-						((st_mode & S_IRGRP) && (st_gid == gid)) ||
-						(st_mode & S_IROTH)
-					)
-				) ||
-				(
-					!Write ||
-					(
-						((st_mode & S_IWUSR) && (st_uid == uid)) ||
-						((st_mode & S_IWGRP) && (st_gid == gid)) ||
-						!(st_mode & S_IWOTH)
-					)
-				) ||
-				(
-					!Execute ||
-					(
-						((st_mode & S_IXUSR) && (st_uid == uid)) ||
-						((st_mode & S_IXGRP) && (st_gid == gid)) ||
-						!(st_mode & S_IXOTH)
-					)
-				);
+			OPER(OperationT::lookup, AtEntry(parent, name))
 		}
+		auto Parent = FromID(parent);
+		if (!Parent->IsDirectory()) return -ENOTDIR;
+		auto Found = LookupEntry(Parent, name);
+		if (!Found) return -ENOENT;
+		return ReplyEntry(req, Found);
+	}
 
-		void SetFile(struct fuse_file_info *fi, std::shared_ptr<FileT> File)
-		{
-			fi->fh = reinterpret_cast<uint64_t>(new std::shared_ptr<FileT>(std::move(File)));
-		}
+	void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+	{
+		Forget(ino, nlookup);
+		fuse_reply_none(req);
+	}
+
+	void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+	{
+		for (size_t Index = 0; Index < count; ++Index)
+			Forget(forgets[Index].ino, forgets[Index].nlookup);
+		fuse_reply_none(req);
+	}
 
-		FileT &GetFile(struct fuse_file_info *fi)
+	int ll_getattr(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+	{
+		if (!OutOfBand)
 		{
-			return **reinterpret_cast<std::shared_ptr<FileT> *>(fi->fh);
+			OPER(OperationT::getattr, AtNode(ino))
 		}
+		struct stat Attributes;
+		GetAttributes(*FromID(ino), Attributes);
+		fuse_reply_attr(req, &Attributes, AttributeTimeout);
+		return 0;
+	}
 
-		void ClearFile(struct fuse_file_info *fi)
+	int ll_setattr(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		// Counted as the call it stands in for
+		auto const Kind =
+			(to_set & FUSE_SET_ATTR_SIZE) ? OperationT::truncate :
+			(to_set & FUSE_SET_ATTR_MODE) ? OperationT::chmod :
+			(to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) ? OperationT::chown :
+			OperationT::utimens;
+		OPER(Kind, AtNode(ino))
+		if (auto Record = Noting())
 		{
-			delete reinterpret_cast<std::shared_ptr<FileT> *>(fi->fh);
+			Record->Mode = attr->st_mode;
+			Record->Size = attr->st_size;
+			if (Kind == OperationT::chown)
+			{
+				Record->Offset = (to_set & FUSE_SET_ATTR_UID) ? static_cast<int32_t>(attr->st_uid) : -1;
+				Record->Size = (to_set & FUSE_SET_ATTR_GID) ? static_cast<int32_t>(attr->st_gid) : -1;
+			}
 		}
+		auto Found = FromID(ino);
+		auto Result = SetAttributes(Found, *attr, to_set);
+		if (Result < 0) return Result;
+		struct stat Attributes;
+		GetAttributes(*Found, Attributes);
+		fuse_reply_attr(req, &Attributes, AttributeTimeout);
+		return 0;
+	}
 
-		Filesystem::PathT MountPath;
+	int ll_readlink(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::readlink, AtNode(ino))
+		auto Found = FromID(ino);
+		if (!Found->Data.Is<SymlinkPathT>()) return -EINVAL;
+		fuse_reply_readlink(req, Found->Data.Get<SymlinkPathT>().c_str());
+		return 0;
+	}
 
-		std::mutex &Mutex;
-		int64_t OperationCount;
+	int ll_mkdir(bool const OutOfBand, fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::mkdir, AtEntry(parent, name))
+		if (auto Record = Noting()) Record->Mode = mode;
+		std::shared_ptr<FileT> Directory;
+		auto Result = MakeDirectory(RequestCaller(req), FromID(parent), name, mode, Directory);
+		if (Result < 0) return Result;
+		return ReplyEntry(req, Directory);
+	}
 
-		std::shared_ptr<FileT> Root;
+	int ll_unlink(bool const OutOfBand, fuse_req_t req, fuse_ino_t parent, const char *name)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::unlink, AtEntry(parent, name))
+		auto Result = RemoveFile(FromID(parent), name);
+		if (Result < 0) return Result;
+		fuse_reply_err(req, 0);
+		return 0;
+	}
 
-		std::map<std::string, std::shared_ptr<FileT>> Files;
-};
+	int ll_rmdir(bool const OutOfBand, fuse_req_t req, fuse_ino_t parent, const char *name)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::rmdir, AtEntry(parent, name))
+		auto Result = RemoveDirectory(FromID(parent), name);
+		if (Result < 0) return Result;
+		fuse_reply_err(req, 0);
+		return 0;
+	}
 
-int main(int argc, char **argv)
-{
-	try
+	int ll_symlink(bool const OutOfBand, fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
 	{
-		// Configure
-		if (argc < 2) throw UserErrorT() << "You must specify the mount point on the command line.";
+		Assert(!OutOfBand);
+		OPER(OperationT::symlink, AtEntry(parent, name))
+		if (auto Record = Noting()) Record->Target = link;
+		std::shared_ptr<FileT> Link;
+		auto Result = Symlink(RequestCaller(req), link, FromID(parent), name, Link);
+		if (Result < 0) return Result;
+		return ReplyEntry(req, Link);
+	}
+
+	int ll_rename(bool const OutOfBand, fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::rename, AtEntry(newparent, newname))
+		if (auto Record = Noting())
+		{
+			Record->Path = PathOf(AtEntry(parent, name));
+			Record->Target = PathOf(AtEntry(newparent, newname));
+		}
+		auto Result = Rename(FromID(parent), name, FromID(newparent), newname);
+		if (Result < 0) return Result;
+		fuse_reply_err(req, 0);
+		return 0;
+	}
+
+	int ll_link(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::link, AtEntry(newparent, newname))
+		if (auto Record = Noting())
+		{
+			Record->Path = PathOf(AtNode(ino));
+			Record->Target = PathOf(AtEntry(newparent, newname));
+		}
+		auto Found = FromID(ino);
+		auto Result = Link(Found, FromID(newparent), newname);
+		if (Result < 0) return Result;
+		return ReplyEntry(req, Found);
+	}
+
+	int ll_open(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::open, AtNode(ino))
+		auto Result = Open(RequestCaller(req), FromID(ino), fi);
+		if (auto Record = Noting())
+		{
+			Record->Flags = fi->flags;
+			Record->Handle = fi->fh;
+		}
+		if (Result < 0) return Result;
+		fuse_reply_open(req, fi);
+		return 0;
+	}
+
+	int ll_read(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::read, AtNode(ino), size)
+		if (auto Record = Noting())
+		{
+			Record->Handle = fi->fh;
+			Record->Offset = off;
+		}
+		// Replies with the storage itself, no copy
+		ReadInPlace(fi, SplitRead(fi, size, off), off, [&](std::vector<struct iovec> const &Segments)
+		{
+			fuse_reply_iov(req, Segments.data(), Segments.size());
+		});
+		return 0;
+	}
+
+	int ll_write_buf(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::write, AtNode(ino), fuse_buf_size(bufv))
+		if (auto Record = Noting())
+		{
+			Record->Handle = fi->fh;
+			Record->Offset = off;
+			Record->Hash = HashOf(*bufv);
+		}
+		auto Result = Write(fi, *bufv, off, TakeSplit());
+		if (Result < 0) return Result;
+		fuse_reply_write(req, Result);
+		return 0;
+	}
+
+	int ll_release(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		if (auto Record = Note(RecordFormatT::Release)) Record->Handle = fi->fh;
+		ClearFile(fi);
+		fuse_reply_err(req, 0);
+		return 0;
+	}
+
+	int ll_opendir(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::opendir, AtNode(ino))
+		auto Result = OpenDirectory(RequestCaller(req), *FromID(ino), fi);
+		if (Result < 0) return Result;
+		fuse_reply_open(req, fi);
+		return 0;
+	}
+
+	int ll_readdir(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::readdir, AtNode(ino))
+		if (auto Record = Noting())
+		{
+			Record->Offset = off;
+			Record->Size = size;
+		}
+		std::vector<char> Buffer(size);
+		size_t Used = 0;
+		auto Result = ReadDirectory(*FromID(ino), off, [&](std::string const &Name, struct stat const &Entry, off_t Next)
+		{
+			auto const Needed = fuse_add_direntry(req, Buffer.data() + Used, size - Used, Name.c_str(), &Entry, Next);
+			if (Needed > size - Used) return false;
+			Used += Needed;
+			return true;
+		});
+		if (Result < 0) return Result;
+		fuse_reply_buf(req, Buffer.data(), Used);
+		return 0;
+	}
+
+	int ll_fsync(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::fsync, AtNode(ino))
+		if (auto Record = Noting()) Record->Handle = fi ? fi->fh : 0;
+		Sync(FromID(ino));
+		fuse_reply_err(req, 0);
+		return 0;
+	}
+
+	int ll_fsyncdir(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::fsyncdir, AtNode(ino))
+		Sync(FromID(ino));
+		fuse_reply_err(req, 0);
+		return 0;
+	}
+
+	int ll_access(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, int mask)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::access, AtNode(ino))
+		if (auto Record = Noting()) Record->Mode = mask;
+		auto Result = Access(RequestCaller(req), *FromID(ino), mask);
+		if (Result < 0) return Result;
+		fuse_reply_err(req, 0);
+		return 0;
+	}
+
+	int ll_create(bool const OutOfBand, fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::create, AtEntry(parent, name))
+		std::shared_ptr<FileT> File;
+		auto Result = CreateFile(RequestCaller(req), FromID(parent), name, mode, fi, File);
+		if (auto Record = Noting())
+		{
+			Record->Mode = mode;
+			Record->Flags = fi->flags;
+			Record->Handle = fi->fh;
+		}
+		if (Result < 0) return Result;
+		fuse_entry_param Entry;
+		Remember(File, Entry);
+		fuse_reply_create(req, &Entry, fi);
+		return 0;
+	}
+
+	int ll_fallocate(bool const OutOfBand, fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+	{
+		Assert(!OutOfBand);
+		OPER(OperationT::fallocate, AtNode(ino))
+		if (auto Record = Noting())
+		{
+			Record->Handle = fi->fh;
+			Record->Mode = mode;
+			Record->Offset = offset;
+			Record->Size = length;
+		}
+		auto Result = Allocate(fi, mode, offset, length);
+		if (Result < 0) return Result;
+		fuse_reply_err(req, 0);
+		return 0;
+	}
+
+	friend struct FuseT<FilesystemT>;
+	private:
+		static constexpr ino_t RootInode = 1;
+
+		// Utility methods
+		// Worked out once per request, since readdir checks every entry
+		bool CallerWatched(void)
+		{
+			auto &Watched = RequestWatched();
+			if (Watched < 0) Watched = Processes.Watched(RequestPid()) ? 1 : 0;
+			return Watched;
+		}
+
+		// Exactly Count operations succeed across all threads.  Once tripped
+		// the count stays at 0 until it's set again; negative disables it.
+		bool DecrementCount(void)
+		{
+			auto Count = OperationCount.load(std::memory_order_relaxed);
+			while (true)
+			{
+				if (Count < 0) return true;
+				if (Count == 0) return false;
+				if (OperationCount.compare_exchange_weak(Count, Count - 1, std::memory_order_relaxed)) 
+				{
+					// Cached state would let operations keep succeeding
+					if (Count == 1) InvalidateKnown();
+					return true;
+				}
+			}
+		}
+
+		// Gives the traced span and the recorded request their kind, path and
+		// size, from the first check in the request.  Takes the same arguments
+		// as FaultsT::Check.
+		template <typename LocateT> void Describe(OperationT Kind, LocateT &&Locate, size_t Bytes = 0)
+		{
+			auto Span = CurrentSpan();
+			if (Span && Span->Located) Span = nullptr;
+			auto Record = (RequestRecord().Kind == RequestRecordT::Unset) ? 
+				Note(static_cast<uint8_t>(Kind)) : nullptr;
+			if (!Span && !Record) return;
+			auto const Path = PathOf(Locate);
+			if (Span)
+			{
+				Span->Located = true;
+				Span->Bytes = Bytes;
+				Span->SetPath(Path);
+			}
+			if (Record)
+			{
+				Record->Path = Path;
+				Record->Size = Bytes;
+			}
+		}
+
+		// The request's record, set to Kind, or null if not recording
+		RequestRecordT *Note(uint8_t Kind)
+		{
+			if (!Recorder().Active()) return nullptr;
+			auto &Record = RequestRecord();
+			Record.Clear();
+			Record.Kind = Kind;
+			return &Record;
+		}
+
+		// The request's record once described, or null if not recording
+		RequestRecordT *Noting(void)
+		{
+			if (!Recorder().Active() || (RequestRecord().Kind == RequestRecordT::Unset)) return nullptr;
+			return &RequestRecord();
+		}
+
+		// Empty if the locator finds nothing.  Takes a locator like AtNode.
+		template <typename LocateT> std::string PathOf(LocateT &&Locate)
+		{
+			RulePathT Path;
+			if (!Locate(Path)) return {};
+			std::string Joined;
+			for (auto const &Part : Path) Joined += "/" + Part;
+			return Joined.empty() ? "/" : Joined;
+		}
+
+		// 0 if any of the data is still in a pipe, rather than a hash of part
+		// of it
+		static uint64_t HashOf(struct fuse_bufvec const &In)
+		{
+			if (!Recorder().Hashes()) return 0;
+			auto Hash = RecordFormatT::HashStart;
+			for (size_t Index = 0; Index < In.count; ++Index)
+			{
+				if (In.buf[Index].flags & FUSE_BUF_IS_FD) return 0;
+				Hash = RecordFormatT::Hash(Hash, In.buf[Index].mem, In.buf[Index].size);
+			}
+			return Hash;
+		}
+
+		// Whether Node is Ancestor or inside it.  Directory parent links only
+		// change under the rename mutex or when an empty directory is removed.
+		bool Within(std::shared_ptr<FileT> Node, FileT const &Ancestor)
+		{
+			while (Node)
+			{
+				if (Node.get() == &Ancestor) return true;
+				Node = Node->Parent.lock();
+			}
+			return false;
+		}
+
+		template <typename DataT> std::shared_ptr<FileT> CreateNode(DataT &&Data)
+		{
+			std::shared_ptr<FileT> Node;
+			try
+			{
+				Node = std::allocate_shared<FileT>(PoolAllocatorT<FileT>());
+			}
+			catch (std::bad_alloc const &)
+			{
+				return nullptr;
+			}
+			Node->stat.st_ino = NextInode++;
+			Node->Data = std::forward<DataT>(Data);
+			Node->Epoch = Epoch;
+			SetInode(Node->stat.st_ino, Node);
+			return Node;
+		}
+
+		void UpdateSize(FileT &File)
+		{
+			auto const &Data = File.Data.Get<RegularFileDataT>();
+			File.stat.st_size = Data.Size();
+			File.stat.st_blocks = Data.Allocated() / 512;
+		}
+
+		void DropLink(std::shared_ptr<FileT> const &Node)
+		{
+			// Open handles keep their own reference, so data outlives the last link
+			Touch(Node);
+			Node->stat.st_nlink -= Node->IsDirectory() ? 2 : 1;
+			Node->stat.st_ctim = Now();
+			if (Node->stat.st_nlink == 0) SetInode(Node->stat.st_ino, nullptr);
+		}
+
+		// Node interface
+		//
+		// Shared by the path and inode interfaces.  Each method takes the
+		// stripes it needs itself, so callers only resolve nodes.
+		struct CallerT
+		{
+			uid_t uid;
+			gid_t gid;
+		};
+
+		static CallerT PathCaller(void)
+		{
+			auto const &fuse_context = *fuse_get_context();
+			return {fuse_context.uid, fuse_context.gid};
+		}
+
+		static CallerT RequestCaller(fuse_req_t req)
+		{
+			auto const &fuse_context = *fuse_req_ctx(req);
+			return {fuse_context.uid, fuse_context.gid};
+		}
+
+		void GetAttributes(FileT &Node, struct stat &Out)
+		{
+			StripeGuardT Guard(Stripes, {&Node});
+			Out = Node.stat;
+		}
+
+		int OpenDirectory(CallerT const &Caller, FileT &Directory, struct fuse_file_info *fi)
+		{
+			StripeGuardT Guard(Stripes, {&Directory});
+			if (!CheckPermission(
+				Caller,
+				Directory,
+				(fi->flags == O_RDONLY) || (fi->flags == O_RDWR),
+				(fi->flags == O_WRONLY) || (fi->flags == O_RDWR),
+				false)) return -EACCES;
+			if (!Directory.IsDirectory()) return -ENOTDIR;
+			return 0;
+		}
+
+		// Fill returns false once the output is full
+		template <typename FillT> int ReadDirectory(FileT &Directory, off_t Offset, FillT &&Fill)
+		{
+			if (!Directory.IsDirectory()) return -ENOTDIR;
+			// Located before the directory is locked, since locating locks it
+			RulePathT Path;
+			auto const Located = (Faults.Scoped(OperationT::readdir) || TracerT::Enabled) && Locate(Directory, Path);
+			StripeGuardT Guard(Stripes, {&Directory});
+			off_t Count = 0;
+			for (auto const &Child : Directory.Data.Get<DirectoryDataT>())
+			{
+				OPER(OperationT::readdir, [&](RulePathT &Out) { Out = Path; return Located; })
+				Count += 1;
+				LOG(Trace, "Directory entry [" << Child.first << "] at " << Count);
+				if (Count <= Offset) continue;
+				// Only the inode and type are used here, and they don't need the
+				// child's lock
+				struct stat Entry;
+				memset(&Entry, 0, sizeof(Entry));
+				Entry.st_ino = Child.second->stat.st_ino;
+				Entry.st_mode = Child.second->Type();
+				if (!Fill(Child.first, Entry, Count)) break;
+			}
+			return 0;
+		}
+
+		int MakeDirectory(CallerT const &Caller, std::shared_ptr<FileT> const &Parent, std::string const &Name, mode_t Mode, std::shared_ptr<FileT> &Out)
+		{
+			if (!Parent->IsDirectory()) return -ENOTDIR;
+			StripeGuardT Guard(Stripes, {Parent.get()});
+			if (Parent->Data.Get<DirectoryDataT>().count(Name)) return -EEXIST;
+			auto Directory = CreateNode(DirectoryDataT());
+			if (!Directory) return -ENOSPC;
+			Directory->stat.st_uid = Caller.uid;
+			Directory->stat.st_gid = Caller.gid;
+			Directory->stat.st_mode = 
+				Mode |
+				S_IFDIR;
+			Directory->stat.st_nlink = 2;
+			Out = Directory;
+			SetChild(Parent, Name, std::move(Directory));
+			Touch(Parent);
+			Parent->stat.st_nlink += 1;
+			return 0;
+		}
+
+		int RemoveDirectory(std::shared_ptr<FileT> const &Parent, std::string const &Name)
+		{
+			if (!Parent->IsDirectory()) return -ENOTDIR;
+			StripeGuardT Guard(Stripes);
+			std::shared_ptr<FileT> Directory;
+			do
+			{
+				Guard.Unlock();
+				Directory = LookupEntry(Parent, Name);
+				if (!Directory) return -ENOENT;
+				Guard.Lock({Parent.get(), Directory.get()});
+			} while (Entry(*Parent, Name) != Directory);
+			if (!Directory->IsDirectory()) return -ENOTDIR;
+			if (!Directory->Data.Get<DirectoryDataT>().empty()) return -ENOTEMPTY;
+			DropLink(Directory);
+			SetChild(Parent, Name, nullptr);
+			Touch(Parent);
+			Parent->stat.st_nlink -= 1;
+			return 0;
+		}
+
+		int RemoveFile(std::shared_ptr<FileT> const &Parent, std::string const &Name)
+		{
+			if (!Parent->IsDirectory()) return -ENOTDIR;
+			StripeGuardT Guard(Stripes);
+			std::shared_ptr<FileT> File;
+			do
+			{
+				Guard.Unlock();
+				File = LookupEntry(Parent, Name);
+				if (!File) return -ENOENT;
+				Guard.Lock({Parent.get(), File.get()});
+			} while (Entry(*Parent, Name) != File);
+			if (File->IsDirectory()) return -EPERM;
+			DropLink(File);
+			SetChild(Parent, Name, nullptr);
+			return 0;
+		}
+
+		int CreateFile(CallerT const &Caller, std::shared_ptr<FileT> const &Parent, std::string const &Name, mode_t Mode, struct fuse_file_info *fi, std::shared_ptr<FileT> &Out)
+		{
+			if (!Parent->IsDirectory()) return -ENOTDIR;
+			StripeGuardT Guard(Stripes, {Parent.get()});
+			if (Parent->Data.Get<DirectoryDataT>().count(Name)) return -EEXIST;
+			auto File = CreateNode(RegularFileDataT());
+			if (!File) return -ENOSPC;
+			File->stat.st_uid = Caller.uid;
+			File->stat.st_gid = Caller.gid;
+			File->stat.st_mode = 
+				Mode |
+				S_IFREG;
+			File->stat.st_nlink = 1;
+			if (!SetFile(fi, File))
+			{
+				SetInode(File->stat.st_ino, nullptr);
+				return -ENOSPC;
+			}
+			Out = File;
+			SetChild(Parent, Name, std::move(File));
+			return 0;
+		}
+
+		int Symlink(CallerT const &Caller, char const *Target, std::shared_ptr<FileT> const &Parent, std::string const &Name, std::shared_ptr<FileT> &Out)
+		{
+			if (!Parent->IsDirectory()) return -ENOTDIR;
+			StripeGuardT Guard(Stripes, {Parent.get()});
+			if (Parent->Data.Get<DirectoryDataT>().count(Name)) return -EEXIST;
+			auto Link = CreateNode(SymlinkPathT(Target));
+			if (!Link) return -ENOSPC;
+			Link->stat.st_uid = Caller.uid;
+			Link->stat.st_gid = Caller.gid;
+			Link->stat.st_mode = 
+				S_IFLNK |
+				S_IRUSR | S_IWUSR | S_IXUSR |
+				S_IRGRP | S_IWGRP | S_IXGRP |
+				S_IROTH | S_IWOTH | S_IXOTH;
+			Link->stat.st_nlink = 1;
+			Link->stat.st_size = strlen(Target);
+			Out = Link;
+			SetChild(Parent, Name, std::move(Link));
+			return 0;
+		}
+
+		int Link(std::shared_ptr<FileT> const &Node, std::shared_ptr<FileT> const &Parent, std::string const &Name)
+		{
+			if (Node->IsDirectory()) return -EPERM;
+			if (!Parent->IsDirectory()) return -ENOTDIR;
+			StripeGuardT Guard(Stripes, {Parent.get(), Node.get()});
+			if (Parent->Data.Get<DirectoryDataT>().count(Name)) return -EEXIST;
+			Touch(Node);
+			Node->stat.st_nlink += 1;
+			Node->stat.st_ctim = Now();
+			SetChild(Parent, Name, Node);
+			return 0;
+		}
+
+		// ToSet is a mask of FUSE_SET_ATTR_ flags selecting fields of Attributes
+		int SetAttributes(std::shared_ptr<FileT> const &Node, struct stat const &Attributes, int ToSet)
+		{
+			if ((ToSet & FUSE_SET_ATTR_SIZE) && !Node->Data.Is<RegularFileDataT>())
+				return Node->IsDirectory() ? -EPERM : -ENOENT;
+			StripeGuardT Guard(Stripes, {Node.get()});
+			Touch(Node);
+			auto &stat = Node->stat;
+			if (ToSet & FUSE_SET_ATTR_MODE) 
+				stat.st_mode = (stat.st_mode & S_IFMT) | (Attributes.st_mode & ~S_IFMT);
+			if (ToSet & FUSE_SET_ATTR_UID) stat.st_uid = Attributes.st_uid;
+			if (ToSet & FUSE_SET_ATTR_GID) stat.st_gid = Attributes.st_gid;
+			if (ToSet & FUSE_SET_ATTR_SIZE)
+			{
+				ChunkJournalT Journal(*this, Node);
+				Node->Data.Get<RegularFileDataT>().Truncate(Attributes.st_size, Journal.Get());
+				UpdateSize(*Node);
+			}
+			if (ToSet & FUSE_SET_ATTR_ATIME_NOW) stat.st_atim = Now();
+			else if (ToSet & FUSE_SET_ATTR_ATIME) stat.st_atim = Attributes.st_atim;
+			if (ToSet & FUSE_SET_ATTR_MTIME_NOW) stat.st_mtim = Now();
+			else if (ToSet & FUSE_SET_ATTR_MTIME) stat.st_mtim = Attributes.st_mtim;
+			return 0;
+		}
+
+		int Access(CallerT const &Caller, FileT &Node, int Mode)
+		{
+			if (Mode == F_OK) return 0;
+			StripeGuardT Guard(Stripes, {&Node});
+			if (!CheckPermission(
+				Caller,
+				Node, 
+				Mode & R_OK,
+				Mode & W_OK,
+				Mode & X_OK)) return -EACCES;
+			return 0;
+		}
+
+		int Open(CallerT const &Caller, std::shared_ptr<FileT> const &Node, struct fuse_file_info *fi)
+		{
+			if (Node->IsDirectory()) return -EPERM;
+			if (Node->Data.Is<SymlinkPathT>())
+			{
+				return -ENOENT;
+			}
+			StripeGuardT Guard(Stripes, {Node.get()});
+			if (!CheckPermission(
+				Caller,
+				*Node,
+				(fi->flags == O_RDONLY) || (fi->flags == O_RDWR),
+				(fi->flags == O_WRONLY) || (fi->flags == O_RDWR),
+				false)) return -EACCES;
+			if (!SetFile(fi, Node)) return -ENOSPC;
+			fi->keep_cache = KeepCache;
+			return 0;
+		}
+
+		size_t Read(struct fuse_file_info *fi, char *Out, size_t Count, off_t Start)
+		{
+			auto const &File = GetFile(fi);
+			StripeGuardT Guard(Stripes, {File.get()});
+			return File->Data.Get<RegularFileDataT>().Read(Out, Count, Start);
+		}
+
+		// Calls Reply with iovecs pointing straight at the file's storage,
+		// while the file is locked against changes
+		template <typename ReplyT> void ReadInPlace(struct fuse_file_info *fi, size_t Count, off_t Start, ReplyT &&Reply)
+		{
+			auto const &File = GetFile(fi);
+			StripeGuardT Guard(Stripes, {File.get()});
+			std::vector<struct iovec> Segments;
+			Segments.reserve(Count / RegularFileDataT::ChunkSize + 2);
+			File->Data.Get<RegularFileDataT>().Segments(Count, Start, [&Segments](uint8_t const *Bytes, size_t Length)
+			{
+				Segments.push_back({const_cast<uint8_t *>(Bytes), Length});
+			});
+			Reply(Segments);
+		}
+
+		// The length a partial fault rule leaves of a read, recorded for the
+		// control socket
+		size_t SplitRead(struct fuse_file_info *fi, size_t Count, off_t Start)
+		{
+			auto const Split = TakeSplit();
+			if (!Split) return Count;
+			auto const Kept = Split.Reported(Start, Count);
+			Faults.RecordSplit({OperationT::read, GetFile(fi)->stat.st_ino, Start, Count, {{Start, Kept}}});
+			return Kept;
+		}
+
+		// Moves past Count bytes of the request buffer.  Memory is skipped in
+		// place; a pipe has to be read, a bounded piece at a time.
+		static void SkipBuffer(struct fuse_bufvec &In, size_t Count)
+		{
+			while ((Count > 0) && (In.idx < In.count))
+			{
+				auto const &Buffer = In.buf[In.idx];
+				if (Buffer.flags & FUSE_BUF_IS_FD)
+				{
+					uint8_t Scratch[4096];
+					auto Out = FUSE_BUFVEC_INIT(std::min(Count, sizeof(Scratch)));
+					Out.buf[0].mem = Scratch;
+					auto const Copied = fuse_buf_copy(&Out, &In, static_cast<fuse_buf_copy_flags>(0));
+					if (Copied <= 0) return;
+					Count -= Copied;
+					continue;
+				}
+				auto const Span = std::min(Count, Buffer.size - In.off);
+				In.off += Span;
+				Count -= Span;
+				if (In.off == Buffer.size)
+				{
+					In.idx += 1;
+					In.off = 0;
+				}
+			}
+		}
+
+		// Copies each chunk's span straight out of the request buffer, which
+		// may be a pipe if the kernel spliced the data.  A split from a
+		// partial fault rule writes only the ranges it keeps, skipping the
+		// rest of the buffer.
+		int Write(struct fuse_file_info *fi, struct fuse_bufvec &In, off_t Start, SplitT const &Split)
+		{
+			auto const Count = fuse_buf_size(&In);
+			auto const &File = GetFile(fi);
+			StripeGuardT Guard(Stripes, {File.get()});
+			auto &Data = File->Data.Get<RegularFileDataT>();
+			Touch(File);
+			ChunkJournalT Journal(*this, File);
+			auto const Copy = [&In](uint8_t *Destination, size_t Span) -> size_t
+			{
+				auto Out = FUSE_BUFVEC_INIT(Span);
+				Out.buf[0].mem = Destination;
+				auto const Copied = fuse_buf_copy(&Out, &In, static_cast<fuse_buf_copy_flags>(0));
+				if (Copied < 0) return 0;
+				return Copied;
+			};
+			if (!Split)
+			{
+				auto const Written = Data.WriteFrom(Count, Start, Journal.Get(), Copy);
+				UpdateSize(*File);
+				if (Written < Count)
+				{
+					if (Written == 0) return -ENOSPC;
+					return Written;
+				}
+				return Count;
+			}
+
+			FaultsT::SplitRecordT Record{OperationT::write, File->stat.st_ino, Start, Count, {}};
+			size_t Position = 0;
+			bool Full = true;
+			Split.Kept(Start, Count, [&](off_t Offset, size_t Length)
+			{
+				if (!Full) return;
+				SkipBuffer(In, Offset - Start - Position);
+				auto const Written = Data.WriteFrom(Length, Offset, Journal.Get(), Copy);
+				if (Written > 0) Record.Kept.emplace_back(Offset, Written);
+				Position = Offset - Start + Written;
+				if (Written < Length) Full = false;
+			});
+			// Torn writes report everything written, and the size follows
+			if (Full && (Split.Mode != FaultModeT::Short) && (Data.Size() < static_cast<off_t>(Start + Count)))
+				Data.Truncate(Start + Count, Journal.Get());
+			UpdateSize(*File);
+			Faults.RecordSplit(std::move(Record));
+			if (!Full)
+			{
+				if (Position == 0) return -ENOSPC;
+				return Position;
+			}
+			return Split.Reported(Start, Count);
+		}
+
+		int Allocate(struct fuse_file_info *fi, int Mode, off_t Offset, off_t Length)
+		{
+			auto const &File = GetFile(fi);
+			auto &Data = File->Data.Get<RegularFileDataT>();
+			if ((Mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) && (Mode != 0) && (Mode != FALLOC_FL_KEEP_SIZE))
+				return -EOPNOTSUPP;
+			StripeGuardT Guard(Stripes, {File.get()});
+			Touch(File);
+			ChunkJournalT Journal(*this, File);
+			if (Mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+				Data.PunchHole(Offset, Length, Journal.Get());
+			else if (Mode == 0)
+			{
+				// Storage is materialized lazily, so allocating only extends the size
+				if (Data.Size() < Offset + Length)
+					Data.Truncate(Offset + Length, Journal.Get());
+			}
+			UpdateSize(*File);
+			return 0;
+		}
+
+		int Rename(std::shared_ptr<FileT> const &FromParent, std::string const &FromName, std::shared_ptr<FileT> const &ToParent, std::string const &ToName)
+		{
+			if (!FromParent->IsDirectory() || !ToParent->IsDirectory()) return -ENOTDIR;
+			// Like the kernel's rename mutex, this keeps the Within check valid
+			// until the move is done
+			std::lock_guard<std::mutex> RenameGuard(RenameMutex);
+			StripeGuardT Guard(Stripes);
+			std::shared_ptr<FileT> File, Victim;
+			do
+			{
+				Guard.Unlock();
+				File = LookupEntry(FromParent, FromName);
+				if (!File) return -ENOENT;
+				Victim = LookupEntry(ToParent, ToName);
+				Guard.Lock({FromParent.get(), ToParent.get(), File.get(), Victim.get()});
+			} while ((Entry(*FromParent, FromName) != File) || (Entry(*ToParent, ToName) != Victim));
+			if (File->IsDirectory() && Within(ToParent, *File)) return -EINVAL;
+			if (Victim)
+			{
+				if (Victim == File) return 0;
+				if (File->IsDirectory())
+				{
+					if (!Victim->IsDirectory()) return -ENOTDIR;
+					if (!Victim->Data.Get<DirectoryDataT>().empty()) return -ENOTEMPTY;
+					Touch(ToParent);
+					ToParent->stat.st_nlink -= 1;
+				}
+				else if (Victim->IsDirectory()) return -EISDIR;
+				DropLink(Victim);
+				SetChild(ToParent, ToName, nullptr);
+			}
+			// Both halves become durable together, when the destination is synced
+			SetChild(FromParent, FromName, nullptr, ToParent);
+			SetChild(ToParent, ToName, File);
+			if (File->IsDirectory())
+			{
+				Touch(FromParent);
+				FromParent->stat.st_nlink -= 1;
+				Touch(ToParent);
+				ToParent->stat.st_nlink += 1;
+			}
+			Touch(File);
+			File->stat.st_ctim = Now();
+			return 0;
+		}
+
+		// Kernel references
+		//
+		// The kernel caches entries and attributes for the configured
+		// timeouts, so lookups and stats mostly never reach us.  Nodes the
+		// kernel holds are also tracked so their cached state can be dropped
+		// when it changes behind the kernel's back.
+		std::shared_ptr<FileT> FromID(fuse_ino_t ID)
+		{
+			if (ID == FUSE_ROOT_ID) return Root;
+			return reinterpret_cast<FileT *>(ID)->shared_from_this();
+		}
+
+		fuse_ino_t ToID(std::shared_ptr<FileT> const &Node) const
+		{
+			if (Node == Root) return FUSE_ROOT_ID;
+			return reinterpret_cast<fuse_ino_t>(Node.get());
+		}
+
+		// Counts a lookup of the node by the kernel and describes it.  Called
+		// without other stripes held.
+		void Remember(std::shared_ptr<FileT> const &Node, fuse_entry_param &Out)
+		{
+			memset(&Out, 0, sizeof(Out));
+			StripeGuardT Guard(Stripes, {Node.get()});
+			if ((Node != Root) && (Node->Lookups++ == 0)) 
+			{
+				Node->Pinned = Node;
+				std::lock_guard<std::mutex> KnownGuard(KnownMutex);
+				Known.insert(Node.get());
+			}
+			Out.ino = ToID(Node);
+			// Addresses are reused once a node is forgotten and freed
+			Out.generation = Node->stat.st_ino;
+			Out.attr = Node->stat;
+			Out.attr_timeout = AttributeTimeout;
+			Out.entry_timeout = EntryTimeout;
+		}
+
+		int ReplyEntry(fuse_req_t req, std::shared_ptr<FileT> const &Node)
+		{
+			fuse_entry_param Entry;
+			Remember(Node, Entry);
+			fuse_reply_entry(req, &Entry);
+			return 0;
+		}
+
+		// Doesn't take the filesystem lock, so the kernel can always make
+		// progress releasing nodes
+		void Forget(fuse_ino_t ID, uint64_t Count)
+		{
+			if (ID == FUSE_ROOT_ID) return;
+			auto Node = reinterpret_cast<FileT *>(ID);
+			std::shared_ptr<FileT> Released;
+			StripeGuardT Guard(Stripes, {Node});
+			Assert(Node->Lookups >= Count);
+			Node->Lookups -= Count;
+			if (Node->Lookups == 0) 
+			{
+				Released = std::move(Node->Pinned);
+				std::lock_guard<std::mutex> KnownGuard(KnownMutex);
+				Known.erase(Node);
+			}
+			// Freed after the stripe is released
+			Guard.Unlock();
+		}
+
+		// Excludes operations for a control command, or with Shared only
+		// waits out changes to the whole tree.  Does nothing inside a batch,
+		// which already excludes operations.
+		struct ControlGuardT
+		{
+			ControlGuardT(FilesystemT &Filesystem, bool Shared = false) : 
+				Mutex(Filesystem.Batching ? nullptr : &Filesystem.Mutex), 
+				Shared(Shared)
+			{
+				if (!Mutex) return;
+				if (Shared) Mutex->lock_shared();
+				else Mutex->lock();
+			}
+
+			ControlGuardT(ControlGuardT const &) = delete;
+
+			~ControlGuardT(void)
+			{
+				if (!Mutex) return;
+				if (Shared) Mutex->unlock_shared();
+				else Mutex->unlock();
+			}
+
+			std::shared_timed_mutex *const Mutex;
+			bool const Shared;
+		};
+
+		// The kernel may wait on operations while handling notifications, so
+		// inside a batch they're waited for once it's done
+		void FlushNotices(void)
+		{
+			if (!Batching) Notify->Flush();
+		}
+
+		// Drops the kernel's cached attributes and data for every node
+		void InvalidateKnown(void)
+		{
+			if (!Notify) return;
+			Notify->Inode(FUSE_ROOT_ID);
+			std::lock_guard<std::mutex> Guard(KnownMutex);
+			for (auto Node : Known) Notify->Inode(reinterpret_cast<fuse_ino_t>(Node));
+		}
+
+		// Snapshot journal
+		//
+		// While any snapshot exists every change is paired with an undo entry.
+		// Nodes and chunks are stamped with the epoch of their last journaled
+		// change, and taking a snapshot starts a new epoch, so each node's stat
+		// and each chunk is saved at most once per snapshot - untouched state
+		// is shared.
+		//
+		// The same journal tracks durability: each entry belongs to the node
+		// whose sync makes it durable, and a sync starts a new epoch for that
+		// node alone, so the journal holds at most one saved copy of each
+		// chunk and stat per sync - the changes since the last sync, as whole
+		// chunks on top of the durable ones.  Entries from DurablePosition on
+		// are rolled back by a crash unless their owner has been synced since.
+		//
+		// The snapshot list, epoch and tracking flag only change while
+		// operations are excluded, so they're read without locking.
+		bool Journaling(void) const { return Tracking || !Snapshots.empty(); }
+
+		struct UndoT
+		{
+			// Set for namespace changes so restore knows which entries the
+			// kernel may have cached; an empty name covers the whole directory
+			std::shared_ptr<FileT> Directory;
+			std::string Name;
+			function<void(void)> Apply;
+			// Set for file data, to undo all but the first Keep bytes of a
+			// chunk
+			function<bool(size_t Keep)> Tear;
+			// Set by Log
+			std::shared_ptr<FileT> Owner;
+			uint64_t Sequence;
+		};
+
+		void Log(std::shared_ptr<FileT> const &Owner, UndoT &&Undo)
+		{
+			std::lock_guard<std::mutex> Guard(JournalMutex);
+			Undo.Owner = Owner;
+			Undo.Sequence = ++JournalSequence;
+			Journal.push_back(std::move(Undo));
+		}
+
+		// Epoch for changes to a node, later than the node's last sync
+		uint64_t EpochOf(FileT const &Node) const { return std::max(Epoch, Node.Floor); }
+
+		void Touch(std::shared_ptr<FileT> const &Node)
+		{
+			if (!Journaling()) return;
+			auto const Current = EpochOf(*Node);
+			if (Node->Epoch >= Current) return;
+			Node->Epoch = Current;
+			auto const Saved = Node->stat;
+			off_t Length = 0;
+			if (Node->Data.Is<RegularFileDataT>()) Length = Node->Data.Get<RegularFileDataT>().Size();
+			Log(Node, UndoT{nullptr, std::string(), [Node, Saved, Length](void)
+			{
+				Node->stat = Saved;
+				if (Node->Data.Is<RegularFileDataT>())
+					Node->Data.Get<RegularFileDataT>().RestoreLength(Length);
+			}});
+		}
+
+		void SetInode(ino_t Inode, std::shared_ptr<FileT> Node)
+		{
+			std::lock_guard<std::mutex> Guard(InodesMutex);
+			if (Journaling())
+			{
+				std::shared_ptr<FileT> Previous;
+				auto Found = Inodes.find(Inode);
+				if (Found != Inodes.end()) Previous = Found->second;
+				Log(Node ? Node : Previous, UndoT{nullptr, std::string(), [this, Inode, Previous](void)
+				{
+					if (Previous) Inodes[Inode] = Previous;
+					else Inodes.erase(Inode);
+				}});
+			}
+			if (Node) Inodes[Inode] = std::move(Node);
+			else Inodes.erase(Inode);
+		}
+
+		// Null Child removes the entry.  The change is durable once Owner, or
+		// else Directory, is synced.
+		void SetChild(std::shared_ptr<FileT> const &Directory, std::string const &Name, std::shared_ptr<FileT> Child, std::shared_ptr<FileT> const &Owner = nullptr)
+		{
+			if (Journaling())
+			{
+				std::shared_ptr<FileT> Previous;
+				auto &Children = Directory->Data.Get<DirectoryDataT>();
+				auto Found = Children.find(Name);
+				if (Found != Children.end()) Previous = Found->second;
+				Log(Owner ? Owner : Directory, UndoT{Directory, Name, [Directory, Name, Previous](void)
+				{
+					PlaceChild(Directory, Name, Previous);
+				}});
+			}
+			PlaceChild(Directory, Name, std::move(Child));
+		}
+
+		static void PlaceChild(std::shared_ptr<FileT> const &Directory, std::string const &Name, std::shared_ptr<FileT> Child)
+		{
+			auto &Children = Directory->Data.Get<DirectoryDataT>();
+			auto Found = Children.find(Name);
+			if (Found != Children.end())
+			{
+				auto &Previous = *Found->second;
+				if ((Previous.Parent.lock() == Directory) && (Previous.Name == Name))
+					Previous.Parent.reset();
+				Children.erase(Found);
+			}
+			if (!Child) return;
+			Child->Parent = Directory;
+			Child->Name = Name;
+			Children.emplace(Name, std::move(Child));
+		}
+
+		struct ChunkJournalT : RegularFileDataT::JournalT
+		{
+			ChunkJournalT(FilesystemT &Filesystem, std::shared_ptr<FileT> const &File) : 
+				Filesystem(Filesystem), 
+				File(File) 
+			{ 
+				Epoch = Filesystem.EpochOf(*File); 
+			}
+
+			// Null when there's nothing to preserve
+			RegularFileDataT::JournalT *Get(void) 
+			{ 
+				return Filesystem.Journaling() ? this : nullptr; 
+			}
+
+			void Save(size_t Index, RegularFileDataT::ChunkT const *Previous) override
+			{
+				auto const Existed = Previous != nullptr;
+				RegularFileDataT::ChunkT Saved;
+				if (Existed) Saved = *Previous;
+				auto File = this->File;
+				UndoT Undo{nullptr, std::string(), [File, Index, Existed, Saved](void)
+				{
+					File->Data.Get<RegularFileDataT>().RestoreChunk(Index, Existed ? &Saved : nullptr);
+				}};
+				Undo.Tear = [File, Index, Existed, Saved](size_t Keep)
+				{
+					return File->Data.Get<RegularFileDataT>().TearChunk(Index, Existed ? &Saved : nullptr, Keep);
+				};
+				Filesystem.Log(File, std::move(Undo));
+			}
+
+			FilesystemT &Filesystem;
+			std::shared_ptr<FileT> File;
+		};
+
+		// What to do with a journal entry when rolling back: leave it, undo
+		// it, or undo all but the first Keep bytes of a data chunk
+		struct RevertT
+		{
+			bool Revert;
+			size_t Keep;
+		};
+
+		// Undoes the entries from Position on that Decide picks, newest first,
+		// and forgets them; torn and untouched entries stay.  Snapshots taken
+		// after Position are discarded.  Operations must be excluded.
+		template <typename DecideT> void Rollback(size_t const Position, DecideT &&Decide, std::map<fuse_ino_t, std::set<std::string>> &Cached)
+		{
+			std::vector<RevertT> Decisions;
+			Decisions.reserve(Journal.size() - Position);
+			std::vector<std::pair<std::shared_ptr<FileT>, std::string>> Changes;
+			for (auto Undo = Journal.begin() + Position; Undo != Journal.end(); ++Undo)
+			{
+				Decisions.push_back(Decide(*Undo));
+				if (Decisions.back().Revert && Undo->Directory) Changes.emplace_back(Undo->Directory, Undo->Name);
+			}
+
+			if (!LowLevel)
+			{
+				// The root is the only node the high-level API shares an ID
+				// for, so the top-level names above changed entries are
+				// dropped, and everything cached below them with them
+				auto &Names = Cached[FUSE_ROOT_ID];
+				for (auto const &Path : ChangedPaths(Changes))
+					Names.insert(Path.substr(1, Path.find('/', 1) - 1));
+			}
+			else
+			{
+				// The current names of changed entries are dropped once the
+				// lock is released
+				for (auto const &Change : Changes)
+				{
+					auto &Names = Cached[ToID(Change.first)];
+					if (!Change.second.empty()) Names.insert(Change.second);
+					else for (auto const &Child : Change.first->Data.Get<DirectoryDataT>()) 
+						Names.insert(Child.first);
+				}
+			}
+
+			for (auto Index = Journal.size(); Index-- > Position;)
+			{
+				auto &Decision = Decisions[Index - Position];
+				if (!Decision.Revert) continue;
+				// Torn chunks that can't be allocated are reverted whole
+				if (Decision.Keep && Journal[Index].Tear(Decision.Keep)) Decision.Revert = false;
+				else Journal[Index].Apply();
+			}
+			auto Kept = Position;
+			for (auto Index = Position; Index < Journal.size(); ++Index)
+			{
+				if (Decisions[Index - Position].Revert) continue;
+				if (Kept != Index) Journal[Kept] = std::move(Journal[Index]);
+				Kept += 1;
+			}
+			Journal.erase(Journal.begin() + Kept, Journal.end());
+
+			for (auto Snapshot = Snapshots.begin(); Snapshot != Snapshots.end();)
+			{
+				if (Snapshot->second > Position) Snapshot = Snapshots.erase(Snapshot);
+				else ++Snapshot;
+			}
+			Epoch = ++Clock;
+			// Attributes and data of files that stayed in place may be cached
+			// too
+			InvalidateKnown();
+		}
+
+		// Counts the whole current state as durable.  Operations must be
+		// excluded.
+		void Settle(void)
+		{
+			if (!Tracking)
+			{
+				if (Snapshots.empty()) Journal.clear();
+				DurablePosition = 0;
+				return;
+			}
+			DurablePosition = Journal.size();
+			if (Snapshots.empty()) CompactJournal();
+		}
+
+		// Drops entries a crash can't roll back.  Only while there are no
+		// snapshots, which need every entry.  Needs the journal mutex or
+		// operations excluded.
+		void CompactJournal(void)
+		{
+			size_t Kept = 0;
+			for (auto Index = DurablePosition; Index < Journal.size(); ++Index)
+			{
+				auto &Undo = Journal[Index];
+				if (Undo.Owner->Synced.load(std::memory_order_relaxed) >= Undo.Sequence) continue;
+				if (Kept != Index) Journal[Kept] = std::move(Undo);
+				Kept += 1;
+			}
+			Journal.erase(Journal.begin() + Kept, Journal.end());
+			DurablePosition = 0;
+			// Amortized, so syncs stay constant time on average.  A copy, since
+			// std::max would need MinimumCompact defined out of the class.
+			size_t const Minimum = MinimumCompact;
+			CompactAt = std::max(Minimum, Journal.size() * 2);
+		}
+
+		// Makes the node's changes so far durable
+		void Sync(std::shared_ptr<FileT> const &Node)
+		{
+			if (!Tracking) return;
+			{
+				StripeGuardT Guard(Stripes, {Node.get()});
+				{
+					std::lock_guard<std::mutex> JournalGuard(JournalMutex);
+					Node->Synced.store(JournalSequence, std::memory_order_relaxed);
+				}
+				Node->Floor = ++Clock;
+			}
+			std::lock_guard<std::mutex> JournalGuard(JournalMutex);
+			if (Snapshots.empty() && (Journal.size() >= CompactAt)) CompactJournal();
+		}
+
+		// Path of a linked directory, false if it's not reachable from the root
+		bool PathOf(std::shared_ptr<FileT> Node, std::string &Out)
+		{
+			std::vector<std::string> Names;
+			while (Node != Root)
+			{
+				auto Parent = Node->Parent.lock();
+				if (!Parent || (Entry(*Parent, Node->Name) != Node)) return false;
+				Names.push_back(Node->Name);
+				Node = std::move(Parent);
+			}
+			Out.clear();
+			for (auto Name = Names.rbegin(); Name != Names.rend(); ++Name)
+				Out += "/" + *Name;
+			return true;
+		}
+
+		// Fault path rules
+		//
+		// Paths are only worked out when a path rule could match.  Each node is
+		// read under its own stripe, so nothing may be locked while locating.
+		static bool LocatePath(char const *Path, RulePathT &Out)
+		{
+			while (*Path)
+			{
+				auto End = Path;
+				while (*End && (*End != '/')) ++End;
+				if (End != Path) Out.emplace_back(Path, End - Path);
+				Path = *End ? End + 1 : End;
+			}
+			return true;
+		}
+
+		bool Locate(FileT &Node, RulePathT &Out)
+		{
+			auto At = Node.shared_from_this();
+			while (At != Root)
+			{
+				std::shared_ptr<FileT> Parent;
+				std::string Name;
+				{
+					StripeGuardT Guard(Stripes, {At.get()});
+					Parent = At->Parent.lock();
+					Name = At->Name;
+				}
+				if (!Parent) return false;
+				{
+					// Nodes detached by a clean still name their old place
+					StripeGuardT Guard(Stripes, {Parent.get()});
+					if (Entry(*Parent, Name) != At) return false;
+				}
+				Out.push_back(std::move(Name));
+				At = std::move(Parent);
+			}
+			std::reverse(Out.begin(), Out.end());
+			return true;
+		}
+
+		// Locators for FaultsT::Check
+		struct AtPathT
+		{
+			char const *Path;
+			bool operator ()(RulePathT &Out) const { return LocatePath(Path, Out); }
+		};
+
+		struct AtNodeT
+		{
+			FilesystemT &Filesystem;
+			fuse_ino_t ID;
+			bool operator ()(RulePathT &Out) const { return Filesystem.Locate(*Filesystem.FromID(ID), Out); }
+		};
+
+		struct AtEntryT
+		{
+			FilesystemT &Filesystem;
+			fuse_ino_t Parent;
+			char const *Name;
+			bool operator ()(RulePathT &Out) const
+			{
+				if (!Filesystem.Locate(*Filesystem.FromID(Parent), Out)) return false;
+				Out.emplace_back(Name);
+				return true;
+			}
+		};
+
+		static AtPathT AtPath(char const *Path) { return {Path}; }
+		AtNodeT AtNode(fuse_ino_t ID) { return {*this, ID}; }
+		AtEntryT AtEntry(fuse_ino_t Parent, char const *Name) { return {*this, Parent, Name}; }
+
+		// Visible paths of changed entries, excluding those inside another
+		// changed entry.  An empty name means every entry in the directory.
+		std::vector<std::string> ChangedPaths(std::vector<std::pair<std::shared_ptr<FileT>, std::string>> const &Changes)
+		{
+			std::set<std::string> Paths;
+			for (auto const &Change : Changes)
+			{
+				std::string Base;
+				if (!PathOf(Change.first, Base)) continue;
+				auto const &Children = Change.first->Data.Get<DirectoryDataT>();
+				if (Change.second.empty())
+				{
+					for (auto const &Child : Children) Paths.insert(Base + "/" + Child.first);
+				}
+				else if (Children.count(Change.second)) Paths.insert(Base + "/" + Change.second);
+			}
+			std::vector<std::string> Out;
+			for (auto const &Path : Paths)
+			{
+				bool Covered = false;
+				for (auto Split = Path.find('/', 1); !Covered && (Split != std::string::npos); Split = Path.find('/', Split + 1))
+					Covered = Paths.count(Path.substr(0, Split));
+				if (!Covered) Out.push_back(Path);
+			}
+			return Out;
+		}
+
+		std::shared_ptr<FileT> Find(char const *Path)
+		{
+			Assert(Path[0] == '/');
+			auto Node = Root;
+			char const *Start = Path + 1;
+			while (*Start)
+			{
+				char const *End = strchrnul(Start, '/');
+				if (!Node->IsDirectory()) return nullptr;
+				Node = LookupEntry(Node, std::string(Start, End - Start));
+				if (!Node) return nullptr;
+				if (!*End) break;
+				Start = End + 1;
+			}
+			return Node;
+		}
+
+		// The directory's stripe must be held
+		static std::shared_ptr<FileT> Entry(FileT const &Directory, std::string const &Name)
+		{
+			auto const &Children = Directory.Data.Get<DirectoryDataT>();
+			auto Found = Children.find(Name);
+			if (Found == Children.end()) return nullptr;
+			return Found->second;
+		}
+
+		std::shared_ptr<FileT> LookupEntry(std::shared_ptr<FileT> const &Directory, std::string const &Name)
+		{
+			std::lock_guard<std::mutex> Guard(Stripes.For(Directory.get()));
+			return Entry(*Directory, Name);
+		}
+
+		std::shared_ptr<FileT> FindParent(char const *Path, std::string &Name)
+		{
+			char const *Split = strrchr(Path, '/');
+			Assert(Split);
+			Name.assign(Split + 1);
+			std::shared_ptr<FileT> Parent;
+			if (Split == Path) Parent = Root;
+			else Parent = Find(std::string(Path, Split - Path).c_str());
+			if (!Parent || !Parent->IsDirectory()) return nullptr;
+			return Parent;
+		}
+
+		bool CheckPermission(CallerT const &Caller, FileT &File, bool Read, bool Write, bool Execute)
+		{
+			auto const &st_mode = File.stat.st_mode;
+			auto const &st_uid = File.stat.st_uid;
+			auto const &st_gid = File.stat.st_gid;
+			auto const uid = Caller.uid;
+			auto const gid = Caller.gid;
+			return
+				(
+					!Read ||
+					(
+						((st_mode & S_IRUSR) && (st_uid == uid)) ||
+						((st_mode & S_IRGRP) && (st_gid == gid)) ||
+						(st_mode & S_IROTH)
+					)
+				) ||
+				(
+					!Write ||
+					(
+						((st_mode & S_IWUSR) && (st_uid == uid)) ||
+						((st_mode & S_IWGRP) && (st_gid == gid)) ||
+						!(st_mode & S_IWOTH)
+					)
+				) ||
+				(
+					!Execute ||
+					(
+						((st_mode & S_IXUSR) && (st_uid == uid)) ||
+						((st_mode & S_IXGRP) && (st_gid == gid)) ||
+						!(st_mode & S_IXOTH)
+					)
+				);
+		}
+
+		typedef std::shared_ptr<FileT> HandleT;
+
+		bool SetFile(struct fuse_file_info *fi, std::shared_ptr<FileT> File)
+		{
+			auto Handle = GlobalPool().Allocate(sizeof(HandleT));
+			if (!Handle) return false;
+			fi->fh = reinterpret_cast<uint64_t>(new (Handle) HandleT(std::move(File)));
+			return true;
+		}
+
+		HandleT const &GetFile(struct fuse_file_info *fi)
+		{
+			return *reinterpret_cast<HandleT *>(fi->fh);
+		}
+
+		void ClearFile(struct fuse_file_info *fi)
+		{
+			auto Handle = reinterpret_cast<HandleT *>(fi->fh);
+			Handle->~HandleT();
+			GlobalPool().Free(Handle);
+		}
+
+		Filesystem::PathT MountPath;
+
+		double const EntryTimeout;
+		double const AttributeTimeout;
+		bool const KeepCache;
+		bool const LowLevel;
+		KernelNotifyT *Notify;
+		DelayQueueT *Delays;
+		std::mutex KnownMutex;
+		std::unordered_set<FileT *> Known;
+
+		std::shared_timed_mutex Mutex;
+		// Set while a batch of control commands holds Mutex.  Only the
+		// control thread runs control commands, so it isn't locked.
+		bool Batching;
+		LockStripesT Stripes;
+		std::mutex RenameMutex;
+
+		std::atomic<int64_t> OperationCount;
+		FaultsT Faults;
+		LatencyT Latency;
+		ProcessFilterT Processes;
+
+		std::atomic<ino_t> NextInode;
+		std::mutex InodesMutex;
+		typedef std::unordered_map<ino_t, std::shared_ptr<FileT>> InodesT;
+		InodesT Inodes;
+
+		static constexpr size_t SectorSize = 512;
+		static constexpr size_t MinimumCompact = 4096;
+
+		std::atomic<uint64_t> Clock;
+		uint64_t Epoch;
+		std::mutex JournalMutex;
+		uint64_t JournalSequence;
+		std::vector<UndoT> Journal;
+		std::map<std::string, size_t> Snapshots;
+		bool Tracking;
+		size_t DurablePosition;
+		size_t CompactAt;
+
+		std::shared_ptr<FileT> Root;
+};
+
+// Starts the reply to a control command, tagged with the command's request
+// id if it had one, so (clean@7) gets (clean_result@7).  Within a batch each
+// reply is the next element of the batch's reply.
+struct ControlReplyT
+{
+	ControlReplyT(luxem::writer &Writer, std::string const &ID) : Writer(Writer), ID(ID) {}
+
+	luxem::writer &operator ()(std::string const &Type)
+	{
+		if (ID.empty()) return Writer.type(Type);
+		return Writer.type(Type + "@" + ID);
+	}
+
+	void Error(std::string const &Message)
+	{
+		(*this)("error").value(Message);
+	}
+
+	// Separates the request id, if any, from a message type
+	static void Split(std::string const &Tagged, std::string &Type, std::string &ID)
+	{
+		auto const At = Tagged.rfind('@');
+		if (At == std::string::npos) 
+		{
+			Type = Tagged;
+			ID.clear();
+			return;
+		}
+		Type = Tagged.substr(0, At);
+		ID = Tagged.substr(At + 1);
+	}
+
+	private:
+		luxem::writer &Writer;
+		std::string const ID;
+};
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		// Configure
+		if (argc < 2) throw UserErrorT() << "You must specify the mount point on the command line.";
 
 		OptionalT<FinallyT> RemoveRoot;
 		if (mkdir(argv[1], 0777) == 0)
@@ -551,20 +2395,79 @@ int main(int argc, char **argv)
 			if (!(StringT(EnvPort) >> Port)) throw UserErrorT() << "Environment variable CLUNKER_PORT has invalid port number: " << EnvPort;
 		}
 
+		{
+			auto EnvLimit = getenv("CLUNKER_MEMORY_LIMIT");
+			if (EnvLimit)
+			{
+				size_t Limit;
+				if (!(StringT(EnvLimit) >> Limit)) throw UserErrorT() << "Environment variable CLUNKER_MEMORY_LIMIT has invalid byte count: " << EnvLimit;
+				GlobalPool().SetLimit(Limit);
+			}
+			auto EnvHugePages = getenv("CLUNKER_HUGE_PAGES");
+			if (EnvHugePages && (std::string(EnvHugePages) != "0"))
+				GlobalPool().SetHugePages(true);
+		}
+
+		bool Multithreaded = false;
+		{
+			auto EnvMultithreaded = getenv("CLUNKER_MULTITHREADED");
+			if (EnvMultithreaded && (std::string(EnvMultithreaded) != "0"))
+				Multithreaded = true;
+		}
+
+		FuseConfigT FuseConfig;
+		{
+			auto EnvHighLevel = getenv("CLUNKER_HIGH_LEVEL");
+			if (EnvHighLevel && (std::string(EnvHighLevel) != "0"))
+				FuseConfig.LowLevel = false;
+			auto EnvEntryTimeout = getenv("CLUNKER_ENTRY_TIMEOUT");
+			if (EnvEntryTimeout && (!(StringT(EnvEntryTimeout) >> FuseConfig.EntryTimeout) || (FuseConfig.EntryTimeout < 0)))
+				throw UserErrorT() << "Environment variable CLUNKER_ENTRY_TIMEOUT has invalid seconds: " << EnvEntryTimeout;
+			auto EnvAttributeTimeout = getenv("CLUNKER_ATTR_TIMEOUT");
+			if (EnvAttributeTimeout && (!(StringT(EnvAttributeTimeout) >> FuseConfig.AttributeTimeout) || (FuseConfig.AttributeTimeout < 0)))
+				throw UserErrorT() << "Environment variable CLUNKER_ATTR_TIMEOUT has invalid seconds: " << EnvAttributeTimeout;
+			auto EnvKeepCache = getenv("CLUNKER_KEEP_CACHE");
+			if (EnvKeepCache && (std::string(EnvKeepCache) != "0"))
+				FuseConfig.KeepCache = true;
+			auto EnvBigWrites = getenv("CLUNKER_BIG_WRITES");
+			if (EnvBigWrites && (std::string(EnvBigWrites) == "0"))
+				FuseConfig.BigWrites = false;
+			auto EnvMaxRead = getenv("CLUNKER_MAX_READ");
+			if (EnvMaxRead && !(StringT(EnvMaxRead) >> FuseConfig.MaxRead))
+				throw UserErrorT() << "Environment variable CLUNKER_MAX_READ has invalid byte count: " << EnvMaxRead;
+			auto EnvMaxWrite = getenv("CLUNKER_MAX_WRITE");
+			if (EnvMaxWrite && !(StringT(EnvMaxWrite) >> FuseConfig.MaxWrite))
+				throw UserErrorT() << "Environment variable CLUNKER_MAX_WRITE has invalid byte count: " << EnvMaxWrite;
+			auto EnvLogLevel = getenv("CLUNKER_LOG_LEVEL");
+			LogLevelT LogLevel;
+			if (EnvLogLevel && !ParseLogLevel(EnvLogLevel, LogLevel))
+				throw UserErrorT() << "Environment variable CLUNKER_LOG_LEVEL has invalid level: " << EnvLogLevel;
+			if (EnvLogLevel) Logger().SetLevel(LogLevel);
+			auto EnvMaxDelayed = getenv("CLUNKER_MAX_DELAYED");
+			if (EnvMaxDelayed && !(StringT(EnvMaxDelayed) >> FuseConfig.MaxDelayed))
+				throw UserErrorT() << "Environment variable CLUNKER_MAX_DELAYED has invalid count: " << EnvMaxDelayed;
+			auto EnvMaxDelayedBytes = getenv("CLUNKER_MAX_DELAYED_BYTES");
+			if (EnvMaxDelayedBytes && !(StringT(EnvMaxDelayedBytes) >> FuseConfig.MaxDelayedBytes))
+				throw UserErrorT() << "Environment variable CLUNKER_MAX_DELAYED_BYTES has invalid byte count: " << EnvMaxDelayedBytes;
+		}
+
 		struct SharedT
 		{
 			bool Die = false;
 
 			asio::io_service MainService;
 
-			std::mutex Mutex;
 			OutOfBandFilesystemT<FilesystemT> Filesystem;
-			FuseT<OutOfBandFilesystemT<FilesystemT>> Fuse;
+			FuseT<OutOfBandFilesystemT<FilesystemT>, TracerT> Fuse;
 
-			SharedT(std::string const &Path) : 
-				Filesystem(Path, Mutex), 
-				Fuse(Path, Filesystem) {}
-		} Shared(argv[1]);
+			SharedT(std::string const &Path, FuseConfigT const &Config) : 
+				Filesystem(Path, Config), 
+				Fuse(Path, Filesystem, Config) 
+			{
+				Filesystem.SetNotify(Fuse.Notifications());
+				Filesystem.SetDelays(Fuse.DelayedRequests());
+			}
+		} Shared(argv[1], FuseConfig);
 
 		{
 			struct sigaction HandlerInfo;
@@ -587,73 +2490,494 @@ int main(int argc, char **argv)
 			SignalHandlers.clear();
 		});
 
-		// Start listeners on IPC thread
-		asio::ip::tcp::endpoint TCPEndpoint(asio::ip::tcp::v4(), Port);
-		TCPListen(Shared.MainService, TCPEndpoint, [&Shared](std::shared_ptr<asio::ip::tcp::socket> Connection)
+		// A single thread serving the high-level API would sleep out every
+		// delay with everything else waiting behind it
+		bool const LatencyAllowed = FuseConfig.LowLevel || Multithreaded;
+
+		// Runs one control command and writes its reply
+		auto Command = [&Shared, LatencyAllowed](std::shared_ptr<luxem::value> const &Data, std::string const &Type, ControlReplyT &Reply)
 		{
-			auto Reader = std::make_shared<luxem::reader>();
-			Reader->element([&Shared, Connection](std::shared_ptr<luxem::value> &&Data)
+			auto Error = [&](std::string Message)
 			{
-				auto Error = [&](std::string Message)
-				{
-					Write(Connection,
-						luxem::writer()
-							.type("error")
-							.value(Message)
-							.dump());
-				};
+				Reply.Error(Message);
+			};
 
-				if (!Data->has_type()) 
+			if (Type == "clean")
+			{
+				auto Success = Shared.Filesystem.Clean();
+				Reply("clean_result").value(Success);
+			}
+			else if (Type == "set_count")
+			{
+				int64_t Count = 0;
+				try
 				{
-					Error(StringT() 
-						<< "Message has no type: [" << luxem::writer().value(Data).dump() << "]");
+					Count = Data->as<luxem::primitive>().get_int();
+				}
+				catch (...)
+				{
+					Error(StringT()
+						<< "Bad count [" << luxem::writer().value(Data).dump() << "]");
 					return;
 				}
-
-				auto Type = Data->get_type();
-				if (Type == "clean")
+				Shared.Filesystem.SetCount(Count);
+				Reply("set_result").value(true);
+			}
+			else if (Type == "set_fault")
+			{
+				OperationT Kind;
+				bool AnyKind = false;
+				std::string Path;
+				FaultRuleT Rule;
+				try
+				{
+					auto &Object = Data->as<luxem::object>();
+					if (Object.has("path")) 
+						Path = Object.get("path")->as<luxem::primitive>().get_primitive();
+					// Path rules may cover every kind of operation
+					if (!Path.empty() && !Object.has("operation")) AnyKind = true;
+					else if (!ParseOperation(Object.get("operation")->as<luxem::primitive>().get_primitive(), Kind))
+						throw std::runtime_error("operation");
+					if (Object.has("operations")) 
+						Rule.Operations = Object.get("operations")->as<luxem::primitive>().get_int();
+					if (Object.has("bytes")) 
+						Rule.Bytes = Object.get("bytes")->as<luxem::primitive>().get_int();
+					if (Object.has("times")) 
+						Rule.Times = Object.get("times")->as<luxem::primitive>().get_int();
+					if (Object.has("error"))
+					{
+						Rule.Error = ParseErrno(Object.get("error")->as<luxem::primitive>().get_primitive());
+						if (!Rule.Error) throw std::runtime_error("error");
+					}
+					if (Object.has("mode") && !ParseFaultMode(Object.get("mode")->as<luxem::primitive>().get_primitive(), Rule.Mode))
+						throw std::runtime_error("mode");
+					if (Object.has("seed")) 
+						Rule.Seed = Object.get("seed")->as<luxem::primitive>().get_int();
+				}
+				catch (...)
 				{
-					auto Success = Shared.Filesystem.Clean();
-					Write(Connection, 
-						luxem::writer()
-							.type("clean_result")
-							.value(Success)
-							.dump());
+					Error(StringT()
+						<< "Bad fault [" << luxem::writer().value(Data).dump() << "]");
+					return;
 				}
-				else if (Type == "set_count")
+				if (!Path.empty()) 
+					Shared.Filesystem.SetPathFault(Path, AnyKind ? AllOperations() : OperationBit(Kind), Rule);
+				else Shared.Filesystem.SetFault(Kind, Rule);
+				Reply("set_fault_result").value(true);
+			}
+			else if (Type == "set_fault_rate")
+			{
+				std::array<double, static_cast<size_t>(OperationT::Count)> Rates;
+				Rates.fill(0);
+				uint64_t Seed = 0;
+				int FaultError = EIO;
+				try
 				{
-					bool Success = false;
-					try
+					auto &Object = Data->as<luxem::object>();
+					if (Object.has("seed")) 
+						Seed = Object.get("seed")->as<luxem::primitive>().get_int();
+					else Seed = (static_cast<uint64_t>(std::random_device()()) << 32) | std::random_device()();
+					if (Object.has("error"))
+					{
+						FaultError = ParseErrno(Object.get("error")->as<luxem::primitive>().get_primitive());
+						if (!FaultError) throw std::runtime_error("error");
+					}
+					for (auto const &Rate : Object.get("rates")->as<luxem::object>().get_data())
 					{
-						Shared.Filesystem.SetCount(Data->as<luxem::primitive>().get_int());
-						Success = true;
+						OperationT Kind;
+						if (!ParseOperation(Rate.first, Kind)) throw std::runtime_error("operation");
+						Rates[static_cast<size_t>(Kind)] = Rate.second->as<luxem::primitive>().get_float();
 					}
-					catch (...)
+				}
+				catch (...)
+				{
+					Error(StringT()
+						<< "Bad fault rate [" << luxem::writer().value(Data).dump() << "]");
+					return;
+				}
+				Shared.Filesystem.SetFaultRates(Seed, Rates, FaultError);
+				Reply("set_fault_rate_result").value(static_cast<int64_t>(Seed));
+			}
+			else if (Type == "get_fault_log")
+			{
+				uint64_t Seed = 0, Dropped = 0;
+				auto const Log = Shared.Filesystem.GetFaultLog(Seed, Dropped);
+				auto &Writer = Reply("fault_log");
+				Writer.object_begin()
+					.key("seed").value(static_cast<int64_t>(Seed))
+					.key("dropped").value(static_cast<int64_t>(Dropped))
+					.key("failures").array_begin();
+				for (auto const &Injected : Log)
+					Writer.array_begin()
+						.value(OperationName(Injected.Kind))
+						.value(static_cast<int64_t>(Injected.Index))
+						.array_end();
+				Writer.array_end().object_end();
+			}
+			else if (Type == "get_split_log")
+			{
+				uint64_t Dropped = 0;
+				auto const Log = Shared.Filesystem.GetSplitLog(Dropped);
+				auto &Writer = Reply("split_log");
+				Writer.object_begin()
+					.key("dropped").value(static_cast<int64_t>(Dropped))
+					.key("splits").array_begin();
+				for (auto const &Split : Log)
+				{
+					Writer.object_begin()
+						.key("operation").value(OperationName(Split.Kind))
+						.key("inode").value(static_cast<int64_t>(Split.Inode))
+						.key("offset").value(static_cast<int64_t>(Split.Offset))
+						.key("length").value(static_cast<int64_t>(Split.Length))
+						.key("kept").array_begin();
+					for (auto const &Kept : Split.Kept)
+						Writer.array_begin()
+							.value(static_cast<int64_t>(Kept.first))
+							.value(static_cast<int64_t>(Kept.second))
+							.array_end();
+					Writer.array_end().object_end();
+				}
+				Writer.array_end().object_end();
+			}
+			else if (Type == "stats")
+			{
+				auto const WriteLatency = [](luxem::writer &Writer, StatsT::LatencyT const &Latency)
+				{
+					Writer.object_begin()
+						.key("total").value(static_cast<int64_t>(Latency.Total))
+						.key("p50").value(static_cast<int64_t>(Latency.Percentile(0.5)))
+						.key("p90").value(static_cast<int64_t>(Latency.Percentile(0.9)))
+						.key("p99").value(static_cast<int64_t>(Latency.Percentile(0.99)))
+						.key("p999").value(static_cast<int64_t>(Latency.Percentile(0.999)))
+						.key("max").value(static_cast<int64_t>(Latency.Percentile(1)))
+						.object_end();
+				};
+				auto &Writer = Reply("stats_result");
+				Writer.object_begin();
+				for (auto const &Operation : Stats().Get())
+				{
+					Writer.key(Operation.Name).object_begin()
+						.key("count").value(static_cast<int64_t>(Operation.Count))
+						.key("errors").value(static_cast<int64_t>(Operation.Errors))
+						.key("delayed").value(static_cast<int64_t>(Operation.Delayed))
+						.key("wait");
+					WriteLatency(Writer, Operation.Wait);
+					Writer.key("run");
+					WriteLatency(Writer, Operation.Run);
+					Writer.object_end();
+				}
+				Writer.object_end();
+			}
+			else if (Type == "reset_stats")
+			{
+				Stats().Reset();
+				Reply("reset_stats_result").value(true);
+			}
+			else if (Type == "record_start")
+			{
+				std::string Path;
+				bool Hashes = false;
+				luxem::object *Object = nullptr;
+				try { Object = &Data->as<luxem::object>(); } catch (...) {}
+				try
+				{
+					if (Object)
 					{
-						Error(StringT()
-							<< "Bad count [" << luxem::writer().value(Data).dump() << "]");
-						Success = false;
+						Path = Object->get("file")->as<luxem::primitive>().get_primitive();
+						if (Object->has("hashes"))
+							Hashes = Object->get("hashes")->as<luxem::primitive>().get_bool();
 					}
-					Write(Connection, 
-						luxem::writer()
-							.type("set_result")
-							.value(Success)
-							.dump());
+					else Path = Data->as<luxem::primitive>().get_primitive();
+					if (Path.empty()) throw std::runtime_error("file");
+				}
+				catch (...)
+				{
+					Error(StringT()
+						<< "Bad recording [" << luxem::writer().value(Data).dump() << "]");
+					return;
+				}
+				if (!Shared.Filesystem.StartRecording(Path, Hashes))
+				{
+					Error(StringT()
+						<< "Can't record to [" << Path << "]: " << strerror(errno));
+					return;
+				}
+				Reply("record_start_result").value(true);
+			}
+			else if (Type == "record_stop")
+			{
+				Reply("record_stop_result").value(static_cast<int64_t>(Recorder().Stop()));
+			}
+			else if (Type == "clear_faults")
+			{
+				Shared.Filesystem.ClearFaults();
+				Reply("clear_faults_result").value(true);
+			}
+			else if (Type == "set_latency")
+			{
+				if (!LatencyAllowed)
+				{
+					Error("Latency needs CLUNKER_MULTITHREADED=1 with CLUNKER_HIGH_LEVEL=1");
+					return;
+				}
+				OperationT Kind;
+				bool AnyKind = false;
+				std::string Path;
+				LatencyRuleT Rule;
+				try
+				{
+					auto &Object = Data->as<luxem::object>();
+					if (Object.has("path")) 
+						Path = Object.get("path")->as<luxem::primitive>().get_primitive();
+					if (!Path.empty() && !Object.has("operation")) AnyKind = true;
+					else if (!ParseOperation(Object.get("operation")->as<luxem::primitive>().get_primitive(), Kind))
+						throw std::runtime_error("operation");
+					Rule.Median = Object.get("median")->as<luxem::primitive>().get_float();
+					if (Object.has("p99")) 
+						Rule.P99 = Object.get("p99")->as<luxem::primitive>().get_float();
+					if ((Rule.Median < 0) || (Rule.P99 < 0)) throw std::runtime_error("negative");
+				}
+				catch (...)
+				{
+					Error(StringT()
+						<< "Bad latency [" << luxem::writer().value(Data).dump() << "]");
+					return;
+				}
+				if (!Path.empty()) 
+					Shared.Filesystem.SetPathLatency(Path, AnyKind ? AllOperations() : OperationBit(Kind), Rule);
+				else Shared.Filesystem.SetLatency(Kind, Rule);
+				Reply("set_latency_result").value(true);
+			}
+			else if (Type == "clear_latency")
+			{
+				Shared.Filesystem.ClearLatency();
+				Reply("clear_latency_result").value(true);
+			}
+			else if (Type == "set_process_filter")
+			{
+				std::set<pid_t> Pids, Roots, Groups;
+				try
+				{
+					auto &Object = Data->as<luxem::object>();
+					auto Read = [&Object](std::string const &Key, std::set<pid_t> &Out)
+					{
+						if (!Object.has(Key)) return;
+						for (auto const &Element : Object.get(Key)->as<luxem::array>().get_data())
+							Out.insert(Element->as<luxem::primitive>().get_int());
+					};
+					Read("pids", Pids);
+					Read("roots", Roots);
+					Read("groups", Groups);
+				}
+				catch (...)
+				{
+					Error(StringT()
+						<< "Bad process filter [" << luxem::writer().value(Data).dump() << "]");
+					return;
+				}
+				Shared.Filesystem.SetProcessFilter(std::move(Pids), std::move(Roots), std::move(Groups));
+				Reply("set_process_filter_result").value(true);
+			}
+			else if (Type == "clear_process_filter")
+			{
+				Shared.Filesystem.ClearProcessFilter();
+				Reply("clear_process_filter_result").value(true);
+			}
+			else if (Type == "track_durability")
+			{
+				bool On = false;
+				try
+				{
+					On = Data->as<luxem::primitive>().get_bool();
+				}
+				catch (...)
+				{
+					Error(StringT()
+						<< "Bad durability tracking flag [" << luxem::writer().value(Data).dump() << "]");
+					return;
+				}
+				Shared.Filesystem.TrackDurability(On);
+				Reply("track_durability_result").value(true);
+			}
+			else if (Type == "crash")
+			{
+				uint64_t Seed = (static_cast<uint64_t>(std::random_device()()) << 32) | std::random_device()();
+				double Survive = 0;
+				bool Tear = false;
+				// A bare (crash) takes the defaults
+				luxem::object *Object = nullptr;
+				try { Object = &Data->as<luxem::object>(); } catch (...) {}
+				try
+				{
+					if (Object && Object->has("seed")) 
+						Seed = Object->get("seed")->as<luxem::primitive>().get_int();
+					if (Object && Object->has("survive")) 
+						Survive = Object->get("survive")->as<luxem::primitive>().get_float();
+					if (Object && Object->has("tear")) 
+						Tear = Object->get("tear")->as<luxem::primitive>().get_bool();
+				}
+				catch (...)
+				{
+					Error(StringT()
+						<< "Bad crash options [" << luxem::writer().value(Data).dump() << "]");
+					return;
+				}
+				auto &Writer = Reply("crash_result");
+				if (Shared.Filesystem.Crash(Seed, Survive, Tear)) Writer.value(static_cast<int64_t>(Seed));
+				else Writer.value(false);
+			}
+			else if (Type == "set_log_level")
+			{
+				LogLevelT Level;
+				bool Parsed = false;
+				try
+				{
+					Parsed = ParseLogLevel(Data->as<luxem::primitive>().get_primitive(), Level);
+				}
+				catch (...) {}
+				if (!Parsed)
+				{
+					Error(StringT()
+						<< "Bad log level [" << luxem::writer().value(Data).dump() << "]");
+					return;
+				}
+				Logger().SetLevel(Level);
+				Reply("set_log_level_result").value(true);
+			}
+			else if (Type == "extents")
+			{
+				std::vector<std::pair<off_t, off_t>> Extents;
+				std::string Path;
+				try
+				{
+					Path = Data->as<luxem::primitive>().get_primitive();
+				}
+				catch (...)
+				{
+					Error(StringT()
+						<< "Bad path [" << luxem::writer().value(Data).dump() << "]");
+					return;
+				}
+				if (Path.empty() || (Path[0] != '/')) Path = "/" + Path;
+				if (!Shared.Filesystem.Extents(Path, Extents))
+				{
+					Error(StringT()
+						<< "No regular file at [" << Path << "]");
+					return;
+				}
+				auto &Writer = Reply("extents");
+				Writer.array_begin();
+				for (auto const &Extent : Extents)
+					Writer.array_begin()
+						.value(static_cast<int64_t>(Extent.first))
+						.value(static_cast<int64_t>(Extent.second))
+						.array_end();
+				Writer.array_end();
+			}
+			else if ((Type == "snapshot") || (Type == "restore") || (Type == "drop_snapshot"))
+			{
+				std::string Name;
+				try
+				{
+					Name = Data->as<luxem::primitive>().get_primitive();
+				}
+				catch (...)
+				{
+					Error(StringT()
+						<< "Bad snapshot name [" << luxem::writer().value(Data).dump() << "]");
+					return;
+				}
+				bool Success = true;
+				if (Type == "snapshot") Shared.Filesystem.Snapshot(Name);
+				else if (Type == "restore") Success = Shared.Filesystem.Restore(Name);
+				else Success = Shared.Filesystem.DropSnapshot(Name);
+				Reply(Type + "_result").value(Success);
+			}
+			else if (Type == "set_memory_limit")
+			{
+				int64_t Limit = 0;
+				try
+				{
+					Limit = Data->as<luxem::primitive>().get_int();
+					if (Limit < 0) throw std::runtime_error("negative");
 				}
-				else if (Type == "get_count")
+				catch (...)
 				{
-					Write(Connection,
-						luxem::writer()
-							.type("count")
-							.value(Shared.Filesystem.GetCount())
-							.dump());
+					Error(StringT()
+						<< "Bad memory limit [" << luxem::writer().value(Data).dump() << "]");
+					return;
 				}
-				else
+				GlobalPool().SetLimit(Limit);
+				Reply("set_memory_limit_result").value(true);
+			}
+			else if (Type == "get_memory_usage")
+			{
+				Reply("memory_usage").value(static_cast<int64_t>(GlobalPool().GetUsed()));
+			}
+			else if (Type == "get_count")
+			{
+				Reply("count").value(Shared.Filesystem.GetCount());
+			}
+			else
+			{
+				Error(StringT() <<
+					"Unknown message type [" << Type << "]");
+				return;
+			}
+		};
+
+		// Start listeners on IPC thread
+		asio::ip::tcp::endpoint TCPEndpoint(asio::ip::tcp::v4(), Port);
+		TCPListen(Shared.MainService, TCPEndpoint, [&Shared, &Command](std::shared_ptr<asio::ip::tcp::socket> Connection)
+		{
+			auto Reader = std::make_shared<luxem::reader>();
+			Reader->element([&Shared, &Command, Connection](std::shared_ptr<luxem::value> &&Data)
+			{
+				luxem::writer Writer;
+				if (!Data->has_type()) 
 				{
-					Error(StringT() <<
-						"Unknown message type [" << Type << "]");
+					ControlReplyT(Writer, "").Error(StringT() 
+						<< "Message has no type: [" << luxem::writer().value(Data).dump() << "]");
+					Write(Connection, Writer.dump());
 					return;
 				}
+
+				std::string Type, ID;
+				ControlReplyT::Split(Data->get_type(), Type, ID);
+				ControlReplyT Reply(Writer, ID);
+				if (Type == "batch")
+				{
+					luxem::array *Commands = nullptr;
+					try { Commands = &Data->as<luxem::array>(); } catch (...) {}
+					if (!Commands)
+					{
+						Reply.Error(StringT()
+							<< "Bad batch [" << luxem::writer().value(Data).dump() << "]");
+						Write(Connection, Writer.dump());
+						return;
+					}
+					Reply("batch_result").array_begin();
+					Shared.Filesystem.Batch([&](void)
+					{
+						for (auto const &Element : Commands->get_data())
+						{
+							if (!Element->has_type())
+							{
+								ControlReplyT(Writer, "").Error(StringT() 
+									<< "Message has no type: [" << luxem::writer().value(Element).dump() << "]");
+								continue;
+							}
+							std::string ElementType, ElementID;
+							ControlReplyT::Split(Element->get_type(), ElementType, ElementID);
+							ControlReplyT ElementReply(Writer, ElementID);
+							if (ElementType == "batch") ElementReply.Error("Batches can't be nested");
+							else Command(Element, ElementType, ElementReply);
+						}
+					});
+					Writer.array_end();
+				}
+				else Command(Data, Type, Reply);
+				Write(Connection, Writer.dump());
 			});
 			LoopRead(std::move(Connection), [&Shared, Reader](ReadBufferT &Buffer)
 			{
@@ -676,12 +3000,12 @@ int main(int argc, char **argv)
 #endif
 			Shared.Filesystem.OutOfBandThreadIDs.insert(tid);
 			Shared.MainService.run();
-			std::cout << "IPC stopped " << std::endl;
+			LOG(Info, "IPC stopped");
 		});
 
 		// Start fuse on other thread
-		auto Result = Shared.Fuse.Run(); 
-		std::cout << "Fuse stopped " << std::endl;
+		auto Result = Shared.Fuse.Run(Multithreaded); 
+		LOG(Info, "Fuse stopped");
 
 		IPCThread.join();
 
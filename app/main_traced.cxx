@@ -0,0 +1,3 @@
+// clunker with every operation traced; see trace.h
+#define CLUNKER_TRACE
+#include "main.cxx"
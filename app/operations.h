@@ -0,0 +1,68 @@
+#ifndef operations_h
+#define operations_h
+
+#include <string>
+#include <cstdint>
+
+// Operation kinds, named after the high-level FUSE callbacks.  Low-level
+// setattr counts as whichever of chmod, chown, truncate or utimens it does.
+#define CLUNKER_OPERATIONS(X) \
+	X(lookup) \
+	X(getattr) \
+	X(readlink) \
+	X(mkdir) \
+	X(unlink) \
+	X(rmdir) \
+	X(symlink) \
+	X(rename) \
+	X(link) \
+	X(chmod) \
+	X(chown) \
+	X(truncate) \
+	X(utimens) \
+	X(open) \
+	X(read) \
+	X(write) \
+	X(fsync) \
+	X(fsyncdir) \
+	X(opendir) \
+	X(readdir) \
+	X(access) \
+	X(create) \
+	X(fallocate)
+
+enum struct OperationT : uint8_t
+{
+#define CLUNKER_OPERATION_ENUM(name) name,
+	CLUNKER_OPERATIONS(CLUNKER_OPERATION_ENUM)
+#undef CLUNKER_OPERATION_ENUM
+	Count
+};
+
+// False if the name isn't an operation
+inline bool ParseOperation(std::string const &Name, OperationT &Out)
+{
+#define CLUNKER_OPERATION_PARSE(name) if (Name == #name) { Out = OperationT::name; return true; }
+	CLUNKER_OPERATIONS(CLUNKER_OPERATION_PARSE)
+#undef CLUNKER_OPERATION_PARSE
+	return false;
+}
+
+inline char const *OperationName(OperationT Kind)
+{
+	switch (Kind)
+	{
+#define CLUNKER_OPERATION_NAME(name) case OperationT::name: return #name;
+		CLUNKER_OPERATIONS(CLUNKER_OPERATION_NAME)
+#undef CLUNKER_OPERATION_NAME
+		default: return "";
+	}
+}
+
+inline uint32_t OperationBit(OperationT Kind) { return uint32_t(1) << static_cast<size_t>(Kind); }
+
+inline uint32_t AllOperations(void) { return OperationBit(OperationT::Count) - 1; }
+
+static_assert(static_cast<size_t>(OperationT::Count) < 32, "Operation kinds must fit a 32 bit mask");
+
+#endif
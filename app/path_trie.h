@@ -0,0 +1,98 @@
+#ifndef path_trie_h
+#define path_trie_h
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <fnmatch.h>
+
+// Path components from the root, as matched by path rules
+typedef std::vector<std::string> RulePathT;
+
+// Values kept by path pattern, each applying to its path and everything below
+// it.  Pattern components may be shell globs, like /db/*.wal.  Plain
+// components are looked up directly, only glob components are matched one by
+// one.
+template <typename ValueT> struct PathTrieT
+{
+	// The values for exactly this pattern
+	std::vector<std::unique_ptr<ValueT>> &At(std::string const &Pattern)
+	{
+		auto Node = &Root;
+		for (auto const &Component : Split(Pattern))
+		{
+			if (Component.find_first_of("*?[") == std::string::npos)
+			{
+				auto &Child = Node->Names[Component];
+				if (!Child) Child.reset(new NodeT());
+				Node = Child.get();
+			}
+			else
+			{
+				auto Found = std::find_if(Node->Patterns.begin(), Node->Patterns.end(), 
+					[&](std::pair<std::string, std::unique_ptr<NodeT>> const &Child) { return Child.first == Component; });
+				if (Found == Node->Patterns.end())
+				{
+					Node->Patterns.emplace_back(Component, std::unique_ptr<NodeT>(new NodeT()));
+					Found = Node->Patterns.end() - 1;
+				}
+				Node = Found->second.get();
+			}
+		}
+		return Node->Values;
+	}
+
+	void Clear(void) { Root = NodeT(); }
+
+	// Calls Visit with the values of every pattern matching Path or one of
+	// its parents, shallower first, until Visit returns true
+	template <typename VisitT> bool Match(RulePathT const &Path, VisitT &&Visit)
+	{
+		return Match(Root, Path, 0, Visit);
+	}
+
+	static RulePathT Split(std::string const &Path)
+	{
+		RulePathT Out;
+		size_t Start = 0;
+		while (Start <= Path.size())
+		{
+			auto End = Path.find('/', Start);
+			if (End == std::string::npos) End = Path.size();
+			if ((End > Start) && (Path.compare(Start, End - Start, ".") != 0)) 
+				Out.emplace_back(Path, Start, End - Start);
+			Start = End + 1;
+		}
+		return Out;
+	}
+
+	private:
+		struct NodeT
+		{
+			std::vector<std::unique_ptr<ValueT>> Values;
+			std::unordered_map<std::string, std::unique_ptr<NodeT>> Names;
+			std::vector<std::pair<std::string, std::unique_ptr<NodeT>>> Patterns;
+		};
+
+		template <typename VisitT> static bool Match(NodeT &Node, RulePathT const &Path, size_t Depth, VisitT &Visit)
+		{
+			for (auto &Value : Node.Values)
+				if (Visit(*Value)) return true;
+			if (Depth == Path.size()) return false;
+			auto const &Component = Path[Depth];
+			auto Found = Node.Names.find(Component);
+			if ((Found != Node.Names.end()) && Match(*Found->second, Path, Depth + 1, Visit)) return true;
+			for (auto &Child : Node.Patterns)
+			{
+				if (fnmatch(Child.first.c_str(), Component.c_str(), FNM_PERIOD) != 0) continue;
+				if (Match(*Child.second, Path, Depth + 1, Visit)) return true;
+			}
+			return false;
+		}
+
+		NodeT Root;
+};
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef pool_h
+#define pool_h
+
+#include <mutex>
+#include <atomic>
+#include <new>
+#include <algorithm>
+#include <cstdint>
+#include <sys/mman.h>
+
+#include "../ren-cxx-basics/error.h"
+
+// Counts the bytes the program holds on the regular heap - directory maps,
+// names, journal entries, delayed request copies and the like - so they count
+// towards the pool's cap.  The executable's operator new and delete report
+// here; see main.cxx.  Changes are gathered per thread and published in steps
+// of Step bytes, so the shared count is touched rarely and is off by at most
+// a step per thread.
+struct HeapCountT
+{
+	static constexpr int64_t Step = 64 * 1024;
+
+	static void Add(int64_t Bytes)
+	{
+		auto &Local = Pending();
+		if (Local.Done) { Total().fetch_add(Bytes, std::memory_order_relaxed); return; }
+		Local.Bytes += Bytes;
+		if ((Local.Bytes < Step) && (Local.Bytes > -Step)) return;
+		Total().fetch_add(Local.Bytes, std::memory_order_relaxed);
+		Local.Bytes = 0;
+	}
+
+	static size_t Get(void)
+	{
+		auto const Out = Total().load(std::memory_order_relaxed);
+		return Out > 0 ? Out : 0;
+	}
+
+	private:
+		// Published when the thread exits; frees after that go straight to
+		// the total
+		struct PendingT
+		{
+			int64_t Bytes = 0;
+			bool Done = false;
+
+			~PendingT(void)
+			{
+				Total().fetch_add(Bytes, std::memory_order_relaxed);
+				Bytes = 0;
+				Done = true;
+			}
+		};
+
+		static PendingT &Pending(void)
+		{
+			static thread_local PendingT Pending;
+			return Pending;
+		}
+
+		static std::atomic<int64_t> &Total(void)
+		{
+			static std::atomic<int64_t> Total(0);
+			return Total;
+		}
+};
+
+// Size class slab allocator for nodes, handles and data chunks.  Slabs are
+// mapped directly so they can be returned to the system once empty, and the
+// total size can be capped - allocations past the cap fail (nullptr) instead
+// of the process growing until it's killed.  The cap covers the slabs and the
+// counted heap together; heap allocations themselves never fail on it, they
+// only leave less room for slabs.  Each size class has its own lock.
+struct PoolT
+{
+	static constexpr size_t SlabSize = 2 * 1024 * 1024;
+	static constexpr size_t MinimumClass = 16;
+	static constexpr size_t MaximumClass = 64 * 1024;
+
+	PoolT(void) : Limit(0), Mapped(0), HugePages(false) {}
+
+	PoolT(PoolT const &) = delete;
+
+	// 0 disables the limit
+	void SetLimit(size_t Bytes) { Limit = Bytes; }
+	size_t GetLimit(void) const { return Limit; }
+	size_t GetMapped(void) const { return Mapped; }
+	// Slabs and counted heap
+	size_t GetUsed(void) const { return Mapped + HeapCountT::Get(); }
+
+	void SetHugePages(bool Enable) { HugePages = Enable; }
+
+	void *Allocate(size_t Size)
+	{
+		auto &Class = Classes[ClassIndex(Size)];
+		std::lock_guard<std::mutex> Guard(Class.Mutex);
+		auto Slab = Class.Partial;
+		if (!Slab)
+		{
+			Slab = CreateSlab(ClassIndex(Size));
+			if (!Slab) return nullptr;
+			Link(Class, *Slab);
+		}
+		void *Out;
+		if (Slab->Free)
+		{
+			Out = Slab->Free;
+			Slab->Free = *reinterpret_cast<void **>(Out);
+		}
+		else
+		{
+			Out = reinterpret_cast<uint8_t *>(Slab) + Slab->Start + Slab->Fresh * Slab->ObjectSize;
+			Slab->Fresh += 1;
+		}
+		Slab->Used += 1;
+		if (Slab->Used == Slab->Capacity) Unlink(Class, *Slab);
+		return Out;
+	}
+
+	void Free(void *Pointer)
+	{
+		if (!Pointer) return;
+		auto Slab = reinterpret_cast<SlabT *>(reinterpret_cast<uintptr_t>(Pointer) & ~(SlabSize - 1));
+		auto &Class = Classes[Slab->Class];
+		std::lock_guard<std::mutex> Guard(Class.Mutex);
+		*reinterpret_cast<void **>(Pointer) = Slab->Free;
+		Slab->Free = Pointer;
+		if (Slab->Used == Slab->Capacity) Link(Class, *Slab);
+		Slab->Used -= 1;
+		if ((Slab->Used == 0) && ((Class.Partial != Slab) || Slab->Next))
+		{
+			// Keep at most one empty slab per class so memory drops back after
+			// mass deletes without thrashing on a create/delete loop
+			Unlink(Class, *Slab);
+			DestroySlab(Slab);
+		}
+	}
+
+	private:
+		struct SlabT
+		{
+			SlabT *Previous, *Next;
+			void *Free;
+			size_t Class;
+			size_t ObjectSize;
+			size_t Start;
+			size_t Capacity;
+			size_t Fresh;
+			size_t Used;
+		};
+
+		struct ClassT
+		{
+			std::mutex Mutex;
+			SlabT *Partial = nullptr;
+		};
+
+		static constexpr size_t ClassCount = 13;
+		static_assert(MinimumClass << (ClassCount - 1) == MaximumClass, "Size classes don't cover the maximum size");
+
+		static size_t ClassIndex(size_t Size)
+		{
+			AssertLTE(Size, MaximumClass);
+			size_t Index = 0;
+			while ((MinimumClass << Index) < Size) ++Index;
+			return Index;
+		}
+
+		SlabT *CreateSlab(size_t Class)
+		{
+			// Reserved first so classes growing at once can't pass the cap
+			auto const Before = Mapped.fetch_add(SlabSize);
+			if (Limit && (Before + SlabSize + HeapCountT::Get() > Limit))
+			{
+				Mapped -= SlabSize;
+				return nullptr;
+			}
+			// Over-map so the slab can be aligned to its size, which lets Free
+			// find the header by masking the object address
+			auto Raw = mmap(nullptr, SlabSize * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (Raw == MAP_FAILED)
+			{
+				Mapped -= SlabSize;
+				return nullptr;
+			}
+			auto const RawStart = reinterpret_cast<uintptr_t>(Raw);
+			auto const Start = (RawStart + SlabSize - 1) & ~(SlabSize - 1);
+			if (Start > RawStart) munmap(Raw, Start - RawStart);
+			munmap(reinterpret_cast<void *>(Start + SlabSize), RawStart + SlabSize - Start);
+			if (HugePages) madvise(reinterpret_cast<void *>(Start), SlabSize, MADV_HUGEPAGE);
+
+			auto Slab = reinterpret_cast<SlabT *>(Start);
+			Slab->Previous = nullptr;
+			Slab->Next = nullptr;
+			Slab->Free = nullptr;
+			Slab->Class = Class;
+			Slab->ObjectSize = MinimumClass << Class;
+			Slab->Start = std::max(Slab->ObjectSize, (sizeof(SlabT) + 63) & ~size_t(63));
+			Slab->Capacity = (SlabSize - Slab->Start) / Slab->ObjectSize;
+			Slab->Fresh = 0;
+			Slab->Used = 0;
+			return Slab;
+		}
+
+		void DestroySlab(SlabT *Slab)
+		{
+			munmap(Slab, SlabSize);
+			Mapped -= SlabSize;
+		}
+
+		void Link(ClassT &Class, SlabT &Slab)
+		{
+			Slab.Previous = nullptr;
+			Slab.Next = Class.Partial;
+			if (Class.Partial) Class.Partial->Previous = &Slab;
+			Class.Partial = &Slab;
+		}
+
+		void Unlink(ClassT &Class, SlabT &Slab)
+		{
+			if (Slab.Previous) Slab.Previous->Next = Slab.Next;
+			else Class.Partial = Slab.Next;
+			if (Slab.Next) Slab.Next->Previous = Slab.Previous;
+			Slab.Previous = nullptr;
+			Slab.Next = nullptr;
+		}
+
+		std::atomic<size_t> Limit;
+		std::atomic<size_t> Mapped;
+		std::atomic<bool> HugePages;
+		ClassT Classes[ClassCount];
+};
+
+inline PoolT &GlobalPool(void)
+{
+	static PoolT Pool;
+	return Pool;
+}
+
+// For allocate_shared and containers; throws std::bad_alloc past the limit
+template <typename ValueT> struct PoolAllocatorT
+{
+	typedef ValueT value_type;
+
+	PoolAllocatorT(void) {}
+	template <typename OtherT> PoolAllocatorT(PoolAllocatorT<OtherT> const &) {}
+
+	ValueT *allocate(size_t Count)
+	{
+		auto Out = GlobalPool().Allocate(sizeof(ValueT) * Count);
+		if (!Out) throw std::bad_alloc();
+		return static_cast<ValueT *>(Out);
+	}
+
+	void deallocate(ValueT *Pointer, size_t) { GlobalPool().Free(Pointer); }
+
+	template <typename OtherT> bool operator ==(PoolAllocatorT<OtherT> const &) const { return true; }
+	template <typename OtherT> bool operator !=(PoolAllocatorT<OtherT> const &) const { return false; }
+};
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef process_filter_h
+#define process_filter_h
+
+#include <set>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <cstdint>
+#include <sys/types.h>
+
+// Decides which callers' operations are counted and faulted.  FUSE reports
+// the calling thread, so a caller is watched if the thread or its process is
+// listed in Pids, its process group is in Groups, or its process is in Roots
+// or descended from one.  Classifications are cached by thread ID in a fixed
+// table, tagged with a generation that changes with the filter, so a repeat
+// caller costs a few loads and no I/O.  At most once a second a cached
+// thread's start time is checked again, so a thread ID reused by a new thread
+// isn't mistaken for the old one.
+struct ProcessFilterT
+{
+	ProcessFilterT(void) : Active(false), Generation(1) {}
+
+	// Operations must be excluded while the filter changes
+	void Set(std::set<pid_t> &&Pids, std::set<pid_t> &&Roots, std::set<pid_t> &&Groups)
+	{
+		this->Pids = std::move(Pids);
+		this->Roots = std::move(Roots);
+		this->Groups = std::move(Groups);
+		Generation += 1;
+		Active = true;
+	}
+
+	void Clear(void)
+	{
+		Pids.clear();
+		Roots.clear();
+		Groups.clear();
+		Generation += 1;
+		Active = false;
+	}
+
+	// Everyone is watched while there's no filter
+	bool Watched(pid_t Thread)
+	{
+		if (!Active) return true;
+		// Thread IDs fit in 22 bits, and the generation in the rest
+		auto const Key = (Generation << 23) | (static_cast<uint64_t>(Thread) << 1);
+		auto &Slot = Cache[static_cast<uint64_t>(Thread) % Cache.size()];
+		auto const Now = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+		auto const Cached = Slot.Key.load(std::memory_order_acquire);
+		uint64_t Started = 0;
+		if ((Cached & ~uint64_t(1)) == Key)
+		{
+			if (Now - Slot.Checked.load(std::memory_order_relaxed) < RecheckMilliseconds) return Cached & 1;
+			if (!ReadStart(Thread, Started)) return Classify(Thread);
+			if (Started == Slot.Started.load(std::memory_order_relaxed))
+			{
+				Slot.Checked.store(Now, std::memory_order_relaxed);
+				return Cached & 1;
+			}
+		}
+		else if (!ReadStart(Thread, Started)) return Classify(Thread);
+		auto const Out = Classify(Thread);
+		Slot.Started.store(Started, std::memory_order_relaxed);
+		Slot.Checked.store(Now, std::memory_order_relaxed);
+		Slot.Key.store(Key | (Out ? 1 : 0), std::memory_order_release);
+		return Out;
+	}
+
+	private:
+		struct StatusT
+		{
+			pid_t Process = 0;
+			pid_t Parent = 0;
+			pid_t Group = 0;
+		};
+
+		// False if the thread is gone
+		static bool ReadStatus(pid_t Thread, StatusT &Out)
+		{
+			std::ifstream File("/proc/" + std::to_string(Thread) + "/status");
+			if (!File) return false;
+			std::string Key;
+			while (File >> Key)
+			{
+				if (Key == "Tgid:") File >> Out.Process;
+				else if (Key == "PPid:") File >> Out.Parent;
+				else if (Key == "NSpgid:") File >> Out.Group;
+				File.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+			}
+			return Out.Process != 0;
+		}
+
+		// The start time field of /proc/<tid>/stat.  False if the thread is gone.
+		static bool ReadStart(pid_t Thread, uint64_t &Out)
+		{
+			std::ifstream File("/proc/" + std::to_string(Thread) + "/stat");
+			if (!File) return false;
+			std::string Line;
+			if (!std::getline(File, Line)) return false;
+			// The command name can hold anything, so count fields after it
+			auto const NameEnd = Line.rfind(')');
+			if (NameEnd == std::string::npos) return false;
+			std::istringstream Fields(Line.substr(NameEnd + 1));
+			std::string Skipped;
+			for (int Field = 3; Field < 22; ++Field)
+				if (!(Fields >> Skipped)) return false;
+			return static_cast<bool>(Fields >> Out);
+		}
+
+		bool Classify(pid_t Thread) const
+		{
+			if (Pids.count(Thread)) return true;
+			StatusT Status;
+			if (!ReadStatus(Thread, Status)) return false;
+			if (Pids.count(Status.Process) || Groups.count(Status.Group)) return true;
+			if (Roots.empty()) return false;
+			auto Process = Status.Process;
+			while (Process > 0)
+			{
+				if (Roots.count(Process)) return true;
+				StatusT Ancestor;
+				if (!ReadStatus(Process, Ancestor)) return false;
+				Process = Ancestor.Parent;
+			}
+			return false;
+		}
+
+		static constexpr int64_t RecheckMilliseconds = 1000;
+
+		// Key holds the generation, thread ID and verdict
+		struct SlotT
+		{
+			std::atomic<uint64_t> Key{0};
+			std::atomic<uint64_t> Started{0};
+			// When Started was last read, in milliseconds on the steady clock
+			std::atomic<int64_t> Checked{0};
+		};
+
+		bool Active;
+		uint64_t Generation;
+		std::set<pid_t> Pids;
+		std::set<pid_t> Roots;
+		std::set<pid_t> Groups;
+		std::array<SlotT, 4096> Cache;
+};
+
+#endif
@@ -0,0 +1,340 @@
+#ifndef record_h
+#define record_h
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "record_ring.h"
+#include "log.h"
+
+// Records every in-band operation to a binary file, to be replayed later as a
+// benchmark.  The file is the magic, then entries each starting with a type
+// byte: a name gives a path or symlink target an id, and an operation refers
+// to names by id.  Ids start at 1; 0 means none.
+//
+// Each thread records into a ring of its own and a background thread writes
+// the rings out, so operations from different threads reach the file out of
+// order; Sequence gives the order they finished in.  Operations that don't fit
+// in a full ring are dropped with a warning.
+
+struct RecordFormatT
+{
+	static char const *Magic(void) { return "clunkrc2"; }
+	static constexpr size_t MagicSize = 8;
+
+	enum : uint8_t
+	{
+		Name = 0,
+		Operation = 1,
+	};
+
+	// Kinds beyond OperationT, for requests that aren't counted
+	static constexpr uint8_t Release = 0x80;
+
+	// Followed by Length bytes
+	struct NameEntryT
+	{
+		uint32_t ID;
+		uint16_t Length;
+	} __attribute__((packed));
+
+	// Result is 0 or a negative errno, or a byte count for high-level reads
+	// and writes.  Offset and Size hold uid and gid for chown.  Hash is 0 when
+	// hashing is off or the written data wasn't in memory to hash.
+	struct OperationEntryT
+	{
+		uint8_t Kind;
+		int32_t Result;
+		uint32_t Path;
+		uint32_t Target;
+		uint32_t Mode;
+		uint32_t Flags;
+		uint64_t Handle;
+		int64_t Offset;
+		uint64_t Size;
+		uint64_t Hash;
+		uint64_t Sequence;
+	} __attribute__((packed));
+
+	// FNV-1a
+	static uint64_t Hash(uint64_t Hash, void const *Data, size_t Length)
+	{
+		auto const Bytes = static_cast<uint8_t const *>(Data);
+		for (size_t Index = 0; Index < Length; ++Index)
+			Hash = (Hash ^ Bytes[Index]) * 0x100000001b3ull;
+		return Hash;
+	}
+
+	static constexpr uint64_t HashStart = 0xcbf29ce484222325ull;
+};
+
+// What's known about the request being served on this thread.  The filesystem
+// fills it in on each pass and the glue records it once the request is done.
+struct RequestRecordT
+{
+	static constexpr int16_t Unset = -1;
+
+	int16_t Kind = Unset;
+	std::string Path;
+	std::string Target;
+	uint32_t Mode = 0;
+	uint32_t Flags = 0;
+	uint64_t Handle = 0;
+	int64_t Offset = 0;
+	uint64_t Size = 0;
+	uint64_t Hash = 0;
+
+	void Clear(void)
+	{
+		Kind = Unset;
+		Path.clear();
+		Target.clear();
+		Mode = 0;
+		Flags = 0;
+		Handle = 0;
+		Offset = 0;
+		Size = 0;
+		Hash = 0;
+	}
+};
+
+inline RequestRecordT &RequestRecord(void)
+{
+	static thread_local RequestRecordT Record;
+	return Record;
+}
+
+struct RecorderT
+{
+	RecorderT(void) : On(false), Hashing(false), Generation(0), Sequence(0), Die(false), File(-1), NextName(1), Count(0) {}
+
+	RecorderT(RecorderT const &) = delete;
+
+	~RecorderT(void) { Stop(); }
+
+	bool Active(void) const { return On.load(std::memory_order_relaxed); }
+
+	// Whether written data should be hashed
+	bool Hashes(void) const { return Hashing.load(std::memory_order_relaxed); }
+
+	// Replaces any recording in progress.  False, with errno set, if the file
+	// can't be opened.
+	bool Start(std::string const &Path, bool Hash)
+	{
+		std::lock_guard<std::mutex> Guard(ControlMutex);
+		Close();
+		File = open(Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (File < 0) return false;
+		Names.clear();
+		NextName = 1;
+		Count = 0;
+		Buffer.assign(RecordFormatT::Magic(), RecordFormatT::Magic() + RecordFormatT::MagicSize);
+		Generation += 1;
+		Sequence = 0;
+		Die = false;
+		Thread = std::thread([this](void) { Run(); });
+		Hashing = Hash;
+		On = true;
+		return true;
+	}
+
+	// The number of operations recorded
+	uint64_t Stop(void)
+	{
+		std::lock_guard<std::mutex> Guard(ControlMutex);
+		Close();
+		return Count;
+	}
+
+	void Write(RequestRecordT const &Record, int32_t Result)
+	{
+		if (Record.Kind == RequestRecordT::Unset) return;
+		auto &Ring = this->Ring();
+		auto const Length = sizeof(RingEntryT) + Record.Path.size() + Record.Target.size();
+		if (Length > RecordRingT::MaxRecord)
+		{
+			Ring.Dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		RingEntryT Entry;
+		Entry.Length = Length;
+		Entry.PathLength = Record.Path.size();
+		Entry.TargetLength = Record.Target.size();
+		Entry.Generation = Generation.load(std::memory_order_relaxed);
+		auto &Out = Entry.Operation;
+		Out.Kind = Record.Kind;
+		Out.Result = Result;
+		Out.Path = 0;
+		Out.Target = 0;
+		Out.Mode = Record.Mode;
+		Out.Flags = Record.Flags;
+		Out.Handle = Record.Handle;
+		Out.Offset = Record.Offset;
+		Out.Size = Record.Size;
+		Out.Hash = Record.Hash;
+		Out.Sequence = Sequence.fetch_add(1, std::memory_order_relaxed);
+		char Bytes[RecordRingT::MaxRecord];
+		memcpy(Bytes, &Entry, sizeof(Entry));
+		memcpy(Bytes + sizeof(Entry), Record.Path.data(), Record.Path.size());
+		memcpy(Bytes + sizeof(Entry) + Record.Path.size(), Record.Target.data(), Record.Target.size());
+		Ring.Push(Bytes, Length);
+		if (Ring.Used() > RecordRingT::Size / 2) Condition.notify_one();
+	}
+
+	private:
+		static constexpr size_t FlushSize = 1 << 20;
+
+		// An operation as stored in a ring, followed by its path and target.
+		// Names are interned by the writer thread.
+		struct RingEntryT
+		{
+			uint16_t Length;
+			uint16_t PathLength;
+			uint16_t TargetLength;
+			uint32_t Generation;
+			RecordFormatT::OperationEntryT Operation;
+		} __attribute__((packed));
+
+		struct HolderT
+		{
+			std::shared_ptr<RecordRingT> Ring;
+			~HolderT(void) { if (Ring) Ring->Orphaned = true; }
+		};
+
+		RecordRingT &Ring(void)
+		{
+			static thread_local HolderT Holder;
+			if (!Holder.Ring) Holder.Ring = Rings.Add();
+			return *Holder.Ring;
+		}
+
+		void Run(void)
+		{
+			std::unique_lock<std::mutex> Guard(Mutex);
+			while (!Die)
+			{
+				Condition.wait_for(Guard, std::chrono::milliseconds(100));
+				Guard.unlock();
+				Drain();
+				Guard.lock();
+			}
+			Guard.unlock();
+			Drain();
+		}
+
+		// On the writer thread only.  Operations left in the rings from an
+		// earlier recording are skipped.
+		void Drain(void)
+		{
+			auto const Current = Generation.load(std::memory_order_relaxed);
+			for (auto const &Ring : Rings.Take())
+			{
+				Ring->Drain([&](char const *Record, size_t)
+				{
+					RingEntryT Entry;
+					memcpy(&Entry, Record, sizeof(Entry));
+					if (Entry.Generation != Current) return;
+					auto const Path = Record + sizeof(Entry);
+					Entry.Operation.Path = Intern(Path, Entry.PathLength);
+					Entry.Operation.Target = Intern(Path + Entry.PathLength, Entry.TargetLength);
+					Buffer.push_back(RecordFormatT::Operation);
+					Append(&Entry.Operation, sizeof(Entry.Operation));
+					Count += 1;
+				});
+				auto const Dropped = Ring->Dropped.exchange(0, std::memory_order_relaxed);
+				if (Dropped) LOG(Warning, Dropped << " recorded operations dropped");
+			}
+			if (Buffer.size() >= FlushSize) Flush();
+		}
+
+		// On the writer thread only
+		uint32_t Intern(char const *Text, size_t Length)
+		{
+			if (!Length) return 0;
+			std::string Name(Text, Length);
+			auto Found = Names.find(Name);
+			if (Found != Names.end()) return Found->second;
+			auto const ID = NextName++;
+			RecordFormatT::NameEntryT Out;
+			Out.ID = ID;
+			Out.Length = Length;
+			Buffer.push_back(RecordFormatT::Name);
+			Append(&Out, sizeof(Out));
+			Append(Name.data(), Out.Length);
+			Names.emplace(std::move(Name), ID);
+			return ID;
+		}
+
+		void Append(void const *Data, size_t Length)
+		{
+			auto const Bytes = static_cast<char const *>(Data);
+			Buffer.insert(Buffer.end(), Bytes, Bytes + Length);
+		}
+
+		void Flush(void)
+		{
+			size_t Done = 0;
+			while (Done < Buffer.size())
+			{
+				auto const Written = ::write(File, Buffer.data() + Done, Buffer.size() - Done);
+				if (Written <= 0) break;
+				Done += Written;
+			}
+			Buffer.clear();
+		}
+
+		// With the control mutex held.  Waits for the writer thread to drain
+		// what's been recorded so far.
+		void Close(void)
+		{
+			On = false;
+			if (File < 0) return;
+			{
+				std::lock_guard<std::mutex> Guard(Mutex);
+				Die = true;
+			}
+			Condition.notify_all();
+			Thread.join();
+			Flush();
+			close(File);
+			File = -1;
+		}
+
+		std::atomic<bool> On;
+		std::atomic<bool> Hashing;
+		std::atomic<uint32_t> Generation;
+		std::atomic<uint64_t> Sequence;
+		RingListT Rings;
+		// Serializes starting and stopping
+		std::mutex ControlMutex;
+		std::mutex Mutex;
+		std::condition_variable Condition;
+		bool Die;
+		std::thread Thread;
+		// Owned by the writer thread while recording
+		int File;
+		uint32_t NextName;
+		uint64_t Count;
+		std::unordered_map<std::string, uint32_t> Names;
+		std::vector<char> Buffer;
+};
+
+inline RecorderT &Recorder(void)
+{
+	static RecorderT Recorder;
+	return Recorder;
+}
+
+#endif
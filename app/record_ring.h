@@ -0,0 +1,118 @@
+#ifndef record_ring_h
+#define record_ring_h
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+// Single producer, single consumer ring of records, each starting with its
+// length as a uint16_t.  Head and Tail only grow; the producer owns Head and
+// the consumer Tail.  A record that doesn't fit is dropped and counted rather
+// than waited on.
+struct RecordRingT
+{
+	static constexpr size_t Size = 1 << 16;
+	static constexpr size_t MaxRecord = 1 << 12;
+
+	RecordRingT(uint64_t Thread) : Thread(Thread), Head(0), Tail(0), Dropped(0), Orphaned(false) {}
+
+	bool Push(char const *Record, size_t Count)
+	{
+		auto const At = Head.load(std::memory_order_relaxed);
+		if (Size - (At - Tail.load(std::memory_order_acquire)) < Count)
+		{
+			Dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		auto const Offset = At % Size;
+		auto const First = std::min(Count, Size - Offset);
+		memcpy(Bytes.data() + Offset, Record, First);
+		memcpy(Bytes.data(), Record + First, Count - First);
+		Head.store(At + Count, std::memory_order_release);
+		return true;
+	}
+
+	size_t Used(void) const
+	{
+		return Head.load(std::memory_order_relaxed) - Tail.load(std::memory_order_relaxed);
+	}
+
+	// Calls Read(Record, Length) for each waiting record
+	template <typename ReadT> void Drain(ReadT &&Read)
+	{
+		auto At = Tail.load(std::memory_order_relaxed);
+		auto const End = Head.load(std::memory_order_acquire);
+		std::array<char, MaxRecord> Record;
+		while (At < End)
+		{
+			uint16_t Length;
+			Copy(At, reinterpret_cast<char *>(&Length), sizeof(Length));
+			Copy(At, Record.data(), Length);
+			Read(static_cast<char const *>(Record.data()), static_cast<size_t>(Length));
+			At += Length;
+		}
+		Tail.store(At, std::memory_order_release);
+	}
+
+	uint64_t const Thread;
+	std::atomic<size_t> Head;
+	std::atomic<size_t> Tail;
+	std::atomic<uint64_t> Dropped;
+	// Set when the thread exits, so the ring can go once it's drained
+	std::atomic<bool> Orphaned;
+
+	private:
+		void Copy(size_t At, char *Out, size_t Count) const
+		{
+			auto const Offset = At % Size;
+			auto const First = std::min(Count, Size - Offset);
+			memcpy(Out, Bytes.data() + Offset, First);
+			memcpy(Out + First, Bytes.data(), Count - First);
+		}
+
+		std::array<char, Size> Bytes;
+};
+
+// The rings of every thread writing to one place, for one background thread
+// to drain.  The lock only covers the list, and the drainer reads and writes
+// out a copy of it, so a thread registering its ring never waits on the
+// drainer's I/O.
+struct RingListT
+{
+	RingListT(void) : NextThread(1) {}
+
+	RingListT(RingListT const &) = delete;
+
+	std::shared_ptr<RecordRingT> Add(void)
+	{
+		auto Ring = std::make_shared<RecordRingT>(NextThread++);
+		std::lock_guard<std::mutex> Guard(Mutex);
+		Rings.push_back(Ring);
+		return Ring;
+	}
+
+	// The rings to drain.  Rings whose threads have exited are handed out
+	// one last time and forgotten.
+	std::vector<std::shared_ptr<RecordRingT>> Take(void)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		auto Out = Rings;
+		Rings.erase(std::remove_if(Rings.begin(), Rings.end(), [](std::shared_ptr<RecordRingT> const &Ring)
+		{
+			return Ring->Orphaned.load(std::memory_order_acquire);
+		}), Rings.end());
+		return Out;
+	}
+
+	private:
+		std::atomic<uint64_t> NextThread;
+		std::mutex Mutex;
+		std::vector<std::shared_ptr<RecordRingT>> Rings;
+};
+
+#endif
@@ -0,0 +1,281 @@
+#ifndef stats_h
+#define stats_h
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "../ren-cxx-basics/error.h"
+
+// Counts and latency histograms per operation, split into the time spent
+// waiting for the filesystem lock and the time spent running.  Each thread
+// records into a shard of its own with plain relaxed stores, so recording
+// never contends; reading adds the shards up.
+
+// How long one request took so far, across any passes
+struct RequestTimeT
+{
+	std::chrono::nanoseconds Wait{0};
+	std::chrono::nanoseconds Run{0};
+};
+
+// Log-linear buckets: values below SubBuckets get a bucket each, and every
+// power of two above is split into SubBuckets, so a bucket is within about 6%
+// of the values in it.
+struct HistogramT
+{
+	static constexpr size_t SubBits = 4;
+	static constexpr size_t SubBuckets = 1 << SubBits;
+	static constexpr size_t Buckets = (64 - SubBits + 1) * SubBuckets;
+
+	static size_t BucketOf(uint64_t Value)
+	{
+		if (Value < SubBuckets) return Value;
+		size_t const Magnitude = 63 - __builtin_clzll(Value);
+		return (Magnitude - SubBits + 1) * SubBuckets + ((Value >> (Magnitude - SubBits)) & (SubBuckets - 1));
+	}
+
+	// The largest value in the bucket
+	static uint64_t BoundOf(size_t Bucket)
+	{
+		if (Bucket < SubBuckets) return Bucket;
+		size_t const Magnitude = Bucket / SubBuckets + SubBits - 1;
+		uint64_t const Low = (SubBuckets + Bucket % SubBuckets) << (Magnitude - SubBits);
+		return Low + (uint64_t(1) << (Magnitude - SubBits)) - 1;
+	}
+};
+
+struct StatsT
+{
+	typedef std::chrono::steady_clock ClockT;
+
+	static constexpr size_t MaxOperations = 128;
+
+	// Totals as read back, in nanoseconds
+	struct LatencyT
+	{
+		uint64_t Total = 0;
+		std::array<uint64_t, HistogramT::Buckets> Counts{};
+
+		// The bound of the bucket holding the given fraction of values
+		uint64_t Percentile(double Fraction) const
+		{
+			uint64_t Sum = 0;
+			for (auto Count : Counts) Sum += Count;
+			if (!Sum) return 0;
+			auto const Rank = std::max<uint64_t>(1, static_cast<uint64_t>(Fraction * Sum + 0.5));
+			uint64_t Seen = 0;
+			for (size_t Bucket = 0; Bucket < Counts.size(); ++Bucket)
+			{
+				Seen += Counts[Bucket];
+				if (Seen >= Rank) return HistogramT::BoundOf(Bucket);
+			}
+			return HistogramT::BoundOf(Counts.size() - 1);
+		}
+	};
+
+	struct OperationTotalsT
+	{
+		std::string Name;
+		uint64_t Count = 0;
+		uint64_t Errors = 0;
+		uint64_t Delayed = 0;
+		LatencyT Wait;
+		LatencyT Run;
+	};
+
+	StatsT(void) : Named(0) {}
+
+	StatsT(StatsT const &) = delete;
+
+	// Called once per operation name; the index is what Record takes
+	size_t Register(char const *Name)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		for (size_t Index = 0; Index < Named; ++Index)
+			if (Names[Index] == Name) return Index;
+		Assert(Named < MaxOperations);
+		Names[Named] = Name;
+		return Named++;
+	}
+
+	void Record(size_t Operation, RequestTimeT const &Time, bool Failed, bool Delayed)
+	{
+		auto &Slot = Shard().Slot(Operation);
+		Bump(Slot.Count, 1);
+		if (Failed) Bump(Slot.Errors, 1);
+		if (Delayed) Bump(Slot.Delayed, 1);
+		Slot.Wait.Add(Time.Wait.count());
+		Slot.Run.Add(Time.Run.count());
+	}
+
+	// Operations that ran since the last reset
+	std::vector<OperationTotalsT> Get(void)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		auto Out = Gather();
+		for (auto &Operation : Out)
+			for (auto const &Base : Baseline)
+				if (Base.Name == Operation.Name) Subtract(Operation, Base);
+		Out.erase(
+			std::remove_if(Out.begin(), Out.end(), [](OperationTotalsT const &Operation) { return !Operation.Count; }),
+			Out.end());
+		return Out;
+	}
+
+	// Shards belong to the threads writing them, so resetting keeps the
+	// current totals to subtract later instead
+	void Reset(void)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		Baseline = Gather();
+	}
+
+	private:
+		static void Bump(std::atomic<uint64_t> &Counter, uint64_t By)
+		{
+			// Only the owning thread writes, so this needn't be a locked add
+			Counter.store(Counter.load(std::memory_order_relaxed) + By, std::memory_order_relaxed);
+		}
+
+		struct RecordedLatencyT
+		{
+			std::atomic<uint64_t> Total{0};
+			std::array<std::atomic<uint64_t>, HistogramT::Buckets> Counts{};
+
+			void Add(uint64_t Value)
+			{
+				Bump(Total, Value);
+				Bump(Counts[HistogramT::BucketOf(Value)], 1);
+			}
+
+			void AddTo(LatencyT &Out) const
+			{
+				Out.Total += Total.load(std::memory_order_relaxed);
+				for (size_t Bucket = 0; Bucket < Counts.size(); ++Bucket)
+					Out.Counts[Bucket] += Counts[Bucket].load(std::memory_order_relaxed);
+			}
+		};
+
+		struct SlotT
+		{
+			std::atomic<uint64_t> Count{0};
+			std::atomic<uint64_t> Errors{0};
+			std::atomic<uint64_t> Delayed{0};
+			RecordedLatencyT Wait;
+			RecordedLatencyT Run;
+		};
+
+		// Slots are made the first time the thread runs each operation
+		struct ShardT
+		{
+			std::array<std::atomic<SlotT *>, MaxOperations> Slots{};
+
+			~ShardT(void)
+			{
+				for (auto &Slot : Slots) delete Slot.load(std::memory_order_relaxed);
+			}
+
+			SlotT &Slot(size_t Operation)
+			{
+				auto Found = Slots[Operation].load(std::memory_order_relaxed);
+				if (!Found)
+				{
+					Found = new SlotT();
+					Slots[Operation].store(Found, std::memory_order_release);
+				}
+				return *Found;
+			}
+		};
+
+		// Registered on first use by each thread; a thread's totals are kept
+		// when it exits
+		struct HolderT
+		{
+			StatsT *Stats = nullptr;
+			std::shared_ptr<ShardT> Shard;
+			~HolderT(void) { if (Shard) Stats->Retire(Shard); }
+		};
+
+		ShardT &Shard(void)
+		{
+			static thread_local HolderT Holder;
+			if (!Holder.Shard)
+			{
+				std::lock_guard<std::mutex> Guard(Mutex);
+				Holder.Stats = this;
+				Holder.Shard = std::make_shared<ShardT>();
+				Shards.push_back(Holder.Shard);
+			}
+			return *Holder.Shard;
+		}
+
+		void Retire(std::shared_ptr<ShardT> const &Shard)
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			if (Retired.size() < Named) Retired.resize(Named);
+			AddShard(*Shard, Retired);
+			Shards.erase(std::remove(Shards.begin(), Shards.end(), Shard), Shards.end());
+		}
+
+		// With the mutex held
+		void AddShard(ShardT const &Shard, std::vector<OperationTotalsT> &Out) const
+		{
+			for (size_t Index = 0; Index < Out.size(); ++Index)
+			{
+				auto const Slot = Shard.Slots[Index].load(std::memory_order_acquire);
+				if (!Slot) continue;
+				Out[Index].Count += Slot->Count.load(std::memory_order_relaxed);
+				Out[Index].Errors += Slot->Errors.load(std::memory_order_relaxed);
+				Out[Index].Delayed += Slot->Delayed.load(std::memory_order_relaxed);
+				Slot->Wait.AddTo(Out[Index].Wait);
+				Slot->Run.AddTo(Out[Index].Run);
+			}
+		}
+
+		// With the mutex held
+		std::vector<OperationTotalsT> Gather(void) const
+		{
+			std::vector<OperationTotalsT> Out(Retired);
+			Out.resize(Named);
+			for (size_t Index = 0; Index < Named; ++Index) Out[Index].Name = Names[Index];
+			for (auto const &Shard : Shards) AddShard(*Shard, Out);
+			return Out;
+		}
+
+		static void Subtract(OperationTotalsT &Operation, OperationTotalsT const &Base)
+		{
+			Operation.Count -= Base.Count;
+			Operation.Errors -= Base.Errors;
+			Operation.Delayed -= Base.Delayed;
+			auto const SubtractLatency = [](LatencyT &Latency, LatencyT const &Base)
+			{
+				Latency.Total -= Base.Total;
+				for (size_t Bucket = 0; Bucket < Latency.Counts.size(); ++Bucket)
+					Latency.Counts[Bucket] -= Base.Counts[Bucket];
+			};
+			SubtractLatency(Operation.Wait, Base.Wait);
+			SubtractLatency(Operation.Run, Base.Run);
+		}
+
+		std::mutex Mutex;
+		std::array<std::string, MaxOperations> Names;
+		size_t Named;
+		std::vector<std::shared_ptr<ShardT>> Shards;
+		std::vector<OperationTotalsT> Retired;
+		std::vector<OperationTotalsT> Baseline;
+};
+
+inline StatsT &Stats(void)
+{
+	static StatsT Stats;
+	return Stats;
+}
+
+#endif
@@ -10,3 +10,25 @@ Define.Executable
 	LinkFlags = '-lfuse -pthread -lluxem-cxx',
 }
 
+
+Define.Executable
+{
+	Name = 'benchmark_scaling',
+	Sources = Item() + 'benchmark_scaling.cxx',
+	BuildFlags = '-D_FILE_OFFSET_BITS=64',
+	LinkFlags = '-pthread',
+}
+
+Define.Executable
+{
+	Name = 'benchmark_throughput',
+	Sources = Item() + 'benchmark_throughput.cxx',
+	BuildFlags = '-D_FILE_OFFSET_BITS=64',
+}
+
+Define.Executable
+{
+	Name = 'replay',
+	Sources = Item() + 'replay.cxx',
+	BuildFlags = '-D_FILE_OFFSET_BITS=64',
+}
@@ -0,0 +1,85 @@
+#include "../../ren-cxx-basics/error.h"
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Measures metadata and small file throughput in the current directory at
+// increasing thread counts.  Run it from inside a clunker mount, started with
+// CLUNKER_MULTITHREADED=1 to see scaling.
+int main(int argc, char **argv)
+{
+	try
+	{
+		size_t MaxThreads = 32;
+		if (argc >= 2)
+		{
+			if (!(StringT(argv[1]) >> MaxThreads) || (MaxThreads == 0))
+				throw UserErrorT() << "Invalid maximum thread count: " << argv[1];
+		}
+		double Seconds = 2;
+		if (argc >= 3)
+		{
+			if (!(StringT(argv[2]) >> Seconds) || (Seconds <= 0))
+				throw UserErrorT() << "Invalid seconds per step: " << argv[2];
+		}
+
+		std::vector<char> const Block(4096, 'x');
+		std::cout << "threads\tops/sec" << std::endl;
+		for (size_t Threads = 1; Threads <= MaxThreads; Threads *= 2)
+		{
+			std::atomic<bool> Stop(false);
+			std::atomic<uint64_t> Total(0);
+			std::vector<std::thread> Workers;
+			for (size_t Index = 0; Index < Threads; ++Index)
+			{
+				Workers.emplace_back([&, Index](void)
+				{
+					// Each thread works in its own directory, so only the
+					// filesystem's own locking is contended
+					auto const Directory = std::string(StringT() << "bench_" << Index);
+					if ((::mkdir(Directory.c_str(), 0777) != 0) && (errno != EEXIST))
+						throw SystemErrorT() << "Failed to create [" << Directory << "]: " << strerror(errno);
+					auto const Path = Directory + "/file";
+					uint64_t Operations = 0;
+					while (!Stop)
+					{
+						auto File = ::open(Path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+						if (File < 0) throw SystemErrorT() << "Failed to open [" << Path << "]: " << strerror(errno);
+						if (::write(File, &Block[0], Block.size()) != static_cast<ssize_t>(Block.size()))
+							throw SystemErrorT() << "Failed to write [" << Path << "]: " << strerror(errno);
+						::close(File);
+						struct stat Stat;
+						::stat(Path.c_str(), &Stat);
+						::unlink(Path.c_str());
+						Operations += 5;
+					}
+					::rmdir(Directory.c_str());
+					Total += Operations;
+				});
+			}
+			auto const Start = std::chrono::steady_clock::now();
+			std::this_thread::sleep_for(std::chrono::duration<double>(Seconds));
+			Stop = true;
+			for (auto &Worker : Workers) Worker.join();
+			std::chrono::duration<double> const Elapsed = std::chrono::steady_clock::now() - Start;
+			std::cout << Threads << "\t" << static_cast<uint64_t>(Total / Elapsed.count()) << std::endl;
+		}
+		return 0;
+	}
+	catch (UserErrorT const &Error)
+	{
+		std::cerr << "Error: " << Error << std::endl;
+		return 1;
+	}
+	catch (SystemErrorT const &Error)
+	{
+		std::cerr << "System error: " << Error << std::endl;
+		return 1;
+	}
+}
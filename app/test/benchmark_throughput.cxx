@@ -0,0 +1,76 @@
+#include "../../ren-cxx-basics/error.h"
+
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Measures sequential write and read throughput of one large file in the
+// current directory.  Run it from inside a clunker mount; compare against a
+// mount started with CLUNKER_HIGH_LEVEL=1, which copies read data instead of
+// replying with the storage in place.
+int main(int argc, char **argv)
+{
+	try
+	{
+		size_t Mebibytes = 1024;
+		if (argc >= 2)
+		{
+			if (!(StringT(argv[1]) >> Mebibytes) || (Mebibytes == 0))
+				throw UserErrorT() << "Invalid file size: " << argv[1];
+		}
+		size_t BlockKibibytes = 128;
+		if (argc >= 3)
+		{
+			if (!(StringT(argv[2]) >> BlockKibibytes) || (BlockKibibytes == 0))
+				throw UserErrorT() << "Invalid block size: " << argv[2];
+		}
+
+		std::string const Path = "bench_throughput";
+		std::vector<char> Block(BlockKibibytes * 1024, 'x');
+		size_t const Blocks = Mebibytes * 1024 / BlockKibibytes;
+		auto Report = [&](char const *Name, std::chrono::steady_clock::time_point Start)
+		{
+			std::chrono::duration<double> const Elapsed = std::chrono::steady_clock::now() - Start;
+			std::cout << Name << "\t" << static_cast<uint64_t>(Blocks * BlockKibibytes / 1024 / Elapsed.count()) << " MiB/s" << std::endl;
+		};
+
+		{
+			auto File = ::open(Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (File < 0) throw SystemErrorT() << "Failed to open [" << Path << "]: " << strerror(errno);
+			auto const Start = std::chrono::steady_clock::now();
+			for (size_t Index = 0; Index < Blocks; ++Index)
+				if (::write(File, &Block[0], Block.size()) != static_cast<ssize_t>(Block.size()))
+					throw SystemErrorT() << "Failed to write [" << Path << "]: " << strerror(errno);
+			::close(File);
+			Report("write", Start);
+		}
+
+		{
+			// Reopening drops the kernel's page cache for the file, so the
+			// reads reach the filesystem
+			auto File = ::open(Path.c_str(), O_RDONLY);
+			if (File < 0) throw SystemErrorT() << "Failed to open [" << Path << "]: " << strerror(errno);
+			auto const Start = std::chrono::steady_clock::now();
+			for (size_t Index = 0; Index < Blocks; ++Index)
+				if (::read(File, &Block[0], Block.size()) != static_cast<ssize_t>(Block.size()))
+					throw SystemErrorT() << "Failed to read [" << Path << "]: " << strerror(errno);
+			::close(File);
+			Report("read", Start);
+		}
+
+		::unlink(Path.c_str());
+		return 0;
+	}
+	catch (UserErrorT const &Error)
+	{
+		std::cerr << "Error: " << Error << std::endl;
+		return 1;
+	}
+	catch (SystemErrorT const &Error)
+	{
+		std::cerr << "System error: " << Error << std::endl;
+		return 1;
+	}
+}
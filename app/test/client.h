@@ -1,40 +1,364 @@
 #include <luxem-cxx/luxem.h>
 
+#include <map>
+#include <memory>
+#include <unordered_map>
+
 #include "../asio_utils.h"
 
+// Commands are tagged with request ids and replies are matched by id, so
+// commands can be sent without waiting for earlier replies.  Commands made
+// between BeginBatch and EndBatch are sent as one batch message instead, which
+// clunker runs with filesystem operations held off and answers at once.
+// Callbacks are called in the order commands were made.
 struct ClunkerControlT
 {
+	ClunkerControlT(void) : NextID(1), BatchID(0) {}
+
+	void BeginBatch(void)
+	{
+		Assert(!Out);
+		BatchID = NextID++;
+		Out.reset(new luxem::writer());
+		Out->type("batch@" + std::to_string(BatchID)).array_begin();
+	}
+
+	void EndBatch(void)
+	{
+		Assert(Out);
+		Out->array_end();
+		Write(Connection, Out->dump());
+		Out.reset();
+		Pending.emplace(BatchID, PendingT{"batch_result", [Replies = std::move(Batched)](luxem::value &Data) mutable
+		{
+			auto &Elements = Data.as<luxem::array>().get_data();
+			AssertE(Elements.size(), Replies.size());
+			for (size_t Index = 0; Index < Elements.size(); ++Index)
+				Answer(Replies[Index], *Elements[Index], Elements[Index]->get_type());
+		}});
+		Batched.clear();
+		BatchID = 0;
+	}
+
 	typedef function<void(bool Success)> CleanCallbackT;
 	void Clean(CleanCallbackT &&Callback)
 	{
-		Write(Connection, 
-			luxem::writer()
-				.type("clean")
-				.value("")
-				.dump());
-		CleanCallbacks.emplace_back(std::move(Callback));
+		Start("clean", "clean_result", Flag(std::move(Callback))).value("");
+		Finish();
 	}
-		
+
 	typedef function<void(int64_t)> GetOpCountCallbackT;
 	void GetOpCount(GetOpCountCallbackT &&Callback)
 	{
-		Write(Connection, 
-			luxem::writer()
-				.type("get_count")
-				.value("")
-				.dump());
-		GetOpCountCallbacks.push_back(std::move(Callback));
+		Start("get_count", "count", [Callback = std::move(Callback)](luxem::value &Data)
+		{
+			Callback(Data.as<luxem::primitive>().get_int());
+		}).value("");
+		Finish();
 	}
 
 	typedef function<void(bool Success)> SetOpCountCallbackT;
 	void SetOpCount(int64_t Count, SetOpCountCallbackT &&Callback)
 	{
-		Write(Connection, 
-			luxem::writer()
-				.type("set_count")
-				.value(Count)
-				.dump());
-		SetOpCountCallbacks.push_back(std::move(Callback));
+		Start("set_count", "set_result", Flag(std::move(Callback))).value(Count);
+		Finish();
+	}
+
+	typedef function<void(bool Success)> SnapshotCallbackT;
+	void Snapshot(std::string const &Name, SnapshotCallbackT &&Callback)
+	{
+		Start("snapshot", "snapshot_result", Flag(std::move(Callback))).value(Name);
+		Finish();
+	}
+
+	void Restore(std::string const &Name, SnapshotCallbackT &&Callback)
+	{
+		Start("restore", "restore_result", Flag(std::move(Callback))).value(Name);
+		Finish();
+	}
+
+	void DropSnapshot(std::string const &Name, SnapshotCallbackT &&Callback)
+	{
+		Start("drop_snapshot", "drop_snapshot_result", Flag(std::move(Callback))).value(Name);
+		Finish();
+	}
+
+	// Negative limits are left unset, error is an errno name like ENOSPC.  An
+	// empty operation with a path covers every operation under the path.
+	typedef function<void(bool Success)> FaultCallbackT;
+	void SetFault(
+		std::string const &Path, 
+		std::string const &Operation, 
+		int64_t Operations, 
+		int64_t Bytes, 
+		std::string const &Error, 
+		int64_t Times, 
+		FaultCallbackT &&Callback)
+	{
+		auto &Writer = Start("set_fault", "set_fault_result", Flag(std::move(Callback)));
+		Writer.object_begin()
+			.key("error").value(Error);
+		if (!Path.empty()) Writer.key("path").value(Path);
+		if (!Operation.empty()) Writer.key("operation").value(Operation);
+		if (Operations >= 0) Writer.key("operations").value(Operations);
+		if (Bytes >= 0) Writer.key("bytes").value(Bytes);
+		if (Times >= 0) Writer.key("times").value(Times);
+		Writer.object_end();
+		Finish();
+	}
+
+	// Mode is short, torn or sectors; reads and writes past the limit go
+	// through in part
+	void SetPartialFault(
+		std::string const &Operation, 
+		int64_t Operations, 
+		std::string const &Mode, 
+		int64_t Seed, 
+		int64_t Times, 
+		FaultCallbackT &&Callback)
+	{
+		auto &Writer = Start("set_fault", "set_fault_result", Flag(std::move(Callback)));
+		Writer.object_begin()
+			.key("operation").value(Operation)
+			.key("mode").value(Mode)
+			.key("seed").value(Seed);
+		if (Operations >= 0) Writer.key("operations").value(Operations);
+		if (Times >= 0) Writer.key("times").value(Times);
+		Writer.object_end();
+		Finish();
+	}
+
+	// Rates are probabilities by operation name.  The callback gets the seed
+	// in use.
+	typedef function<void(int64_t Seed)> FaultRateCallbackT;
+	void SetFaultRate(
+		int64_t Seed, 
+		std::map<std::string, double> const &Rates, 
+		std::string const &Error, 
+		FaultRateCallbackT &&Callback)
+	{
+		auto &Writer = Start("set_fault_rate", "set_fault_rate_result", [Callback = std::move(Callback)](luxem::value &Data)
+		{
+			Callback(Data.as<luxem::primitive>().get_int());
+		});
+		Writer.object_begin()
+			.key("seed").value(Seed)
+			.key("error").value(Error)
+			.key("rates").object_begin();
+		for (auto const &Rate : Rates) Writer.key(Rate.first).value(Rate.second);
+		Writer.object_end().object_end();
+		Finish();
+	}
+
+	// Random failures as the operation and its index among its kind
+	typedef function<void(std::vector<std::pair<std::string, int64_t>> const &Failures)> FaultLogCallbackT;
+	void GetFaultLog(FaultLogCallbackT &&Callback)
+	{
+		Start("get_fault_log", "fault_log", [Callback = std::move(Callback)](luxem::value &Data)
+		{
+			std::vector<std::pair<std::string, int64_t>> Failures;
+			auto &Log = Data.as<luxem::object>();
+			for (auto const &Element : Log.get("failures")->as<luxem::array>().get_data())
+			{
+				auto &Pair = Element->as<luxem::array>();
+				Failures.emplace_back(
+					Pair.get(0)->as<luxem::primitive>().get_primitive(),
+					Pair.get(1)->as<luxem::primitive>().get_int());
+			}
+			Callback(Failures);
+		}).value("");
+		Finish();
+	}
+
+	// A partial read or write: the request, and the ranges that went through
+	struct SplitT
+	{
+		std::string Operation;
+		int64_t Offset;
+		int64_t Length;
+		std::vector<std::pair<int64_t, int64_t>> Kept;
+	};
+	typedef function<void(std::vector<SplitT> const &Splits)> SplitLogCallbackT;
+	void GetSplitLog(SplitLogCallbackT &&Callback)
+	{
+		Start("get_split_log", "split_log", [Callback = std::move(Callback)](luxem::value &Data)
+		{
+			std::vector<SplitT> Splits;
+			auto &Log = Data.as<luxem::object>();
+			for (auto const &Element : Log.get("splits")->as<luxem::array>().get_data())
+			{
+				auto &Object = Element->as<luxem::object>();
+				SplitT Split;
+				Split.Operation = Object.get("operation")->as<luxem::primitive>().get_primitive();
+				Split.Offset = Object.get("offset")->as<luxem::primitive>().get_int();
+				Split.Length = Object.get("length")->as<luxem::primitive>().get_int();
+				for (auto const &Range : Object.get("kept")->as<luxem::array>().get_data())
+				{
+					auto &Pair = Range->as<luxem::array>();
+					Split.Kept.emplace_back(
+						Pair.get(0)->as<luxem::primitive>().get_int(),
+						Pair.get(1)->as<luxem::primitive>().get_int());
+				}
+				Splits.push_back(std::move(Split));
+			}
+			Callback(Splits);
+		}).value("");
+		Finish();
+	}
+
+	void ClearFaults(FaultCallbackT &&Callback)
+	{
+		Start("clear_faults", "clear_faults_result", Flag(std::move(Callback))).value("");
+		Finish();
+	}
+
+	// Seconds; a p99 no larger than the median gives a fixed delay
+	typedef function<void(bool Success)> LatencyCallbackT;
+	void SetLatency(
+		std::string const &Path, 
+		std::string const &Operation, 
+		double Median, 
+		double P99, 
+		LatencyCallbackT &&Callback)
+	{
+		auto &Writer = Start("set_latency", "set_latency_result", Flag(std::move(Callback)));
+		Writer.object_begin()
+			.key("median").value(Median)
+			.key("p99").value(P99);
+		if (!Path.empty()) Writer.key("path").value(Path);
+		if (!Operation.empty()) Writer.key("operation").value(Operation);
+		Writer.object_end();
+		Finish();
+	}
+
+	void ClearLatency(LatencyCallbackT &&Callback)
+	{
+		Start("clear_latency", "clear_latency_result", Flag(std::move(Callback))).value("");
+		Finish();
+	}
+
+	typedef function<void(bool Success)> ProcessFilterCallbackT;
+	void SetProcessFilter(
+		std::vector<pid_t> const &Pids, 
+		std::vector<pid_t> const &Roots, 
+		ProcessFilterCallbackT &&Callback)
+	{
+		auto &Writer = Start("set_process_filter", "set_process_filter_result", Flag(std::move(Callback)));
+		Writer.object_begin();
+		Writer.key("pids").array_begin();
+		for (auto Pid : Pids) Writer.value(static_cast<int64_t>(Pid));
+		Writer.array_end();
+		Writer.key("roots").array_begin();
+		for (auto Root : Roots) Writer.value(static_cast<int64_t>(Root));
+		Writer.array_end();
+		Writer.object_end();
+		Finish();
+	}
+
+	void ClearProcessFilter(ProcessFilterCallbackT &&Callback)
+	{
+		Start("clear_process_filter", "clear_process_filter_result", Flag(std::move(Callback))).value("");
+		Finish();
+	}
+
+	typedef function<void(bool Success)> DurabilityCallbackT;
+	void TrackDurability(bool On, DurabilityCallbackT &&Callback)
+	{
+		Start("track_durability", "track_durability_result", Flag(std::move(Callback))).value(On);
+		Finish();
+	}
+
+	void Crash(uint64_t Seed, double Survive, bool Tear, DurabilityCallbackT &&Callback)
+	{
+		// The seed, or false if durability isn't tracked
+		Start("crash", "crash_result", [Callback = std::move(Callback)](luxem::value &Data)
+		{
+			Callback(Data.as<luxem::primitive>().get_primitive() != "false");
+		})
+			.object_begin()
+				.key("seed").value(static_cast<int64_t>(Seed))
+				.key("survive").value(Survive)
+				.key("tear").value(Tear)
+			.object_end();
+		Finish();
+	}
+
+	// Nanoseconds
+	struct LatencyT
+	{
+		int64_t Total;
+		int64_t P50;
+		int64_t P90;
+		int64_t P99;
+		int64_t P999;
+		int64_t Max;
+	};
+	struct OperationStatsT
+	{
+		int64_t Count;
+		int64_t Errors;
+		int64_t Delayed;
+		LatencyT Wait;
+		LatencyT Run;
+	};
+	typedef function<void(std::map<std::string, OperationStatsT> const &Stats)> StatsCallbackT;
+	void GetStats(StatsCallbackT &&Callback)
+	{
+		Start("stats", "stats_result", [Callback = std::move(Callback)](luxem::value &Data)
+		{
+			auto const ReadLatency = [](luxem::object &Object)
+			{
+				LatencyT Latency;
+				Latency.Total = Object.get("total")->as<luxem::primitive>().get_int();
+				Latency.P50 = Object.get("p50")->as<luxem::primitive>().get_int();
+				Latency.P90 = Object.get("p90")->as<luxem::primitive>().get_int();
+				Latency.P99 = Object.get("p99")->as<luxem::primitive>().get_int();
+				Latency.P999 = Object.get("p999")->as<luxem::primitive>().get_int();
+				Latency.Max = Object.get("max")->as<luxem::primitive>().get_int();
+				return Latency;
+			};
+			std::map<std::string, OperationStatsT> Stats;
+			for (auto const &Entry : Data.as<luxem::object>().get_data())
+			{
+				auto &Object = Entry.second->as<luxem::object>();
+				auto &Operation = Stats[Entry.first];
+				Operation.Count = Object.get("count")->as<luxem::primitive>().get_int();
+				Operation.Errors = Object.get("errors")->as<luxem::primitive>().get_int();
+				Operation.Delayed = Object.get("delayed")->as<luxem::primitive>().get_int();
+				Operation.Wait = ReadLatency(Object.get("wait")->as<luxem::object>());
+				Operation.Run = ReadLatency(Object.get("run")->as<luxem::object>());
+			}
+			Callback(Stats);
+		}).value("");
+		Finish();
+	}
+
+	typedef function<void(bool Success)> ResetStatsCallbackT;
+	void ResetStats(ResetStatsCallbackT &&Callback)
+	{
+		Start("reset_stats", "reset_stats_result", Flag(std::move(Callback))).value("");
+		Finish();
+	}
+
+	typedef function<void(bool Success)> RecordStartCallbackT;
+	void RecordStart(std::string const &Path, bool Hashes, RecordStartCallbackT &&Callback)
+	{
+		Start("record_start", "record_start_result", Flag(std::move(Callback)))
+			.object_begin()
+				.key("file").value(Path)
+				.key("hashes").value(Hashes)
+			.object_end();
+		Finish();
+	}
+
+	typedef function<void(int64_t Count)> RecordStopCallbackT;
+	void RecordStop(RecordStopCallbackT &&Callback)
+	{
+		Start("record_stop", "record_stop_result", [Callback = std::move(Callback)](luxem::value &Data)
+		{
+			Callback(Data.as<luxem::primitive>().get_int());
+		}).value("");
+		Finish();
 	}
 
 	friend void ConnectClunker(
@@ -42,11 +366,78 @@ struct ClunkerControlT
 		asio::ip::tcp::endpoint &Endpoint, 
 		function<void(std::shared_ptr<ClunkerControlT> Control)> &&Callback);
 	private:
+		typedef function<void(luxem::value &Data)> HandlerT;
+
+		// What a command's reply should be and what to do with it
+		struct PendingT
+		{
+			std::string Type;
+			HandlerT Handler;
+		};
+
+		static HandlerT Flag(function<void(bool Success)> &&Callback)
+		{
+			return [Callback = std::move(Callback)](luxem::value &Data)
+			{
+				Callback(Data.as<luxem::primitive>().get_bool());
+			};
+		}
+
+		// Starts a command, returning the writer for its value
+		luxem::writer &Start(std::string const &Type, std::string const &ReplyType, HandlerT &&Handler)
+		{
+			if (Out)
+			{
+				Batched.push_back(PendingT{ReplyType, std::move(Handler)});
+				return Out->type(Type);
+			}
+			auto const ID = NextID++;
+			Pending.emplace(ID, PendingT{ReplyType, std::move(Handler)});
+			Out.reset(new luxem::writer());
+			return Out->type(Type + "@" + std::to_string(ID));
+		}
+
+		// Sends the command, unless it's part of a batch
+		void Finish(void)
+		{
+			if (BatchID) return;
+			Write(Connection, Out->dump());
+			Out.reset();
+		}
+
+		static void Answer(PendingT &Reply, luxem::value &Data, std::string const &Type)
+		{
+			if (Type == "error")
+				throw SystemErrorT() << "Clunker error: " << Data.as<luxem::primitive>().get_primitive();
+			if (Type != Reply.Type)
+				throw SystemErrorT() << "Expected [" << Reply.Type << "] reply, got [" << Type << "]";
+			Reply.Handler(Data);
+		}
+
+		void Receive(luxem::value &Data)
+		{
+			auto const &Tagged = Data.get_type();
+			auto const At = Tagged.rfind('@');
+			if (At == std::string::npos)
+				throw SystemErrorT() << "Unexpected message type [" << Tagged << "]";
+			auto Found = Pending.find(std::stoull(Tagged.substr(At + 1)));
+			if (Found == Pending.end())
+				throw SystemErrorT() << "Reply to unknown request [" << Tagged << "]";
+			auto Reply = std::move(Found->second);
+			Pending.erase(Found);
+			Answer(Reply, Data, Tagged.substr(0, At));
+		}
+
 		std::shared_ptr<asio::ip::tcp::socket> Connection;
-				
-		std::list<CleanCallbackT> CleanCallbacks;
-		std::list<GetOpCountCallbackT> GetOpCountCallbacks;
-		std::list<SetOpCountCallbackT> SetOpCountCallbacks;
+
+		uint64_t NextID;
+		std::unordered_map<uint64_t, PendingT> Pending;
+
+		// The message being written; stays open between BeginBatch and
+		// EndBatch
+		std::unique_ptr<luxem::writer> Out;
+		uint64_t BatchID;
+		std::vector<PendingT> Batched;
 };
 
 void ConnectClunker(
@@ -55,8 +446,8 @@ void ConnectClunker(
 	function<void(std::shared_ptr<ClunkerControlT> Control)> &&Callback)
 {
 	TCPConnect(
-		Service, 
-		Endpoint, 
+		Service,
+		Endpoint,
 		[Callback = std::move(Callback)](std::shared_ptr<asio::ip::tcp::socket> Connection)
 		{
 			auto Control = std::make_shared<ClunkerControlT>();
@@ -70,33 +461,7 @@ void ConnectClunker(
 					std::cerr << "Message has no type: [" << luxem::writer().value(Data).dump() << "]";
 					return;
 				}
-
-				auto Type = Data->get_type();
-				if (Type == "clean_result")
-				{
-					AssertGT(Control->CleanCallbacks.size(), 0u);
-					auto Callback = std::move(Control->CleanCallbacks.front());
-					Control->CleanCallbacks.pop_front();
-					Callback(Data->as<luxem::primitive>().get_bool());
-				}
-				else if (Type == "set_result")
-				{
-					AssertGT(Control->SetOpCountCallbacks.size(), 0u);
-					auto Callback = std::move(Control->SetOpCountCallbacks.front());
-					Control->SetOpCountCallbacks.pop_front();
-					Callback(Data->as<luxem::primitive>().get_bool());
-				}
-				else if (Type == "count")
-				{
-					AssertGT(Control->GetOpCountCallbacks.size(), 0u);
-					auto Callback = std::move(Control->GetOpCountCallbacks.front());
-					Control->GetOpCountCallbacks.pop_front();
-					Callback(Data->as<luxem::primitive>().get_int());
-				}
-				else
-				{
-					throw SystemErrorT() << "Unknown message type [" << Type << "]";
-				}
+				Control->Receive(*Data);
 			});
 
 			LoopRead(std::move(Connection), [Reader](ReadBufferT &Buffer)
@@ -109,4 +474,3 @@ void ConnectClunker(
 			Callback(std::move(Control));
 		});
 }
-
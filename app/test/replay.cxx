@@ -0,0 +1,274 @@
+#include "../../ren-cxx-basics/error.h"
+#include "../operations.h"
+#include "../record.h"
+
+#include <map>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Replays a recording made with record_start against a directory, as fast as
+// it can, and reports the time spent per kind of operation.  The directory
+// should start out as the mount did when recording started.
+//
+// Operations are replayed one at a time in the order they finished, which
+// isn't the order they were written in.  Handles opened before recording
+// started are opened again on first use.  Written data is a fixed pattern; the
+// recorded hashes are only for comparing recordings.  A directory is listed in
+// full at its first readdir.
+struct ReplayT
+{
+	ReplayT(std::string const &Root, bool Verbose) : Root(Root), Verbose(Verbose), Replayed(0), Differed(0) {}
+
+	~ReplayT(void)
+	{
+		for (auto const &Handle : Handles) close(Handle.second);
+	}
+
+	void AddName(uint32_t ID, std::string &&Name) { Names[ID] = std::move(Name); }
+
+	void Run(RecordFormatT::OperationEntryT const &Operation)
+	{
+		auto const Start = std::chrono::steady_clock::now();
+		auto const Succeeded = Apply(Operation);
+		auto &Total = Totals[Operation.Kind];
+		Total.Count += 1;
+		Total.Time += std::chrono::steady_clock::now() - Start;
+		Replayed += 1;
+		if (Succeeded == (Operation.Result >= 0)) return;
+		Differed += 1;
+		if (Verbose)
+			std::cerr << KindName(Operation.Kind) << " [" << Name(Operation.Path) << "] " <<
+				(Succeeded ? "succeeded" : strerror(errno)) << ", recorded " << Operation.Result << std::endl;
+	}
+
+	void Report(std::chrono::steady_clock::duration Elapsed)
+	{
+		std::chrono::duration<double> const Seconds = Elapsed;
+		std::cout << "Replayed " << Replayed << " operations in " << Seconds.count() << "s (" <<
+			static_cast<uint64_t>(Replayed / Seconds.count()) << " per second); " <<
+			Differed << " succeeded or failed unlike the recording" << std::endl;
+		for (auto const &Total : Totals)
+		{
+			std::chrono::duration<double, std::micro> const Micro = Total.second.Time;
+			std::cout << KindName(Total.first) << "\t" << Total.second.Count << "\t" <<
+				Micro.count() / Total.second.Count << " us" << std::endl;
+		}
+	}
+
+	private:
+		struct TotalT
+		{
+			uint64_t Count = 0;
+			std::chrono::steady_clock::duration Time{0};
+		};
+
+		static std::string KindName(uint8_t Kind)
+		{
+			if (Kind == RecordFormatT::Release) return "release";
+			return OperationName(static_cast<OperationT>(Kind));
+		}
+
+		std::string const &Name(uint32_t ID)
+		{
+			static std::string const None;
+			auto Found = Names.find(ID);
+			if (Found == Names.end()) return None;
+			return Found->second;
+		}
+
+		std::string PathOf(uint32_t ID) { return Root + Name(ID); }
+
+		// Opens the recorded handle's path if it was opened before recording
+		int HandleFor(RecordFormatT::OperationEntryT const &Operation)
+		{
+			auto Found = Handles.find(Operation.Handle);
+			if (Found != Handles.end()) return Found->second;
+			auto File = open(PathOf(Operation.Path).c_str(), O_RDWR);
+			if (File < 0) File = open(PathOf(Operation.Path).c_str(), O_RDONLY);
+			if (File >= 0) Handles[Operation.Handle] = File;
+			return File;
+		}
+
+		void SetHandle(uint64_t Handle, int File)
+		{
+			auto Found = Handles.find(Handle);
+			if (Found != Handles.end()) close(Found->second);
+			if (File >= 0) Handles[Handle] = File;
+			else if (Found != Handles.end()) Handles.erase(Found);
+		}
+
+		char *Data(size_t Size)
+		{
+			if (Buffer.size() < Size)
+			{
+				Buffer.resize(Size);
+				for (size_t Index = 0; Index < Size; ++Index) Buffer[Index] = 'a' + Index % 26;
+			}
+			return Buffer.data();
+		}
+
+		// True if the operation succeeded, otherwise errno is set
+		bool Apply(RecordFormatT::OperationEntryT const &Operation)
+		{
+			auto const Path = PathOf(Operation.Path);
+			if (Operation.Kind == RecordFormatT::Release)
+			{
+				auto Found = Handles.find(Operation.Handle);
+				if (Found == Handles.end()) return true;
+				auto const Result = close(Found->second);
+				Handles.erase(Found);
+				return Result == 0;
+			}
+			switch (static_cast<OperationT>(Operation.Kind))
+			{
+				case OperationT::lookup:
+				case OperationT::getattr:
+				{
+					struct stat Out;
+					return lstat(Path.c_str(), &Out) == 0;
+				}
+				case OperationT::readlink: return readlink(Path.c_str(), Data(PATH_MAX), PATH_MAX) >= 0;
+				case OperationT::mkdir: return mkdir(Path.c_str(), Operation.Mode & 07777) == 0;
+				case OperationT::unlink: return unlink(Path.c_str()) == 0;
+				case OperationT::rmdir: return rmdir(Path.c_str()) == 0;
+				case OperationT::symlink: return symlink(Name(Operation.Target).c_str(), Path.c_str()) == 0;
+				case OperationT::rename: return rename(Path.c_str(), PathOf(Operation.Target).c_str()) == 0;
+				case OperationT::link: return link(Path.c_str(), PathOf(Operation.Target).c_str()) == 0;
+				case OperationT::chmod: return chmod(Path.c_str(), Operation.Mode & 07777) == 0;
+				case OperationT::chown:
+					return lchown(Path.c_str(), static_cast<uid_t>(Operation.Offset), static_cast<gid_t>(Operation.Size)) == 0;
+				case OperationT::truncate: return truncate(Path.c_str(), Operation.Size) == 0;
+				case OperationT::utimens: return utimensat(AT_FDCWD, Path.c_str(), nullptr, AT_SYMLINK_NOFOLLOW) == 0;
+				case OperationT::open:
+				{
+					auto const File = open(Path.c_str(), Operation.Flags & ~(O_CREAT | O_EXCL));
+					SetHandle(Operation.Handle, File);
+					return File >= 0;
+				}
+				case OperationT::create:
+				{
+					auto const File = open(Path.c_str(), Operation.Flags | O_CREAT, Operation.Mode & 07777);
+					SetHandle(Operation.Handle, File);
+					return File >= 0;
+				}
+				case OperationT::read: return pread(HandleFor(Operation), Data(Operation.Size), Operation.Size, Operation.Offset) >= 0;
+				case OperationT::write: return pwrite(HandleFor(Operation), Data(Operation.Size), Operation.Size, Operation.Offset) >= 0;
+				case OperationT::fsync: return fsync(HandleFor(Operation)) == 0;
+				case OperationT::fsyncdir:
+				case OperationT::opendir:
+				{
+					auto const Directory = open(Path.c_str(), O_RDONLY | O_DIRECTORY);
+					if (Directory < 0) return false;
+					auto const Result = (static_cast<OperationT>(Operation.Kind) == OperationT::fsyncdir) ? fsync(Directory) : 0;
+					close(Directory);
+					return Result == 0;
+				}
+				case OperationT::readdir:
+				{
+					if (Operation.Offset != 0) return true;
+					auto const Directory = open(Path.c_str(), O_RDONLY | O_DIRECTORY);
+					if (Directory < 0) return false;
+					long Result;
+					while ((Result = syscall(SYS_getdents64, Directory, Data(32768), 32768)) > 0) {}
+					close(Directory);
+					return Result == 0;
+				}
+				case OperationT::access: return access(Path.c_str(), Operation.Mode) == 0;
+				case OperationT::fallocate:
+					return fallocate(HandleFor(Operation), Operation.Mode, Operation.Offset, Operation.Size) == 0;
+				default:
+					errno = EINVAL;
+					return false;
+			}
+		}
+
+		std::string const Root;
+		bool const Verbose;
+		uint64_t Replayed;
+		uint64_t Differed;
+		std::unordered_map<uint32_t, std::string> Names;
+		std::unordered_map<uint64_t, int> Handles;
+		std::map<uint8_t, TotalT> Totals;
+		std::vector<char> Buffer;
+};
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		bool Verbose = false;
+		std::vector<std::string> Arguments;
+		for (int Index = 1; Index < argc; ++Index)
+		{
+			if (std::string(argv[Index]) == "-v") Verbose = true;
+			else Arguments.push_back(argv[Index]);
+		}
+		if (Arguments.size() != 2) throw UserErrorT() << "Usage: " << argv[0] << " [-v] RECORDING DIRECTORY";
+
+		std::ifstream In(Arguments[0], std::ios::binary);
+		if (!In) throw SystemErrorT() << "Failed to open [" << Arguments[0] << "]";
+		std::vector<char> Bytes((std::istreambuf_iterator<char>(In)), std::istreambuf_iterator<char>());
+		if ((Bytes.size() < RecordFormatT::MagicSize) ||
+			memcmp(Bytes.data(), RecordFormatT::Magic(), RecordFormatT::MagicSize))
+			throw UserErrorT() << "[" << Arguments[0] << "] isn't a clunker recording.";
+
+		auto Root = Arguments[1];
+		while ((Root.size() > 1) && (Root.back() == '/')) Root.pop_back();
+		ReplayT Replay(Root, Verbose);
+
+		std::vector<RecordFormatT::OperationEntryT> Operations;
+		size_t At = RecordFormatT::MagicSize;
+		while (At < Bytes.size())
+		{
+			auto const Type = Bytes[At++];
+			if ((Type == RecordFormatT::Name) && (At + sizeof(RecordFormatT::NameEntryT) <= Bytes.size()))
+			{
+				RecordFormatT::NameEntryT Entry;
+				memcpy(&Entry, Bytes.data() + At, sizeof(Entry));
+				At += sizeof(Entry);
+				if (At + Entry.Length > Bytes.size()) break;
+				Replay.AddName(Entry.ID, std::string(Bytes.data() + At, Entry.Length));
+				At += Entry.Length;
+			}
+			else if ((Type == RecordFormatT::Operation) && (At + sizeof(RecordFormatT::OperationEntryT) <= Bytes.size()))
+			{
+				RecordFormatT::OperationEntryT Entry;
+				memcpy(&Entry, Bytes.data() + At, sizeof(Entry));
+				At += sizeof(Entry);
+				Operations.push_back(Entry);
+			}
+			else
+			{
+				std::cerr << "Stopping at a truncated or unknown entry at byte " << At - 1 << std::endl;
+				break;
+			}
+		}
+		std::stable_sort(Operations.begin(), Operations.end(),
+			[](RecordFormatT::OperationEntryT const &First, RecordFormatT::OperationEntryT const &Second)
+			{ return First.Sequence < Second.Sequence; });
+
+		auto const Start = std::chrono::steady_clock::now();
+		for (auto const &Operation : Operations) Replay.Run(Operation);
+		Replay.Report(std::chrono::steady_clock::now() - Start);
+		return 0;
+	}
+	catch (UserErrorT const &Error)
+	{
+		std::cerr << "Error: " << Error << std::endl;
+		return 1;
+	}
+	catch (SystemErrorT const &Error)
+	{
+		std::cerr << "System error: " << Error << std::endl;
+		return 1;
+	}
+}
@@ -4,6 +4,11 @@
 #include "../asio_utils.h"
 #include "client.h"
 
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <chrono>
+#include <algorithm>
+
 int main(int argc, char **argv)
 {
 	try
@@ -93,15 +98,13 @@ int main(int argc, char **argv)
 				Chain
 					.Add([&Control, &Chain](void) mutable
 					{
-						Control->Clean([&Chain](bool Success)
+						Control->BeginBatch();
+						Control->Clean([](bool Success)
 						{
 							if (!Success) throw SystemErrorT() << "Clean failed - test case may be broken.";
-							Chain.Next();
 						});
-					})
-					.Add([&Control, &Chain](void)
-					{
 						Control->SetOpCount(-1, [&Chain](bool Success) { Chain.Next(); });
+						Control->EndBatch();
 					})
 					.Add([&Control, &Chain, Callback = std::move(Callback)](void) mutable
 					{ 
@@ -231,6 +234,110 @@ int main(int argc, char **argv)
 				// create new file, empty
 				Chain.Next();
 			}))
+			.Add(WrapTest([&TestIndex, &Chain](void) 
+			{ 
+				std::cout << TestIndex++ << " Test directory rename" << std::endl; 
+				auto Dir = Filesystem::PathT::Qualify("old_dir");
+				Dir.CreateDirectory();
+				Filesystem::FileT::OpenWrite(Dir.Enter("inner")).Write("cargo");
+				auto NewDir = Filesystem::PathT::Qualify("new_dir");
+				AssertE(rename(Dir.Render().c_str(), NewDir.Render().c_str()), 0);
+				auto Buffer = Filesystem::FileT::OpenRead(NewDir.Enter("inner")).ReadAll();
+				AssertE(std::string((char const *)&Buffer[0], Buffer.size()), "cargo");
+				try
+				{
+					Filesystem::FileT::OpenRead(Dir.Enter("inner"));
+					Assert(false);
+				}
+				catch (ConstructionErrorT const &Error) {}
+				Chain.Next();
+			}))
+			.Add(WrapTest([&TestIndex, &Chain](void) 
+			{ 
+				std::cout << TestIndex++ << " Test sparse file" << std::endl; 
+				auto Path = Filesystem::PathT::Qualify("sparse");
+				auto File = open(Path.Render().c_str(), O_RDWR | O_CREAT, 0644);
+				off_t const Huge = off_t(1) << 40;
+				AssertE(ftruncate(File, Huge), 0);
+				AssertE(pwrite(File, "page", 4, Huge / 2), 4);
+				struct stat Stat;
+				AssertE(fstat(File, &Stat), 0);
+				AssertE(Stat.st_size, Huge);
+				AssertLT(Stat.st_blocks * 512, 1024 * 1024);
+				std::vector<char> Buffer(4, 1);
+				AssertE(pread(File, &Buffer[0], 4, 12345), 4);
+				AssertE(Buffer, std::vector<char>({0, 0, 0, 0}));
+				AssertE(fallocate(File, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, Huge / 2, 4), 0);
+				AssertE(pread(File, &Buffer[0], 4, Huge / 2), 4);
+				AssertE(Buffer, std::vector<char>({0, 0, 0, 0}));
+				AssertE(fstat(File, &Stat), 0);
+				AssertE(Stat.st_size, Huge);
+				AssertE(Stat.st_blocks, 0);
+				close(File);
+				Chain.Next();
+			}))
+			.Add(WrapTest([&TestIndex, &Chain, &Control](void) 
+			{ 
+				std::cout << TestIndex++ << " Test snapshot restore" << std::endl; 
+				auto Dir = Filesystem::PathT::Qualify("fixture");
+				Dir.CreateDirectory();
+				auto Kept = Dir.Enter("kept");
+				Filesystem::FileT::OpenWrite(Kept).Write("original");
+				auto Removed = Filesystem::PathT::Qualify("removed");
+				Filesystem::FileT::OpenWrite(Removed).Write("still here");
+				auto Added = Dir.Enter("added");
+				auto Read = [](Filesystem::PathT const &Path)
+				{
+					auto Buffer = Filesystem::FileT::OpenRead(Path).ReadAll();
+					return std::string((char const *)&Buffer[0], Buffer.size());
+				};
+				Chain
+					.Add([&Control, &Chain](void)
+					{
+						Control->Snapshot("fixture", [&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Chain, Kept, Removed, Added](void)
+					{
+						Filesystem::FileT::OpenWrite(Kept).Write("changed");
+						AssertE(unlink(Removed.Render().c_str()), 0);
+						Filesystem::FileT::OpenWrite(Added).Write("new");
+						Chain.Next();
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->Restore("fixture", [&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Chain, Kept, Removed, Added, Read](void)
+					{
+						AssertE(Read(Kept), "original");
+						AssertE(Read(Removed), "still here");
+						try
+						{
+							Filesystem::FileT::OpenRead(Added);
+							Assert(false);
+						}
+						catch (ConstructionErrorT const &Error) {}
+						Chain.Next();
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->DropSnapshot("fixture", [&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					;
+				Chain.Next();
+			}))
 			.Add(WrapTest([&TestIndex, &Chain, &Control](void) 
 			{ 
 				std::cout << TestIndex++ << " Test scheduled clunk" << std::endl; 
@@ -270,6 +377,472 @@ int main(int argc, char **argv)
 					;
 				Chain.Next();
 			}))
+			.Add(WrapTest([&TestIndex, &Chain, &Control](void) 
+			{ 
+				std::cout << TestIndex++ << " Test write fault" << std::endl; 
+				auto Path = Filesystem::PathT::Qualify("chicken");
+				Filesystem::FileT::OpenWrite(Path).Write("before");
+				Chain
+					.Add([&Control, &Chain](void)
+					{
+						// The first 4 bytes go through, the next write fails once
+						Control->SetFault("", "write", -1, 4, "ENOSPC", 1, [&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Chain, Path](void)
+					{
+						auto File = open(Path.Render().c_str(), O_WRONLY | O_TRUNC);
+						AssertGTE(File, 0);
+						AssertE(pwrite(File, "frog", 4, 0), 4);
+						AssertE(pwrite(File, "man", 3, 4), -1);
+						AssertE(errno, ENOSPC);
+						AssertE(pwrite(File, "man", 3, 4), 3);
+						close(File);
+						Chain.Next();
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->ClearFaults([&Chain](bool Success) { Chain.Next(); });
+					})
+					;
+				Chain.Next();
+			}))
+			.Add(WrapTest([&TestIndex, &Chain, &Control](void) 
+			{ 
+				std::cout << TestIndex++ << " Test path fault" << std::endl; 
+				auto Dir = Filesystem::PathT::Qualify("wal");
+				Dir.CreateDirectory();
+				auto Inside = Dir.Enter("log");
+				auto Outside = Filesystem::PathT::Qualify("chicken");
+				auto File = std::make_shared<int>(open(Inside.Render().c_str(), O_WRONLY | O_CREAT, 0644));
+				AssertGTE(*File, 0);
+				Chain
+					.Add([&Control, &Chain](void)
+					{
+						// Writes elsewhere don't count towards the rule
+						Control->SetFault("/wal", "write", 2, -1, "EROFS", -1, [&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Chain, File, Outside](void)
+					{
+						for (size_t Count = 0; Count < 10; ++Count)
+							Filesystem::FileT::OpenWrite(Outside).Write("ok");
+						AssertE(pwrite(*File, "frog", 4, 0), 4);
+						AssertE(pwrite(*File, "man", 3, 4), 3);
+						AssertE(pwrite(*File, "eats", 4, 7), -1);
+						AssertE(errno, EROFS);
+						close(*File);
+						Filesystem::FileT::OpenWrite(Outside).Write("still ok");
+						Chain.Next();
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->ClearFaults([&Chain](bool Success) { Chain.Next(); });
+					})
+					;
+				Chain.Next();
+			}))
+			.Add(WrapTest([&TestIndex, &Chain, &Control](void) 
+			{ 
+				std::cout << TestIndex++ << " Test seeded fault rate" << std::endl; 
+				auto Path = Filesystem::PathT::Qualify("chicken");
+				Filesystem::FileT::OpenWrite(Path).Write("");
+				// Which of the writes failed, for each run
+				auto Runs = std::make_shared<std::vector<std::vector<bool>>>();
+				auto const Run = [&Control, &Chain, Path, Runs](void)
+				{
+					Chain
+						.Add([&Control, &Chain](void)
+						{
+							Control->SetFaultRate(42, {{"write", 0.3}}, "EIO", [&Chain](int64_t Seed) 
+							{ 
+								AssertE(Seed, 42);
+								Chain.Next(); 
+							});
+						})
+						.Add([&Chain, Path, Runs](void)
+						{
+							auto File = open(Path.Render().c_str(), O_WRONLY);
+							AssertGTE(File, 0);
+							std::vector<bool> Failed;
+							for (size_t Count = 0; Count < 64; ++Count)
+							{
+								auto const Written = pwrite(File, "frog", 4, Count * 4);
+								if (Written < 0) AssertE(errno, EIO);
+								Failed.push_back(Written < 0);
+							}
+							close(File);
+							Runs->push_back(std::move(Failed));
+							Chain.Next();
+						});
+				};
+				Run();
+				Run();
+				Chain
+					.Add([&Control, &Chain, Runs](void)
+					{
+						// The same seed fails the same writes, and the log
+						// lists them by index
+						AssertE(Runs->size(), 2u);
+						Assert((*Runs)[0] == (*Runs)[1]);
+						auto const Failures = std::count((*Runs)[1].begin(), (*Runs)[1].end(), true);
+						AssertGT(Failures, 0);
+						AssertLT(Failures, 64);
+						Control->GetFaultLog([&Chain, Runs, Failures](std::vector<std::pair<std::string, int64_t>> const &Log)
+						{
+							AssertE(static_cast<int64_t>(Log.size()), Failures);
+							for (auto const &Failure : Log)
+							{
+								AssertE(Failure.first, "write");
+								Assert((*Runs)[1][Failure.second]);
+							}
+							Chain.Next();
+						});
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->ClearFaults([&Chain](bool Success) { Chain.Next(); });
+					})
+					;
+				Chain.Next();
+			}))
+			.Add(WrapTest([&TestIndex, &Chain, &Control](void) 
+			{ 
+				std::cout << TestIndex++ << " Test process filter" << std::endl; 
+				auto Path = Filesystem::PathT::Qualify("chicken");
+				Chain
+					.Add([&Control, &Chain](void)
+					{
+						// This process and its children are watched, and with
+						// the count at 0 nothing they do can succeed
+						Control->SetProcessFilter({}, {getpid()}, [&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->SetOpCount(0, [&Chain](bool Success) { Chain.Next(); });
+					})
+					.Add([&Chain, Path](void)
+					{
+						auto Child = fork();
+						if (Child == 0)
+						{
+							auto File = open(Path.Render().c_str(), O_WRONLY | O_CREAT, 0644);
+							_exit(File < 0 ? 0 : 1);
+						}
+						int Status = -1;
+						AssertE(waitpid(Child, &Status, 0), Child);
+						AssertE(WEXITSTATUS(Status), 0);
+						Chain.Next();
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->SetProcessFilter({getpid() + 1000000}, {}, [&Chain](bool Success) { Chain.Next(); });
+					})
+					.Add([&Chain, Path](void)
+					{
+						// This process isn't watched, so the count doesn't stop it
+						Filesystem::FileT::OpenWrite(Path).Write("unwatched");
+						Chain.Next();
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->ClearProcessFilter([&Chain](bool Success) { Chain.Next(); });
+					})
+					;
+				Chain.Next();
+			}))
+			.Add(WrapTest([&TestIndex, &Chain, &Control](void) 
+			{ 
+				std::cout << TestIndex++ << " Test latency" << std::endl; 
+				auto Path = Filesystem::PathT::Qualify("chicken");
+				Filesystem::FileT::OpenWrite(Path).Write("slow");
+				Chain
+					.Add([&Control, &Chain](void)
+					{
+						Control->SetLatency("", "fsync", 0.2, 0, [&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Chain, Path](void)
+					{
+						auto File = open(Path.Render().c_str(), O_RDWR);
+						AssertGTE(File, 0);
+						auto const Start = std::chrono::steady_clock::now();
+						AssertE(fsync(File), 0);
+						std::chrono::duration<double> const Elapsed = std::chrono::steady_clock::now() - Start;
+						AssertGTE(Elapsed.count(), 0.2);
+						// Only fsync is delayed
+						auto const ReadStart = std::chrono::steady_clock::now();
+						char Buffer[4];
+						AssertE(pread(File, Buffer, 4, 0), 4);
+						std::chrono::duration<double> const ReadElapsed = std::chrono::steady_clock::now() - ReadStart;
+						AssertLT(ReadElapsed.count(), 0.2);
+						close(File);
+						Chain.Next();
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->ClearLatency([&Chain](bool Success) { Chain.Next(); });
+					})
+					;
+				Chain.Next();
+			}))
+			.Add(WrapTest([&TestIndex, &Chain, &Control](void) 
+			{ 
+				std::cout << TestIndex++ << " Test short write" << std::endl; 
+				auto Path = Filesystem::PathT::Qualify("stub");
+				auto Written = std::make_shared<ssize_t>(0);
+				Chain
+					.Add([&Control, &Chain](void)
+					{
+						Control->SetPartialFault("write", -1, "short", 7, 1, [&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Chain, Path, Written](void)
+					{
+						auto File = open(Path.Render().c_str(), O_RDWR | O_CREAT, 0666);
+						AssertGTE(File, 0);
+						*Written = pwrite(File, "abcdefgh", 8, 0);
+						AssertGT(*Written, 0);
+						AssertLT(*Written, 8);
+						// The rule only cuts one write short
+						AssertE(pwrite(File, "abcdefgh", 8, 0), 8);
+						close(File);
+						Chain.Next();
+					})
+					.Add([&Control, &Chain, Written](void)
+					{
+						Control->GetSplitLog([&Chain, Written](std::vector<ClunkerControlT::SplitT> const &Splits) 
+						{ 
+							AssertE(Splits.size(), 1u);
+							AssertE(Splits[0].Operation, "write");
+							AssertE(Splits[0].Length, 8);
+							AssertE(Splits[0].Kept.size(), 1u);
+							AssertE(Splits[0].Kept[0].second, *Written);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->ClearFaults([&Chain](bool Success) { Chain.Next(); });
+					})
+					;
+				Chain.Next();
+			}))
+			.Add(WrapTest([&TestIndex, &Chain, &Control](void) 
+			{ 
+				std::cout << TestIndex++ << " Test crash" << std::endl; 
+				auto Synced = Filesystem::PathT::Qualify("ledger");
+				auto Unsynced = Filesystem::PathT::Qualify("scratch");
+				Chain
+					.Add([&Control, &Chain](void)
+					{
+						Control->TrackDurability(true, [&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Chain, Synced, Unsynced](void)
+					{
+						auto File = open(Synced.Render().c_str(), O_RDWR | O_CREAT, 0666);
+						AssertGTE(File, 0);
+						AssertE(pwrite(File, "kept", 4, 0), 4);
+						AssertE(fsync(File), 0);
+						auto Directory = open(".", O_RDONLY | O_DIRECTORY);
+						AssertGTE(Directory, 0);
+						AssertE(fsync(Directory), 0);
+						close(Directory);
+						// Neither of these is synced
+						AssertE(pwrite(File, "lost", 4, 0), 4);
+						close(File);
+						Filesystem::FileT::OpenWrite(Unsynced).Write("gone");
+						Chain.Next();
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->Crash(1, 0, false, [&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Chain, Synced, Unsynced](void)
+					{
+						auto File = open(Synced.Render().c_str(), O_RDONLY);
+						AssertGTE(File, 0);
+						char Buffer[4];
+						AssertE(pread(File, Buffer, 4, 0), 4);
+						AssertE(std::string(Buffer, 4), "kept");
+						close(File);
+						try
+						{
+							Filesystem::FileT::OpenRead(Unsynced);
+							Assert(false);
+						}
+						catch (ConstructionErrorT const &Error) {}
+						Chain.Next();
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->TrackDurability(false, [&Chain](bool Success) { Chain.Next(); });
+					})
+					;
+				Chain.Next();
+			}))
+			.Add(WrapTest([&TestIndex, &Chain, &Control](void) 
+			{ 
+				std::cout << TestIndex++ << " Test stats" << std::endl; 
+				auto Path = Filesystem::PathT::Qualify("tally");
+				Chain
+					.Add([&Control, &Chain](void)
+					{
+						Control->ResetStats([&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Chain, Path](void)
+					{
+						auto File = open(Path.Render().c_str(), O_RDWR | O_CREAT, 0666);
+						AssertGTE(File, 0);
+						for (size_t Index = 0; Index < 10; ++Index) AssertE(pwrite(File, "tick", 4, Index * 4), 4);
+						close(File);
+						Chain.Next();
+					})
+					.Add([&Control, &Chain](void)
+					{
+						Control->GetStats([&Chain](std::map<std::string, ClunkerControlT::OperationStatsT> const &Stats) 
+						{ 
+							// Low-level mounts write through write_buf
+							auto Found = Stats.find("write_buf");
+							if (Found == Stats.end()) Found = Stats.find("write");
+							Assert(Found != Stats.end());
+							AssertE(Found->second.Count, 10);
+							AssertE(Found->second.Errors, 0);
+							AssertGT(Found->second.Run.Total, 0);
+							AssertGTE(Found->second.Run.Max, Found->second.Run.P50);
+							Chain.Next(); 
+						});
+					})
+					;
+				Chain.Next();
+			}))
+			.Add(WrapTest([&TestIndex, &Chain, &Control, &Root](void) 
+			{ 
+				std::cout << TestIndex++ << " Test recording" << std::endl; 
+				// The recording has to be outside the mount
+				auto const Recording = Root.Render() + ".recording";
+				auto Path = Filesystem::PathT::Qualify("taped");
+				Chain
+					.Add([&Control, &Chain, Recording](void)
+					{
+						Control->RecordStart(Recording, true, [&Chain](bool Success) 
+						{ 
+							Assert(Success);
+							Chain.Next(); 
+						});
+					})
+					.Add([&Chain, Path](void)
+					{
+						auto File = open(Path.Render().c_str(), O_RDWR | O_CREAT, 0666);
+						AssertGTE(File, 0);
+						AssertE(pwrite(File, "reel", 4, 0), 4);
+						close(File);
+						AssertE(unlink(Path.Render().c_str()), 0);
+						Chain.Next();
+					})
+					.Add([&Control, &Chain, Recording](void)
+					{
+						Control->RecordStop([&Chain, Recording](int64_t Count) 
+						{ 
+							// At least the create, write, release and unlink
+							AssertGTE(Count, 4);
+							struct stat Stat;
+							AssertE(stat(Recording.c_str(), &Stat), 0);
+							AssertGT(Stat.st_size, 8);
+							unlink(Recording.c_str());
+							Chain.Next(); 
+						});
+					})
+					;
+				Chain.Next();
+			}))
+			.Add(WrapTest([&TestIndex, &Chain, &Control](void) 
+			{ 
+				std::cout << TestIndex++ << " Test batch" << std::endl; 
+				auto Path = Filesystem::PathT::Qualify("bundle");
+				auto Replies = std::make_shared<std::vector<std::string>>();
+				Chain
+					.Add([&Control, &Chain, Replies](void)
+					{
+						// Answered in order, in one reply
+						Control->BeginBatch();
+						Control->Snapshot("bundle", [Replies](bool Success) 
+						{ 
+							Assert(Success);
+							Replies->push_back("snapshot");
+						});
+						Control->SetOpCount(3, [Replies](bool Success) 
+						{ 
+							Assert(Success);
+							Replies->push_back("set");
+						});
+						Control->GetOpCount([&Chain, Replies](int64_t Count) 
+						{ 
+							AssertE(Count, 3);
+							Replies->push_back("get");
+							Chain.Next(); 
+						});
+						Control->EndBatch();
+					})
+					.Add([&Control, &Chain, Replies](void)
+					{
+						AssertE(*Replies, std::vector<std::string>({"snapshot", "set", "get"}));
+						// Sent without waiting for the replies to earlier commands
+						Control->SetOpCount(-1, [Replies](bool Success) { Replies->push_back("unset"); });
+						Control->GetOpCount([&Chain, Replies](int64_t Count) 
+						{ 
+							AssertE(Count, -1);
+							AssertE(Replies->back(), std::string("unset"));
+							Chain.Next(); 
+						});
+					})
+					.Add([&Control, &Chain, Path, Replies](void)
+					{
+						Filesystem::FileT::OpenWrite(Path).Write("knot");
+						Control->Restore("bundle", [Replies](bool Success) 
+						{ 
+							Assert(Success);
+							Replies->push_back("restore");
+						});
+						Control->DropSnapshot("bundle", [&Chain, Path, Replies](bool Success) 
+						{ 
+							Assert(Success);
+							AssertE(Replies->back(), std::string("restore"));
+							AssertNE(access(Path.Render().c_str(), F_OK), 0);
+							Chain.Next(); 
+						});
+					})
+					;
+				Chain.Next();
+			}))
 			.Add(WrapTest([&TestIndex, &Chain](void) 
 			{ 
 				std::cout << TestIndex++ << " Read all valid" << std::endl; 
@@ -0,0 +1,252 @@
+#ifndef trace_h
+#define trace_h
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "../ren-cxx-basics/error.h"
+#include "record_ring.h"
+#include "stats.h"
+#include "log.h"
+
+// Spans for each filesystem operation, picked at compile time through the
+// TracerT argument of FuseT.  NoTraceT compiles to nothing.  TraceT records
+// each span into a ring of the thread serving it, and a background thread
+// appends the rings to a binary file, which clunker_trace converts to Chrome
+// trace events afterwards.
+
+// A span as stored: the header, then the operation name, then the path
+struct TraceRecordT
+{
+	// A function rather than an array, so no definition is needed outside the
+	// class
+	static char const *Magic(void) { return "clunktr1"; }
+	static constexpr size_t MagicSize = 8;
+
+	enum : uint8_t
+	{
+		// The failure countdown ran out on this operation
+		Tripped = 1 << 0,
+		// Injected latency held the operation back
+		Delayed = 1 << 1,
+	};
+
+	uint16_t Length;
+	uint8_t Flags;
+	uint8_t NameLength;
+	int32_t Result;
+	uint32_t Pid;
+	uint32_t Thread;
+	// Nanoseconds on the steady clock
+	uint64_t Start;
+	uint64_t Duration;
+	uint64_t Bytes;
+};
+
+// What's known about the operation being served, filled in by the filesystem
+// as it finds out
+struct TraceSpanT
+{
+	static constexpr size_t PathLimit = 1024;
+
+	StatsT::ClockT::time_point Start;
+	char const *Name = nullptr;
+	pid_t Pid = 0;
+	uint8_t Flags = 0;
+	bool Located = false;
+	uint64_t Bytes = 0;
+	uint16_t PathLength = 0;
+	char Path[PathLimit];
+
+	void SetPath(std::string const &Path)
+	{
+		PathLength = std::min<size_t>(Path.size(), static_cast<size_t>(PathLimit));
+		memcpy(this->Path, Path.data(), PathLength);
+	}
+};
+
+// The span of the request being served on this thread, or null when tracing
+// is off
+inline TraceSpanT *&CurrentSpan(void)
+{
+	static thread_local TraceSpanT *Span = nullptr;
+	return Span;
+}
+
+struct NoTraceT
+{
+	static constexpr bool Enabled = false;
+
+	struct SpanT {};
+
+	static void Start(void) {}
+	static void Begin(SpanT &, char const *, pid_t) {}
+	static void Resume(SpanT &) {}
+	static void Suspend(void) {}
+	template <typename ResultT> static void End(SpanT &, ResultT const &) {}
+};
+
+struct TraceT
+{
+	static constexpr bool Enabled = true;
+
+	typedef TraceSpanT SpanT;
+
+	// Opens the trace file, before anything is mounted
+	static void Start(void) { Writer(); }
+
+	static void Begin(SpanT &Span, char const *Name, pid_t Pid)
+	{
+		Span.Start = StatsT::ClockT::now();
+		Span.Name = Name;
+		Span.Pid = Pid;
+		CurrentSpan() = &Span;
+	}
+
+	// Continues a span on another thread, after injected latency
+	static void Resume(SpanT &Span)
+	{
+		Span.Flags |= TraceRecordT::Delayed;
+		CurrentSpan() = &Span;
+	}
+
+	static void Suspend(void) { CurrentSpan() = nullptr; }
+
+	template <typename ResultT> static void End(SpanT &Span, ResultT const &Result)
+	{
+		CurrentSpan() = nullptr;
+		Writer().Write(Span, ResultOf(Result), StatsT::ClockT::now());
+	}
+
+	private:
+		template <typename ResultT> static int32_t ResultOf(ResultT const &) { return 0; }
+		static int32_t ResultOf(int Result) { return Result; }
+
+		struct WriterT
+		{
+			WriterT(void) : Die(false)
+			{
+				std::string Path = "clunker.trace";
+				if (getenv("CLUNKER_TRACE_FILE")) Path = getenv("CLUNKER_TRACE_FILE");
+				File = open(Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+				if (File < 0) throw SystemErrorT() << "Failed to open trace file [" << Path << "]: " << strerror(errno);
+				Output.append(TraceRecordT::Magic(), TraceRecordT::MagicSize);
+				Thread = std::thread([this](void) { Run(); });
+			}
+
+			WriterT(WriterT const &) = delete;
+
+			~WriterT(void)
+			{
+				{
+					std::lock_guard<std::mutex> Guard(Mutex);
+					Die = true;
+				}
+				Condition.notify_all();
+				Thread.join();
+				close(File);
+			}
+
+			void Write(SpanT const &Span, int32_t Result, StatsT::ClockT::time_point End)
+			{
+				static thread_local uint32_t const ThreadID = syscall(SYS_gettid);
+				auto const NameLength = std::min<size_t>(strlen(Span.Name), 255);
+				auto const PathLength = std::min<size_t>(Span.PathLength,
+					RecordRingT::MaxRecord - sizeof(TraceRecordT) - NameLength);
+				char Record[RecordRingT::MaxRecord];
+				TraceRecordT Header;
+				Header.Length = sizeof(Header) + NameLength + PathLength;
+				Header.Flags = Span.Flags;
+				Header.NameLength = NameLength;
+				Header.Result = Result;
+				Header.Pid = Span.Pid;
+				Header.Thread = ThreadID;
+				Header.Start = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					Span.Start.time_since_epoch()).count();
+				Header.Duration = std::chrono::duration_cast<std::chrono::nanoseconds>(End - Span.Start).count();
+				Header.Bytes = Span.Bytes;
+				memcpy(Record, &Header, sizeof(Header));
+				memcpy(Record + sizeof(Header), Span.Name, NameLength);
+				memcpy(Record + sizeof(Header) + NameLength, Span.Path, PathLength);
+				auto &Ring = this->Ring();
+				Ring.Push(Record, Header.Length);
+				if (Ring.Used() > RecordRingT::Size / 2) Condition.notify_one();
+			}
+
+			private:
+				struct HolderT
+				{
+					std::shared_ptr<RecordRingT> Ring;
+					~HolderT(void) { if (Ring) Ring->Orphaned = true; }
+				};
+
+				RecordRingT &Ring(void)
+				{
+					static thread_local HolderT Holder;
+					if (!Holder.Ring) Holder.Ring = Rings.Add();
+					return *Holder.Ring;
+				}
+
+				void Run(void)
+				{
+					std::unique_lock<std::mutex> Guard(Mutex);
+					while (!Die)
+					{
+						Condition.wait_for(Guard, std::chrono::milliseconds(100));
+						Guard.unlock();
+						Drain();
+						Guard.lock();
+					}
+					Guard.unlock();
+					Drain();
+				}
+
+				// On the writer thread only, without the mutex
+				void Drain(void)
+				{
+					for (auto const &Ring : Rings.Take())
+					{
+						Ring->Drain([&](char const *Record, size_t Length) { Output.append(Record, Length); });
+						auto const Dropped = Ring->Dropped.exchange(0, std::memory_order_relaxed);
+						if (Dropped) LOG(Warning, Dropped << " trace spans dropped");
+					}
+					size_t Done = 0;
+					while (Done < Output.size())
+					{
+						auto const Written = ::write(File, Output.data() + Done, Output.size() - Done);
+						if (Written <= 0) break;
+						Done += Written;
+					}
+					Output.clear();
+				}
+
+				std::mutex Mutex;
+				std::condition_variable Condition;
+				bool Die;
+				RingListT Rings;
+				std::string Output;
+				int File;
+				std::thread Thread;
+		};
+
+		static WriterT &Writer(void)
+		{
+			static WriterT Writer;
+			return Writer;
+		}
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include "../ren-cxx-basics/error.h"
+#include "trace.h"
+
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <limits>
+
+// Converts a trace written by a clunker built with CLUNKER_TRACE into Chrome
+// trace event JSON, as loaded by chrome://tracing and Perfetto.  Spans are
+// grouped by the process that made the request and the thread that served
+// it.
+
+void WriteString(std::ostream &Out, std::string const &Text)
+{
+	Out << '"';
+	for (auto const Character : Text)
+	{
+		switch (Character)
+		{
+			case '"': Out << "\\\""; break;
+			case '\\': Out << "\\\\"; break;
+			case '\n': Out << "\\n"; break;
+			default:
+				if (static_cast<unsigned char>(Character) < 0x20)
+					Out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(Character) << std::dec;
+				else Out << Character;
+		}
+	}
+	Out << '"';
+}
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		if (argc < 2) throw UserErrorT() << "Usage: " << argv[0] << " TRACE [OUTPUT]";
+		std::ifstream In(argv[1], std::ios::binary);
+		if (!In) throw SystemErrorT() << "Failed to open [" << argv[1] << "]";
+		std::vector<char> Bytes((std::istreambuf_iterator<char>(In)), std::istreambuf_iterator<char>());
+
+		if ((Bytes.size() < TraceRecordT::MagicSize) ||
+			memcmp(Bytes.data(), TraceRecordT::Magic(), TraceRecordT::MagicSize))
+			throw UserErrorT() << "[" << argv[1] << "] isn't a clunker trace.";
+
+		std::ofstream OutFile;
+		if (argc >= 3)
+		{
+			OutFile.open(argv[2]);
+			if (!OutFile) throw SystemErrorT() << "Failed to open [" << argv[2] << "]";
+		}
+		std::ostream &Out = (argc >= 3) ? OutFile : std::cout;
+
+		// Times are shown from the first span on
+		uint64_t Origin = std::numeric_limits<uint64_t>::max();
+		for (size_t At = TraceRecordT::MagicSize; At + sizeof(TraceRecordT) <= Bytes.size();)
+		{
+			TraceRecordT Header;
+			memcpy(&Header, Bytes.data() + At, sizeof(Header));
+			if (Header.Length < sizeof(Header)) break;
+			Origin = std::min(Origin, Header.Start);
+			At += Header.Length;
+		}
+
+		Out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+		Out << std::fixed << std::setprecision(3);
+		size_t At = TraceRecordT::MagicSize;
+		size_t Count = 0;
+		while (At + sizeof(TraceRecordT) <= Bytes.size())
+		{
+			TraceRecordT Header;
+			memcpy(&Header, Bytes.data() + At, sizeof(Header));
+			if ((Header.Length < sizeof(Header) + Header.NameLength) || (At + Header.Length > Bytes.size()))
+			{
+				std::cerr << "Stopping at a truncated span at byte " << At << std::endl;
+				break;
+			}
+			auto const Text = Bytes.data() + At + sizeof(Header);
+			std::string const Name(Text, Header.NameLength);
+			std::string const Path(Text + Header.NameLength, Header.Length - sizeof(Header) - Header.NameLength);
+			At += Header.Length;
+
+			if (Count++) Out << ",\n";
+			Out << "{\"name\":";
+			WriteString(Out, Name);
+			Out << ",\"cat\":\"fs\",\"ph\":\"X\""
+				<< ",\"ts\":" << (Header.Start - Origin) / 1000.0
+				<< ",\"dur\":" << Header.Duration / 1000.0
+				<< ",\"pid\":" << Header.Pid
+				<< ",\"tid\":" << Header.Thread
+				<< ",\"args\":{\"path\":";
+			WriteString(Out, Path);
+			Out << ",\"result\":" << Header.Result
+				<< ",\"bytes\":" << Header.Bytes
+				<< ",\"tripped\":" << ((Header.Flags & TraceRecordT::Tripped) ? "true" : "false")
+				<< ",\"delayed\":" << ((Header.Flags & TraceRecordT::Delayed) ? "true" : "false")
+				<< "}}";
+		}
+		Out << "\n]}\n";
+		std::cerr << "Converted " << Count << " spans" << std::endl;
+		return 0;
+	}
+	catch (UserErrorT const &Error)
+	{
+		std::cerr << "Error: " << Error << std::endl;
+		return 1;
+	}
+	catch (SystemErrorT const &Error)
+	{
+		std::cerr << "System error: " << Error << std::endl;
+		return 1;
+	}
+}